@@ -26,6 +26,7 @@
 /* GLib types are part of the API */
 #include <glib.h>
 
+#include "calibrate.h"
 #include "cfg.h"
 #include "cmdline.h"
 #include "config.h"
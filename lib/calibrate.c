@@ -0,0 +1,507 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "calibrate.h"
+#include "cfg.h"
+#include "utilities.h"
+
+/* size of the scratch file; large enough that the drive's own cache
+ * does not hold a significant part of it */
+#define RM_CALIBRATE_FILE_SIZE (256 * 1024 * 1024)
+
+/* bytes read for each sequential read size measured */
+#define RM_CALIBRATE_SEQ_BYTES (64 * 1024 * 1024)
+
+/* sequential read sizes measured: 4K, 16K, ..., 4M */
+#define RM_CALIBRATE_MIN_READ_SIZE (4 * 1024)
+#define RM_CALIBRATE_MAX_READ_SIZE (4 * 1024 * 1024)
+
+/* number of random 4K reads to average the latency over */
+#define RM_CALIBRATE_RANDOM_READS (256)
+#define RM_CALIBRATE_RANDOM_READ_SIZE (4 * 1024)
+
+/* concurrent readers measured: 1, 2, 4, ..., 32; each run does
+ * RM_CALIBRATE_QD_READS random reads of RM_CALIBRATE_QD_READ_SIZE in total */
+#define RM_CALIBRATE_MAX_QUEUE_DEPTH (32)
+#define RM_CALIBRATE_QD_READS (1024)
+#define RM_CALIBRATE_QD_READ_SIZE (64 * 1024)
+
+/* settings are the smallest ones that reach this fraction of the best rate */
+#define RM_CALIBRATE_GOOD_ENOUGH (0.9)
+
+/* limits for the settings derived from a profile */
+#define RM_CALIBRATE_MAX_READ_BUF_LEN (1024 * 1024)
+#define RM_CALIBRATE_SWEEP_SECONDS (8)
+#define RM_CALIBRATE_MIN_SWEEP_SIZE ((RmOff)64 * 1024 * 1024)
+#define RM_CALIBRATE_MAX_SWEEP_SIZE ((RmOff)4 * 1024 * 1024 * 1024)
+
+/* the first hash increment should cost no more than 1/CHEAP of a seek
+ * (compare SHRED_BALANCED_PAGES in shredder.c) */
+#define RM_CALIBRATE_CHEAP (64)
+#define RM_CALIBRATE_MIN_BALANCED_BYTES (4 * 1024)
+#define RM_CALIBRATE_MAX_BALANCED_BYTES (1024 * 1024)
+
+#define RM_CALIBRATE_GROUP "profile"
+
+//////////////////////////////
+//     PROFILE STORAGE      //
+//////////////////////////////
+
+static char *rm_calibrate_profile_path(const char *disk_name) {
+    /* nfs servers and unknown devices may have slashes in their name */
+    char *name = g_strdelimit(g_strdup(disk_name), "/:\\", '_');
+    char *file_name = g_strdup_printf("%s.profile", name);
+    char *path =
+        g_build_filename(g_get_user_config_dir(), "rmlint", "devices", file_name, NULL);
+
+    g_free(file_name);
+    g_free(name);
+    return path;
+}
+
+/* Model of the disk, used to notice that a name now refers to a different
+ * disk (sdX names are not stable across boots). Empty if unknown. */
+static char *rm_calibrate_disk_model(const char *disk_name) {
+    char *model = NULL;
+    char *sys_path = g_strdup_printf("/sys/block/%s/device/model", disk_name);
+
+    if(!g_file_get_contents(sys_path, &model, NULL, NULL)) {
+        model = g_strdup("");
+    }
+
+    g_free(sys_path);
+    return g_strstrip(model);
+}
+
+bool rm_calibrate_load_profile(const char *disk_name, RmDeviceProfile *profile) {
+    char *path = rm_calibrate_profile_path(disk_name);
+    GKeyFile *key_file = g_key_file_new();
+    bool result = false;
+
+    if(!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)) {
+        goto cleanup;
+    }
+
+    char *model = g_key_file_get_string(key_file, RM_CALIBRATE_GROUP, "model", NULL);
+    char *disk_model = rm_calibrate_disk_model(disk_name);
+    bool same_disk = model && g_strcmp0(model, disk_model) == 0;
+    g_free(disk_model);
+    g_free(model);
+
+    if(!same_disk) {
+        rm_log_debug_line("Ignoring profile %s: made for a different disk", path);
+        goto cleanup;
+    }
+
+    profile->seq_read_rate =
+        g_key_file_get_double(key_file, RM_CALIBRATE_GROUP, "seq_read_rate", NULL);
+    profile->random_latency_us =
+        g_key_file_get_double(key_file, RM_CALIBRATE_GROUP, "random_latency_us", NULL);
+    profile->read_size =
+        g_key_file_get_uint64(key_file, RM_CALIBRATE_GROUP, "read_size", NULL);
+    profile->queue_depth =
+        g_key_file_get_integer(key_file, RM_CALIBRATE_GROUP, "queue_depth", NULL);
+
+    result = profile->seq_read_rate > 0 && profile->random_latency_us > 0 &&
+             profile->read_size > 0 && profile->queue_depth > 0;
+    if(!result) {
+        rm_log_warning_line(_("Ignoring invalid device profile %s"), path);
+    }
+
+cleanup:
+    g_key_file_free(key_file);
+    g_free(path);
+    return result;
+}
+
+static bool rm_calibrate_save_profile(const char *disk_name, RmDeviceProfile *profile,
+                                      GArray *seq_rates, GArray *qd_rates) {
+    char *path = rm_calibrate_profile_path(disk_name);
+    char *dir = g_path_get_dirname(path);
+    char *model = rm_calibrate_disk_model(disk_name);
+    GKeyFile *key_file = g_key_file_new();
+    GError *error = NULL;
+
+    g_key_file_set_string(key_file, RM_CALIBRATE_GROUP, "disk", disk_name);
+    g_key_file_set_string(key_file, RM_CALIBRATE_GROUP, "model", model);
+    g_key_file_set_double(key_file, RM_CALIBRATE_GROUP, "seq_read_rate",
+                          profile->seq_read_rate);
+    g_key_file_set_double(key_file, RM_CALIBRATE_GROUP, "random_latency_us",
+                          profile->random_latency_us);
+    g_key_file_set_uint64(key_file, RM_CALIBRATE_GROUP, "read_size", profile->read_size);
+    g_key_file_set_integer(key_file, RM_CALIBRATE_GROUP, "queue_depth",
+                           profile->queue_depth);
+
+    /* the raw curves; not used by rmlint itself but handy to compare disks */
+    g_key_file_set_double_list(key_file, RM_CALIBRATE_GROUP, "seq_read_rate_by_size",
+                               (gdouble *)seq_rates->data, seq_rates->len);
+    g_key_file_set_double_list(key_file, RM_CALIBRATE_GROUP,
+                               "random_read_rate_by_queue_depth",
+                               (gdouble *)qd_rates->data, qd_rates->len);
+
+    bool result = false;
+    if(g_mkdir_with_parents(dir, 0755) != 0) {
+        rm_log_perrorf(_("calibrate: cannot create %s"), dir);
+    } else if(!g_key_file_save_to_file(key_file, path, &error)) {
+        rm_log_error_line(_("calibrate: cannot write %s: %s"), path, error->message);
+        g_error_free(error);
+    } else {
+        fprintf(stdout, _("Profile written to %s\n"), path);
+        result = true;
+    }
+
+    g_key_file_free(key_file);
+    g_free(model);
+    g_free(dir);
+    g_free(path);
+    return result;
+}
+
+//////////////////////////////
+//       MEASUREMENTS       //
+//////////////////////////////
+
+/* Make sure the next reads actually go to the disk */
+static void rm_calibrate_drop_cache(int fd) {
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+}
+
+static bool rm_calibrate_write_scratch(int fd) {
+    const gsize buf_len = RM_CALIBRATE_MAX_READ_SIZE;
+    guint32 *buf = g_malloc(buf_len);
+
+    /* random data, so that compressing or deduplicating filesystems
+     * can't take a shortcut */
+    for(gsize i = 0; i < buf_len / sizeof(guint32); ++i) {
+        buf[i] = g_random_int();
+    }
+
+    bool result = true;
+    for(RmOff written = 0; written < RM_CALIBRATE_FILE_SIZE && result;) {
+        ssize_t n = write(fd, buf, buf_len);
+        if(n <= 0 || rm_session_was_aborted()) {
+            result = false;
+        } else {
+            written += n;
+            buf[0]++;
+        }
+    }
+
+    g_free(buf);
+    return result && fsync(fd) == 0;
+}
+
+/* Read RM_CALIBRATE_SEQ_BYTES from the start of fd in chunks of read_size;
+ * returns the rate in bytes/sec */
+static gdouble rm_calibrate_sequential(int fd, char *buf, gsize read_size) {
+    rm_calibrate_drop_cache(fd);
+
+    gint64 start = g_get_monotonic_time();
+    RmOff total = 0;
+    while(total < RM_CALIBRATE_SEQ_BYTES && !rm_session_was_aborted()) {
+        ssize_t n = pread(fd, buf, read_size, total);
+        if(n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+    return total * (gdouble)G_USEC_PER_SEC / elapsed;
+}
+
+/* Mean latency of a random aligned 4K read in microseconds */
+static gdouble rm_calibrate_random_latency(int fd, char *buf) {
+    const guint32 slots = RM_CALIBRATE_FILE_SIZE / RM_CALIBRATE_RANDOM_READ_SIZE;
+    rm_calibrate_drop_cache(fd);
+
+    gint64 start = g_get_monotonic_time();
+    guint reads = 0;
+    for(; reads < RM_CALIBRATE_RANDOM_READS && !rm_session_was_aborted(); ++reads) {
+        RmOff offset = (RmOff)g_random_int_range(0, slots) * RM_CALIBRATE_RANDOM_READ_SIZE;
+        if(pread(fd, buf, RM_CALIBRATE_RANDOM_READ_SIZE, offset) <= 0) {
+            break;
+        }
+    }
+    return (gdouble)(g_get_monotonic_time() - start) / MAX(reads, 1);
+}
+
+typedef struct RmCalibrateReader {
+    int fd;
+    guint reads;
+    guint32 seed;
+    RmOff bytes_read;
+} RmCalibrateReader;
+
+static gpointer rm_calibrate_reader(RmCalibrateReader *reader) {
+    const guint32 slots = RM_CALIBRATE_FILE_SIZE / RM_CALIBRATE_QD_READ_SIZE;
+    char *buf = g_malloc(RM_CALIBRATE_QD_READ_SIZE);
+    GRand *rand = g_rand_new_with_seed(reader->seed);
+
+    for(guint i = 0; i < reader->reads && !rm_session_was_aborted(); ++i) {
+        RmOff offset = (RmOff)g_rand_int_range(rand, 0, slots) * RM_CALIBRATE_QD_READ_SIZE;
+        ssize_t n = pread(reader->fd, buf, RM_CALIBRATE_QD_READ_SIZE, offset);
+        if(n <= 0) {
+            break;
+        }
+        reader->bytes_read += n;
+    }
+
+    g_rand_free(rand);
+    g_free(buf);
+    return NULL;
+}
+
+/* Random read rate in bytes/sec with queue_depth concurrent readers */
+static gdouble rm_calibrate_queue_depth(int fd, gint queue_depth) {
+    RmCalibrateReader readers[RM_CALIBRATE_MAX_QUEUE_DEPTH];
+    GThread *threads[RM_CALIBRATE_MAX_QUEUE_DEPTH];
+    g_assert(queue_depth <= RM_CALIBRATE_MAX_QUEUE_DEPTH);
+
+    rm_calibrate_drop_cache(fd);
+
+    gint64 start = g_get_monotonic_time();
+    for(gint i = 0; i < queue_depth; ++i) {
+        readers[i].fd = fd;
+        readers[i].reads = RM_CALIBRATE_QD_READS / queue_depth;
+        readers[i].seed = g_random_int();
+        readers[i].bytes_read = 0;
+        threads[i] = g_thread_new("calibrate", (GThreadFunc)rm_calibrate_reader, &readers[i]);
+    }
+
+    RmOff total = 0;
+    for(gint i = 0; i < queue_depth; ++i) {
+        g_thread_join(threads[i]);
+        total += readers[i].bytes_read;
+    }
+
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+    return total * (gdouble)G_USEC_PER_SEC / elapsed;
+}
+
+/* Index of the first rate that is close enough to the best one */
+static guint rm_calibrate_good_enough(GArray *rates) {
+    gdouble best = 0;
+    for(guint i = 0; i < rates->len; ++i) {
+        best = MAX(best, g_array_index(rates, gdouble, i));
+    }
+
+    for(guint i = 0; i < rates->len; ++i) {
+        if(g_array_index(rates, gdouble, i) >= best * RM_CALIBRATE_GOOD_ENOUGH) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static void rm_calibrate_print_rate(const char *label, gdouble rate) {
+    char human[64];
+    rm_util_size_to_human_readable(rate, human, sizeof(human));
+    fprintf(stdout, "  %-28s %10s/s\n", label, human);
+}
+
+static bool rm_calibrate_measure(int fd, RmDeviceProfile *profile, GArray *seq_rates,
+                                 GArray *qd_rates) {
+    char *buf = g_malloc(RM_CALIBRATE_MAX_READ_SIZE);
+
+    fprintf(stdout, _("Sequential reads:\n"));
+    for(gsize size = RM_CALIBRATE_MIN_READ_SIZE; size <= RM_CALIBRATE_MAX_READ_SIZE;
+        size *= 4) {
+        gdouble rate = rm_calibrate_sequential(fd, buf, size);
+        g_array_append_val(seq_rates, rate);
+
+        char human[64], label[128];
+        rm_util_size_to_human_readable(size, human, sizeof(human));
+        g_snprintf(label, sizeof(label), _("read size %s"), human);
+        rm_calibrate_print_rate(label, rate);
+    }
+
+    profile->random_latency_us = rm_calibrate_random_latency(fd, buf);
+    fprintf(stdout, _("Random 4K reads:\n  %-28s %10.0f us\n"), _("mean latency"),
+            profile->random_latency_us);
+
+    fprintf(stdout, _("Random reads by concurrent readers:\n"));
+    for(gint depth = 1; depth <= RM_CALIBRATE_MAX_QUEUE_DEPTH; depth *= 2) {
+        gdouble rate = rm_calibrate_queue_depth(fd, depth);
+        g_array_append_val(qd_rates, rate);
+
+        char label[128];
+        g_snprintf(label, sizeof(label), _("%d readers"), depth);
+        rm_calibrate_print_rate(label, rate);
+    }
+
+    g_free(buf);
+    if(rm_session_was_aborted()) {
+        return false;
+    }
+
+    guint seq_index = rm_calibrate_good_enough(seq_rates);
+    profile->read_size = (RmOff)RM_CALIBRATE_MIN_READ_SIZE << (2 * seq_index);
+    profile->seq_read_rate = g_array_index(seq_rates, gdouble, seq_index);
+    profile->queue_depth = 1 << rm_calibrate_good_enough(qd_rates);
+    return profile->seq_read_rate > 0;
+}
+
+int rm_calibrate_main(RmSession *session) {
+    RmCfg *cfg = session->cfg;
+
+    g_assert(cfg->path_count == g_slist_length(cfg->paths));
+    if(cfg->path_count != 1) {
+        rm_log_error(_("Usage: rmlint --calibrate [-v|V] dir\n"));
+        return EXIT_FAILURE;
+    }
+
+    RmPath *target = cfg->paths->data;
+    char *dir = g_file_test(target->path, G_FILE_TEST_IS_DIR)
+                    ? g_strdup(target->path)
+                    : g_path_get_dirname(target->path);
+
+    int exit_state = EXIT_FAILURE;
+    RmMountTable *mounts = rm_mounts_table_new(false);
+    dev_t disk = rm_mounts_get_disk_id_by_path(mounts, dir);
+    const char *disk_name = rm_mounts_get_disk_name(mounts, disk);
+    if(disk_name == NULL) {
+        rm_log_error_line(_("calibrate: cannot find the disk %s is on"), dir);
+        goto cleanup;
+    }
+
+    char *scratch = g_build_filename(dir, ".rmlint-calibrate-XXXXXX", NULL);
+    int fd = g_mkstemp(scratch);
+    if(fd == -1) {
+        rm_log_perrorf(_("calibrate: cannot create scratch file in %s"), dir);
+        g_free(scratch);
+        goto cleanup;
+    }
+
+    /* removed right away; the data stays around until fd is closed */
+    g_unlink(scratch);
+    g_free(scratch);
+
+    fprintf(stdout, _("Calibrating disk %s using %s\n"), disk_name, dir);
+
+    RmDeviceProfile profile;
+    GArray *seq_rates = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    GArray *qd_rates = g_array_new(FALSE, FALSE, sizeof(gdouble));
+
+    if(!rm_calibrate_write_scratch(fd)) {
+        rm_log_error_line(_("calibrate: cannot write %d MB of test data to %s"),
+                          RM_CALIBRATE_FILE_SIZE / 1024 / 1024, dir);
+    } else if(rm_calibrate_measure(fd, &profile, seq_rates, qd_rates)) {
+        char human[64];
+        rm_util_size_to_human_readable(profile.read_size, human, sizeof(human));
+        fprintf(stdout, _("Best read size: %s, best number of readers: %d\n"), human,
+                profile.queue_depth);
+
+        if(rm_calibrate_save_profile(disk_name, &profile, seq_rates, qd_rates)) {
+            exit_state = EXIT_SUCCESS;
+        }
+    }
+
+    g_array_free(seq_rates, TRUE);
+    g_array_free(qd_rates, TRUE);
+    rm_sys_close(fd);
+
+cleanup:
+    if(mounts) {
+        rm_mounts_table_destroy(mounts);
+    }
+    g_free(dir);
+    return exit_state;
+}
+
+//////////////////////////////
+//     APPLYING PROFILES    //
+//////////////////////////////
+
+void rm_calibrate_apply_profiles(RmSession *session) {
+    RmCfg *cfg = session->cfg;
+    if(session->mounts == NULL || cfg->fake_pathindex_as_disk) {
+        return;
+    }
+
+    RmOff read_buf_len = 0, sweep_size = 0, balanced_bytes = 0;
+    GHashTable *disks = g_hash_table_new(NULL, NULL);
+
+    for(GSList *iter = cfg->paths; iter; iter = iter->next) {
+        RmPath *path = iter->data;
+        dev_t disk = rm_mounts_get_disk_id_by_path(session->mounts, path->path);
+        if(!g_hash_table_add(disks, GUINT_TO_POINTER(disk))) {
+            continue;
+        }
+
+        RmDeviceProfile profile;
+        const char *disk_name = rm_mounts_get_disk_name(session->mounts, disk);
+        if(disk_name == NULL || !rm_calibrate_load_profile(disk_name, &profile)) {
+            continue;
+        }
+
+        rm_log_debug_line("Using profile of %s: %.0f MB/s, %.0f us, read size %" LLU
+                          ", queue depth %d",
+                          disk_name, profile.seq_read_rate / 1024 / 1024,
+                          profile.random_latency_us, profile.read_size,
+                          profile.queue_depth);
+
+        rm_mounts_set_queue_depth(session->mounts, disk, profile.queue_depth);
+
+        /* read buffers are shared by all disks: size them for the most
+         * demanding one; sweeps and first increments for the slowest one */
+        read_buf_len = MAX(read_buf_len, MIN(profile.read_size, RM_CALIBRATE_MAX_READ_BUF_LEN));
+
+        RmOff sweep = CLAMP(profile.seq_read_rate * RM_CALIBRATE_SWEEP_SECONDS,
+                            RM_CALIBRATE_MIN_SWEEP_SIZE, RM_CALIBRATE_MAX_SWEEP_SIZE);
+        sweep_size = (sweep_size) ? MIN(sweep_size, sweep) : sweep;
+
+        RmOff balanced = CLAMP(profile.seq_read_rate * profile.random_latency_us /
+                                   G_USEC_PER_SEC / RM_CALIBRATE_CHEAP,
+                               RM_CALIBRATE_MIN_BALANCED_BYTES,
+                               RM_CALIBRATE_MAX_BALANCED_BYTES);
+        balanced_bytes = (balanced_bytes) ? MIN(balanced_bytes, balanced) : balanced;
+    }
+
+    g_hash_table_unref(disks);
+
+    if(read_buf_len && !cfg->read_buf_len_given) {
+        cfg->read_buf_len = read_buf_len;
+    }
+    if(sweep_size && !cfg->sweep_size_given) {
+        cfg->sweep_size = sweep_size;
+    }
+    if(balanced_bytes && cfg->shred_balanced_bytes == 0) {
+        /* 0 is the shredder's default (see cfg.h) */
+        cfg->shred_balanced_bytes = balanced_bytes;
+    }
+}
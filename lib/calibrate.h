@@ -0,0 +1,88 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#ifndef RM_CALIBRATE_H
+#define RM_CALIBRATE_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "session.h"
+
+/**
+ * @file calibrate.h
+ * @brief Measure the read performance of a disk and remember it.
+ *
+ * `rmlint --calibrate <path>` writes a scratch file below path, times
+ * sequential reads with different read sizes, random 4K reads and random
+ * reads with increasing numbers of concurrent readers, and stores the
+ * results as a profile for the disk behind path in
+ * $XDG_CONFIG_HOME/rmlint/devices/<disk>.profile.
+ *
+ * Normal runs load the profiles of the disks they scan and use them instead
+ * of the built-in guesses for the read buffer length, sweep size, readers per
+ * disk and size of the first hash increment (unless given on the command
+ * line).
+ **/
+
+typedef struct RmDeviceProfile {
+    /* sequential read rate at the best read size in bytes/sec */
+    gdouble seq_read_rate;
+
+    /* mean latency of a random 4K read in microseconds */
+    gdouble random_latency_us;
+
+    /* smallest read size that gets close to the best sequential rate */
+    RmOff read_size;
+
+    /* smallest number of concurrent readers that gets close to the best
+     * random read rate */
+    gint queue_depth;
+} RmDeviceProfile;
+
+/**
+ * @brief Run the --calibrate mode on the path in session->cfg.
+ *
+ * @retval EXIT_SUCCESS or EXIT_FAILURE.
+ **/
+int rm_calibrate_main(RmSession *session);
+
+/**
+ * @brief Load the profile of the disk called disk_name.
+ *
+ * @retval false if there is no (valid) profile for it.
+ **/
+bool rm_calibrate_load_profile(const char *disk_name, RmDeviceProfile *profile);
+
+/**
+ * @brief Seed session->cfg and session->mounts from the profiles of the disks
+ * behind the paths in session->cfg.
+ *
+ * Call after session->mounts was created and before the scheduler is.
+ **/
+void rm_calibrate_apply_profiles(RmSession *session);
+
+#endif /* end of include guard */
@@ -69,7 +69,7 @@ void rm_cfg_set_default(RmCfg *cfg) {
     cfg->with_stdout_color = true;
     cfg->with_stderr_color = true;
     cfg->threads = 16;
-    cfg->threads_per_disk = 2;
+    cfg->threads_per_disk = 0; /* detect per disk */
     cfg->verbosity = G_LOG_LEVEL_INFO;
     cfg->see_symlinks = true;
     cfg->follow_symlinks = false;
@@ -72,6 +72,7 @@ typedef struct RmCfg {
     gboolean must_match_untagged;
     gboolean find_hardlinked_dupes;
     gboolean keep_hardlinked_dupes;
+    gboolean keep_reflinked_dupes;
     gboolean limits_specified;
     gboolean filter_mtime;
     gboolean match_basename;
@@ -152,6 +153,10 @@ typedef struct RmCfg {
     guint threads_per_disk;
     RmDigestType checksum_type;
 
+    /* verify duplicate groups by reading their files side by side
+     * (see lockstep.h); replaces the paranoid digest */
+    gboolean paranoid_lockstep;
+
     /* total number of bytes we are allowed to use (target only) */
     RmOff total_mem;
 
@@ -163,8 +168,27 @@ typedef struct RmCfg {
     RmOff sweep_size;
     RmOff sweep_count;
 
+    /* set if given on the command line; otherwise device profiles
+     * (see calibrate.h) may change them */
+    gboolean read_buf_len_given;
+    gboolean sweep_size_given;
+
+    /* size of the first hash increment as measured by --calibrate
+     * (0: use shredder default) */
+    RmOff shred_balanced_bytes;
+
+    /* per-disk limits for bytes read per second and files/directories opened
+     * per second (0: unlimited); adaptive backs off when read latency rises */
+    RmOff limit_read_rate;
+    RmOff limit_read_ops;
+    gboolean limit_adaptive;
+
     gboolean shred_always_wait;
     gboolean shred_never_wait;
+
+    /* start preprocessing & hashing of each device as soon as its
+     * traversal has finished (see rm_shred_pipeline_start) */
+    gboolean pipeline;
     gboolean fake_pathindex_as_disk;
     gboolean fake_abort;
 
@@ -182,9 +206,16 @@ typedef struct RmCfg {
     bool dedupe;
     bool dedupe_check_xattr;
     bool dedupe_readonly;
+    /* dedupe the groups of rmlint json output (see --dedupe-batch) */
+    bool dedupe_batch;
 
     /* for --is-reflink option */
     bool is_reflink;
+    /* test all pairs read from stdin (see --is-reflink-batch) */
+    bool is_reflink_batch;
+
+    /* for --calibrate option */
+    bool calibrate;
 
     /* don't use sse accelerations */
     bool no_sse;
@@ -128,10 +128,6 @@ void rm_buffer_free(RmSemaphore *sem, RmBuffer *buf) {
     g_slice_free(RmBuffer, buf);
 }
 
-static gboolean rm_buffer_equal(RmBuffer *a, RmBuffer *b) {
-    return (a->len == b->len && memcmp(a->data, b->data, a->len) == 0);
-}
-
 ///////////////////////////////////////
 //  RMDIGEST INTERFACE DEFINITIONS   //
 ///////////////////////////////////////
@@ -684,6 +680,68 @@ static const RmDigestInterface ext_interface = {
 //     paranoid 'hash'   //
 ///////////////////////////
 
+/* Paranoid data is kept in power-of-two sized blocks; released blocks are
+ * recycled by later digests (which mostly need the same sizes) instead of going
+ * back to the allocator.  Pooled blocks are linked through their first bytes. */
+#define RM_PARANOID_MIN_CAPACITY (4096)
+#define RM_PARANOID_POOL_CLASSES (32)
+#define RM_PARANOID_POOL_MAX_BYTES (32 * 1024 * 1024)
+
+static struct {
+    GMutex lock;
+    gpointer blocks[RM_PARANOID_POOL_CLASSES];
+    RmOff bytes;
+} rm_paranoid_pool;
+
+static guint rm_paranoid_size_class(RmOff bytes) {
+    return g_bit_storage(MAX(bytes, RM_PARANOID_MIN_CAPACITY) - 1);
+}
+
+RmOff rm_digest_paranoid_footprint(RmOff bytes) {
+    return (RmOff)1 << rm_paranoid_size_class(bytes);
+}
+
+/* get a block of at least *capacity bytes; sets *capacity to its actual size */
+static guint8 *rm_paranoid_storage_get(RmOff *capacity) {
+    guint size_class = rm_paranoid_size_class(*capacity);
+    *capacity = (RmOff)1 << size_class;
+
+    guint8 *block = NULL;
+    if(size_class < RM_PARANOID_POOL_CLASSES) {
+        g_mutex_lock(&rm_paranoid_pool.lock);
+        {
+            block = rm_paranoid_pool.blocks[size_class];
+            if(block) {
+                rm_paranoid_pool.blocks[size_class] = *(gpointer *)block;
+                rm_paranoid_pool.bytes -= *capacity;
+            }
+        }
+        g_mutex_unlock(&rm_paranoid_pool.lock);
+    }
+    return block ? block : g_malloc(*capacity);
+}
+
+static void rm_paranoid_storage_put(guint8 *block, RmOff capacity) {
+    if(!block) {
+        return;
+    }
+
+    guint size_class = g_bit_storage(capacity - 1);
+    if(size_class < RM_PARANOID_POOL_CLASSES) {
+        g_mutex_lock(&rm_paranoid_pool.lock);
+        {
+            if(rm_paranoid_pool.bytes + capacity <= RM_PARANOID_POOL_MAX_BYTES) {
+                *(gpointer *)block = rm_paranoid_pool.blocks[size_class];
+                rm_paranoid_pool.blocks[size_class] = block;
+                rm_paranoid_pool.bytes += capacity;
+                block = NULL;
+            }
+        }
+        g_mutex_unlock(&rm_paranoid_pool.lock);
+    }
+    g_free(block);
+}
+
 static RmParanoid *rm_digest_paranoid_new(void) {
     RmParanoid *paranoid = g_slice_new0(RmParanoid);
     paranoid->incoming_twin_candidates = g_async_queue_new();
@@ -691,13 +749,26 @@ static RmParanoid *rm_digest_paranoid_new(void) {
     return paranoid;
 }
 
-static void rm_buffer_destroy_notify_func(gpointer data) {
-    rm_buffer_free(NULL, data);
+static void rm_digest_paranoid_reserve(RmParanoid *paranoid, RmOff bytes) {
+    if(bytes <= paranoid->capacity) {
+        return;
+    }
+
+    RmOff capacity = bytes;
+    guint8 *data = rm_paranoid_storage_get(&capacity);
+    if(paranoid->len > 0) {
+        memcpy(data, paranoid->data, paranoid->len);
+    }
+    rm_paranoid_storage_put(paranoid->data, paranoid->capacity);
+    paranoid->data = data;
+    paranoid->capacity = capacity;
 }
 
 static void rm_digest_paranoid_release_buffers(RmParanoid *paranoid) {
-    g_slist_free_full(paranoid->buffers, (GDestroyNotify)rm_buffer_destroy_notify_func);
-    paranoid->buffers = NULL;
+    rm_paranoid_storage_put(paranoid->data, paranoid->capacity);
+    paranoid->data = NULL;
+    paranoid->len = 0;
+    paranoid->capacity = 0;
 }
 
 static RmParanoid *rm_digest_paranoid_copy(RmParanoid *paranoid) {
@@ -712,76 +783,68 @@ static void rm_digest_paranoid_free(RmParanoid *paranoid) {
     rm_digest_free(paranoid->shadow_hash);
     rm_digest_paranoid_release_buffers(paranoid);
     g_async_queue_unref(paranoid->incoming_twin_candidates);
-    g_slist_free(paranoid->rejects);
+    if(paranoid->rejects) {
+        g_hash_table_destroy(paranoid->rejects);
+    }
     g_slice_free(RmParanoid, paranoid);
 }
 
+/* true if the first len bytes of twin match data */
+static gboolean rm_digest_paranoid_prefix_equal(RmParanoid *twin, RmOff offset,
+                                                const guint8 *data, RmOff len) {
+    return twin->data && twin->len >= offset + len &&
+           memcmp(twin->data + offset, data, len) == 0;
+}
+
 static void rm_digest_paranoid_buffered_update(RmParanoid *paranoid, RmBuffer *buffer) {
     /* Welcome to hell!
      * This is a somewhat crazy part of the rmlint optimisation strategy.
-     * Comparing two "paranoid digests" (basically a large chunk of a file stored in
-     * a series of buffers) is fairly simple but it's slow because it has to compare
-     * each buffer.
+     * Comparing two "paranoid digests" (basically a large chunk of a file stored
+     * byte-by-byte) is fairly simple but it's slow because it has to compare
+     * all of the data.
      * The algorithm below tries to get a head-start on the comparison by starting the
-     * buffer comparison before the last buffer has been read.
+     * comparison before the last buffer has been read.
      */
 
     rm_digest_update(paranoid->shadow_hash, buffer->data, buffer->len);
 
-    if(!paranoid->buffers) {
-        /* first buffer */
-        paranoid->buffers = g_slist_prepend(NULL, buffer);
-        paranoid->buffer_tail = paranoid->buffers;
-    } else {
-        paranoid->buffer_tail = g_slist_append(paranoid->buffer_tail, buffer)->next;
-    }
+    RmOff offset = paranoid->len;
+    rm_digest_paranoid_reserve(paranoid, offset + buffer->len);
+    memcpy(paranoid->data + offset, buffer->data, buffer->len);
+    paranoid->len += buffer->len;
 
     if(paranoid->twin_candidate) {
         /* do a running check that digest remains the same as its candidate twin */
-        if(rm_buffer_equal(buffer, paranoid->twin_candidate_buffer->data)) {
-            /* buffers match; move ptr to next one ready for next buffer */
-            paranoid->twin_candidate_buffer = paranoid->twin_candidate_buffer->next;
-        } else {
-            /* buffers don't match - delete candidate (new candidate might be added on
-             * next
-             * call to rm_digest_buffered_update) */
+        if(!rm_digest_paranoid_prefix_equal(paranoid->twin_candidate->state, offset,
+                                            buffer->data, buffer->len)) {
+            /* data doesn't match - delete candidate (new candidate might be added on
+             * next call to rm_digest_buffered_update) */
             paranoid->twin_candidate = NULL;
-            paranoid->twin_candidate_buffer = NULL;
 #if _RM_CHECKSUM_DEBUG
-            rm_log_debug_line("Ejected candidate match at buffer #%u",
-                              g_slist_length(paranoid->buffers));
+            rm_log_debug_line("Ejected candidate match at byte %" LLU, offset);
 #endif
         }
     }
 
+    /* the data has been copied; the read buffer can go back right away */
+    rm_buffer_free(NULL, buffer);
+
     while(!paranoid->twin_candidate && (paranoid->twin_candidate = g_async_queue_try_pop(
                                             paranoid->incoming_twin_candidates))) {
-        /* validate the new candidate by comparing the previous buffers (not
-         * including current)*/
-        RmParanoid *twin = paranoid->twin_candidate->state;
-        paranoid->twin_candidate_buffer = twin->buffers;
-        GSList *iter_self = paranoid->buffers;
-        gboolean match = TRUE;
-        while(match && iter_self) {
-            match =
-                (rm_buffer_equal(paranoid->twin_candidate_buffer->data, iter_self->data));
-            iter_self = iter_self->next;
-            paranoid->twin_candidate_buffer = paranoid->twin_candidate_buffer->next;
-        }
-        if(paranoid->twin_candidate && !match) {
-        /* reject the twin candidate, also add to rejects list to speed up
+        /* validate the new candidate by comparing all data so far */
+        if(!rm_digest_paranoid_prefix_equal(paranoid->twin_candidate->state, 0,
+                                            paranoid->data, paranoid->len)) {
+        /* reject the twin candidate, also add to rejects set to speed up
          * rm_digest_equal() */
 #if _RM_CHECKSUM_DEBUG
             rm_log_debug_line("Rejected twin candidate %p for %p",
                               paranoid->twin_candidate, paranoid);
 #endif
-            if(!paranoid->shadow_hash) {
-                /* we use the rejects file to speed up rm_digest_equal */
-                paranoid->rejects =
-                    g_slist_prepend(paranoid->rejects, paranoid->twin_candidate);
+            if(!paranoid->rejects) {
+                paranoid->rejects = g_hash_table_new(NULL, NULL);
             }
+            g_hash_table_add(paranoid->rejects, paranoid->twin_candidate);
             paranoid->twin_candidate = NULL;
-            paranoid->twin_candidate_buffer = NULL;
         } else {
 #if _RM_CHECKSUM_DEBUG
             rm_log_debug_line("Added twin candidate %p for %p", paranoid->twin_candidate,
@@ -915,6 +978,12 @@ void rm_digest_release_buffers(RmDigest *digest) {
     rm_digest_paranoid_release_buffers(digest->state);
 }
 
+void rm_digest_reserve(RmDigest *digest, RmOff bytes) {
+    if(digest->type == RM_DIGEST_PARANOID) {
+        rm_digest_paranoid_reserve(digest->state, bytes);
+    }
+}
+
 void rm_digest_free(RmDigest *digest) {
     const RmDigestInterface *interface = rm_digest_get_interface(digest->type);
     interface->free(digest->state);
@@ -929,13 +998,38 @@ void rm_digest_update(RmDigest *digest, const unsigned char *data, RmOff size) {
     }
 }
 
+/* block of zeros fed to digests by rm_digest_zero_update() */
+#define RM_DIGEST_ZERO_BLOCK (64 * 1024)
+
+void rm_digest_zero_update(RmDigest *digest, RmOff size) {
+    static const unsigned char zeros[RM_DIGEST_ZERO_BLOCK];
+    g_assert(digest->type != RM_DIGEST_PARANOID);
+
+    if(digest->type == RM_DIGEST_CUMULATIVE && size > 0 &&
+       ((RmDigestCumulative *)digest->state)->data) {
+        /* xor with zeros is a no-op once the checksum length is fixed */
+        return;
+    }
+
+    while(size > 0) {
+        RmOff chunk = MIN(size, sizeof(zeros));
+        rm_digest_update(digest, zeros, chunk);
+        size -= chunk;
+    }
+}
+
 void rm_digest_buffered_update(RmSemaphore *sem, RmBuffer *buffer) {
     g_assert(buffer);
     RmDigest *digest = buffer->digest;
     if(digest->type != RM_DIGEST_PARANOID) {
-        rm_digest_update(digest, buffer->data, buffer->len);
+        if(buffer->zero_run > 0) {
+            rm_digest_zero_update(digest, buffer->zero_run);
+        } else {
+            rm_digest_update(digest, buffer->data, buffer->len);
+        }
         rm_buffer_free(sem, buffer);
     } else {
+        g_assert(buffer->zero_run == 0);
         RmParanoid *paranoid = digest->state;
         rm_digest_paranoid_buffered_update(paranoid, buffer);
     }
@@ -998,7 +1092,7 @@ gboolean rm_digest_equal(RmDigest *a, RmDigest *b) {
     if(a->type == RM_DIGEST_PARANOID) {
         RmParanoid *pa = a->state;
         RmParanoid *pb = b->state;
-        if(!pa->buffers) {
+        if(!pa->data || !pb->data) {
             /* buffers have been freed so we need to rely on shadow hash */
             return rm_digest_equal(pa->shadow_hash, pb->shadow_hash);
         }
@@ -1007,24 +1101,21 @@ gboolean rm_digest_equal(RmDigest *a, RmDigest *b) {
             return true;
         }
         /* check if already rejected */
-        if(g_slist_find(pa->rejects, b) || g_slist_find(pb->rejects, a)) {
+        if((pa->rejects && g_hash_table_contains(pa->rejects, b)) ||
+           (pb->rejects && g_hash_table_contains(pb->rejects, a))) {
             return false;
         }
-        /* all the "easy" ways failed... do manual check of all buffers */
-        GSList *a_iter = pa->buffers;
-        GSList *b_iter = pb->buffers;
-        while(a_iter && b_iter) {
-            if(!rm_buffer_equal(a_iter->data, b_iter->data)) {
-                rm_log_error_line(
-                    "Paranoid digest compare found mismatch - must be hash collision in "
-                    "shadow hash");
-                return false;
-            }
-            a_iter = a_iter->next;
-            b_iter = b_iter->next;
+        /* all the "easy" ways failed... do manual check of all data */
+        if(pa->len != pb->len) {
+            return false;
         }
-
-        return (!a_iter && !b_iter);
+        if(memcmp(pa->data, pb->data, pa->len) != 0) {
+            rm_log_error_line(
+                "Paranoid digest compare found mismatch - must be hash collision in "
+                "shadow hash");
+            return false;
+        }
+        return true;
     } else {
         guint8 *buf_a = rm_digest_steal(a);
         guint8 *buf_b = rm_digest_steal(b);
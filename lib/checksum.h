@@ -74,10 +74,13 @@ typedef struct RmUint128 {
 } RmUint128;
 
 typedef struct RmParanoid {
-    /* the buffers containing file data byte-by-byte */
-    GSList *buffers;
-    /* pointer to the last buffer (for efficient appends) */
-    GSList *buffer_tail;
+    /* the file data byte-by-byte, in one contiguous block which is recycled
+     * once released (see rm_digest_reserve) */
+    guint8 *data;
+    /* number of bytes in data */
+    RmOff len;
+    /* allocated size of data */
+    RmOff capacity;
 
     /* A hash is built for every paranoid digest.
      * So we can make rm_digest_hash() and rm_digest_hexstring() work.
@@ -88,12 +91,12 @@ typedef struct RmParanoid {
      * can be provided and will be progressively compared against
      * this RmDigest *during* rm_digest_buffered_update(); this speeds
      * up subsequent calls to rm_digest_equal() significantly.
+     * While set, the first len bytes of both digests are known to match.
      */
     struct RmDigest *twin_candidate;
 
-    /* Pointer to current buffer in twin_candidate->paranoid->buffers */
-    GSList *twin_candidate_buffer;
-    GSList *rejects;
+    /* set of digests that are known not to match; created on demand */
+    GHashTable *rejects;
 
     /* Optional: incoming queue for additional twin candidate RmDigest's */
     GAsyncQueue *incoming_twin_candidates;
@@ -165,6 +168,10 @@ typedef struct RmBuffer {
 
     /* pointer to the data block */
     unsigned char *data;
+
+    /* if > 0, the buffer stands for this many zero bytes (a hole in a sparse
+     * file) and data/len are unused; see rm_digest_zero_update() */
+    RmOff zero_run;
 } RmBuffer;
 
 RmBuffer *rm_buffer_new(RmSemaphore *sem, gsize buf_size);
@@ -211,6 +218,18 @@ void rm_digest_free(RmDigest *digest);
  */
 void rm_digest_update(RmDigest *digest, const unsigned char *data, RmOff size);
 
+/**
+ * @brief Add size zero bytes to the checksum.
+ *
+ * Gives the same result as rm_digest_update() with a zero-filled block, but
+ * needs no such block; digests where zeros don't change the state skip them
+ * altogether.  Not supported for RM_DIGEST_PARANOID.
+ *
+ * @param digest a pointer to a RmDigest
+ * @param size the number of zero bytes
+ */
+void rm_digest_zero_update(RmDigest *digest, RmOff size);
+
 /**
  * @brief Hash a datablock and add it to the current checksum.
  *
@@ -299,6 +318,18 @@ int rm_digest_get_bytes(RmDigest *self);
  */
 void rm_digest_release_buffers(RmDigest *digest);
 
+/**
+ * @brief Make room for bytes of data in a RM_DIGEST_PARANOID digest, so that
+ * it does not need to grow while being updated.  No-op for other types.
+ */
+void rm_digest_reserve(RmDigest *digest, RmOff bytes);
+
+/**
+ * @brief How much memory rm_digest_reserve really takes for bytes of
+ * paranoid data (blocks are rounded up to their size class).
+ */
+RmOff rm_digest_paranoid_footprint(RmOff bytes);
+
 /**
  * @brief Send a new (pending) paranoid digest match `candidate` for `target`.
  */
@@ -39,9 +39,11 @@
 #include <search.h>
 #include <sys/time.h>
 
+#include "calibrate.h"
 #include "cmdline.h"
 #include "formats.h"
 #include "hash-utility.h"
+#include "lockstep.h"
 #include "md-scheduler.h"
 #include "preprocess.h"
 #include "replay.h"
@@ -990,15 +992,23 @@ static gboolean rm_cmd_parse_limit_mem(_UNUSED const char *option_name,
 static gboolean rm_cmd_parse_read_buf_len(_UNUSED const char *option_name,
                                           const gchar *size_spec, RmSession *session,
                                           GError **error) {
+    session->cfg->read_buf_len_given = true;
     return (rm_cmd_parse_mem(size_spec, error, &session->cfg->read_buf_len));
 }
 
 static gboolean rm_cmd_parse_sweep_size(_UNUSED const char *option_name,
                                         const gchar *size_spec, RmSession *session,
                                         GError **error) {
+    session->cfg->sweep_size_given = true;
     return (rm_cmd_parse_mem(size_spec, error, &session->cfg->sweep_size));
 }
 
+static gboolean rm_cmd_parse_limit_read_rate(_UNUSED const char *option_name,
+                                             const gchar *size_spec, RmSession *session,
+                                             GError **error) {
+    return (rm_cmd_parse_mem(size_spec, error, &session->cfg->limit_read_rate));
+}
+
 static gboolean rm_cmd_parse_sweep_count(_UNUSED const char *option_name,
                                          const gchar *size_spec, RmSession *session,
                                          GError **error) {
@@ -1256,6 +1266,22 @@ static gboolean rm_cmd_parse_equal(_UNUSED const char *option_name,
     return true;
 }
 
+static gboolean rm_cmd_parse_dedupe_batch(_UNUSED const char *option_name,
+                                          _UNUSED const gchar *x, RmSession *session,
+                                          _UNUSED GError **error) {
+    session->cfg->dedupe = true;
+    session->cfg->dedupe_batch = true;
+    return true;
+}
+
+static gboolean rm_cmd_parse_is_reflink_batch(_UNUSED const char *option_name,
+                                              _UNUSED const gchar *x, RmSession *session,
+                                              _UNUSED GError **error) {
+    session->cfg->is_reflink = true;
+    session->cfg->is_reflink_batch = true;
+    return true;
+}
+
 static gboolean rm_cmd_parse_btrfs_clone(_UNUSED const char *option_name,
                                    _UNUSED const gchar *x, RmSession *session,
                                    _UNUSED GError **error) {
@@ -1321,7 +1347,9 @@ static bool rm_cmd_set_paths(RmSession *session, char **paths) {
 
     g_strfreev(paths);
 
-    if(cfg->read_stdin || cfg->read_stdin0) {
+    if(cfg->dedupe_batch || cfg->is_reflink_batch) {
+        /* stdin is read by the dedupe / is-reflink session itself */
+    } else if(cfg->read_stdin || cfg->read_stdin0) {
         /* option '-' means read paths from stdin */
         all_paths_valid &=
             rm_cmd_read_paths_from_stdin(session, stdin_paths_preferred, cfg->read_stdin0);
@@ -1430,6 +1458,7 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         {"followlinks"              , 'f'  , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(follow_symlinks)          , _("Follow symlinks")                                                      , NULL}     ,
         {"no-followlinks"           , 'F'  , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(no_follow_symlinks)       , _("Ignore symlinks")                                                      , NULL}     ,
         {"paranoid"                 , 'p'  , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(paranoid)                 , _("Use more paranoid hashing")                                            , NULL}     ,
+        {"lockstep"                 , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->paranoid_lockstep        , _("Verify duplicates byte-by-byte by reading them side by side")          , NULL}     ,
         {"no-crossdev"              , 'x'  , DISABLE   , G_OPTION_ARG_NONE      , &cfg->crossdev                 , _("Do not cross mountpoints")                                             , NULL}     ,
         {"keep-all-tagged"          , 'k'  , 0         , G_OPTION_ARG_NONE      , &cfg->keep_all_tagged          , _("Keep all tagged files")                                                , NULL}     ,
         {"keep-all-untagged"        , 'K'  , 0         , G_OPTION_ARG_NONE      , &cfg->keep_all_untagged        , _("Keep all untagged files")                                              , NULL}     ,
@@ -1443,6 +1472,7 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         {"perms"                    , 'z'  , OPTIONAL  , G_OPTION_ARG_CALLBACK  , FUNC(permissions)              , _("Only use files with certain permissions")                              , "[RWX]+"} ,
         {"no-hardlinked"            , 'L'  , DISABLE   , G_OPTION_ARG_NONE      , &cfg->find_hardlinked_dupes    , _("Ignore hardlink twins")                                                , NULL}     ,
         {"keep-hardlinked"          , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->keep_hardlinked_dupes    , _("Keep hardlink that are linked to any original")                        , NULL}     ,
+        {"keep-reflinked"           , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->keep_reflinked_dupes     , _("Keep duplicates that share all their data with any original")         , NULL}     ,
         {"partial-hidden"           , 0    , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(partial_hidden)           , _("Find hidden files in duplicate folders only")                          , NULL}     ,
         {"mtime-window"             , 'Z'  , 0         , G_OPTION_ARG_DOUBLE    , &cfg->mtime_window             , _("Consider duplicates only equal when mtime differs at max. T seconds")  , "T"}      ,
         {"stdin0"                   , '0'  , 0         , G_OPTION_ARG_NONE      , &cfg->read_stdin0              , _("Read null-separated file list from stdin")                             , NULL}     ,
@@ -1452,7 +1482,12 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         {"dedupe"                   , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->dedupe                   , _("Dedupe matching extents from source to dest (if filesystem supports)") , NULL}     ,
         {"dedupe-xattr"             , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->dedupe_check_xattr       , _("Check extended attributes to see if the file is already deduplicated") , NULL}     ,
         {"dedupe-readonly"          , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->dedupe_readonly          , _("(--dedupe option) even dedupe read-only snapshots (needs root)")       , NULL}     ,
+        {"dedupe-batch"             , 0    , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(dedupe_batch)             , _("Dedupe all duplicate groups of rmlint json output (files or stdin)")  , NULL}     ,
         {"is-reflink"               , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->is_reflink               , _("Test if two files are reflinks (share same data extents)")             , NULL}     ,
+        {"is-reflink-batch"         , 0    , EMPTY     , G_OPTION_ARG_CALLBACK  , FUNC(is_reflink_batch)         , _("Test all pairs of files read from stdin (paths or rmlint json)")       , NULL}     ,
+
+        /* Device profiles */
+        {"calibrate"                , 0    , 0         , G_OPTION_ARG_NONE      , &cfg->calibrate                , _("Measure the disk under PATH and save a profile for later runs")       , NULL}     ,
 
         /* Callback */
         {"show-man" , 'H' , EMPTY , G_OPTION_ARG_CALLBACK , rm_cmd_show_manpage , _("Show the manpage")            , NULL} ,
@@ -1488,11 +1523,14 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         {"clamp-low"              , 'q' , 0                , G_OPTION_ARG_CALLBACK , FUNC(clamp_low)              , "Limit lower reading barrier"                                 , "P"}    ,
         {"clamp-top"              , 'Q' , 0                , G_OPTION_ARG_CALLBACK , FUNC(clamp_top)              , "Limit upper reading barrier"                                 , "P"}    ,
         {"limit-mem"              , 'u' , HIDDEN           , G_OPTION_ARG_CALLBACK , FUNC(limit_mem)              , "Specify max. memory usage target"                            , "S"}    ,
+        {"limit-read-rate"        , 0   , HIDDEN           , G_OPTION_ARG_CALLBACK , FUNC(limit_read_rate)        , "Limit bytes read per second and disk"                        , "S"}    ,
+        {"limit-read-ops"         , 0   , HIDDEN           , G_OPTION_ARG_INT64    , &cfg->limit_read_ops         , "Limit files/dirs opened per second and disk"                 , "N"}    ,
+        {"limit-adaptive"         , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->limit_adaptive         , "Back off when disk latency rises due to other IO"            , NULL}   ,
         {"read-buffer-len"        , 0   , HIDDEN           , G_OPTION_ARG_CALLBACK , FUNC(read_buf_len)           , "Specify read buffer length in bytes"                         , "S"}    ,
         {"sweep-size"             , 0   , HIDDEN           , G_OPTION_ARG_CALLBACK , FUNC(sweep_size)             , "Specify max. bytes per pass when scanning disks"             , "S"}    ,
         {"sweep-files"            , 0   , HIDDEN           , G_OPTION_ARG_CALLBACK , FUNC(sweep_count)            , "Specify max. file count per pass when scanning disks"        , "S"}    ,
         {"threads"                , 't' , HIDDEN           , G_OPTION_ARG_INT64    , &cfg->threads                , "Specify max. number of hasher threads"                       , "N"}    ,
-        {"threads-per-disk"       , 0   , HIDDEN           , G_OPTION_ARG_INT      , &cfg->threads_per_disk       , "Specify number of reader threads per physical disk"          , NULL}   ,
+        {"threads-per-disk"       , 0   , HIDDEN           , G_OPTION_ARG_INT      , &cfg->threads_per_disk       , "Specify reader threads per physical disk (0: auto)"           , NULL}   ,
         {"write-unfinished"       , 'U' , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->write_unfinished       , "Output unfinished checksums"                                 , NULL}   ,
         {"xattr-write"            , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->write_cksum_to_xattr   , "Cache checksum in file attributes"                           , NULL}   ,
         {"xattr-read"             , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->read_cksum_from_xattr  , "Read cached checksums from file attributes"                  , NULL}   ,
@@ -1506,6 +1544,7 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         {"fake-abort"             , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->fake_abort             , "Simulate interrupt after 10% shredder progress"              , NULL}   ,
         {"buffered-read"          , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->use_buffered_read      , "Default to buffered reading calls (fread) during reading."   , NULL}   ,
         {"shred-never-wait"       , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->shred_never_wait       , "Never waits for file increment to finish hashing"            , NULL}   ,
+        {"pipeline"               , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->pipeline               , "Start hashing each disk as soon as it is traversed"          , NULL}   ,
         {"no-sse"                 , 0   , HIDDEN           , G_OPTION_ARG_NONE     , &cfg->no_sse                 , "Don't use SSE accelerations"                                 , NULL}   ,
         {"no-mount-table"         , 0   , DISABLE | HIDDEN , G_OPTION_ARG_NONE     , &cfg->list_mounts            , "Do not try to optimize by listing mounted volumes"           , NULL}   ,
         {NULL                     , 0   , HIDDEN           , 0                     , NULL                         , NULL                                                          , NULL}
@@ -1602,15 +1641,15 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         goto cleanup;
     }
 
-    if(cfg->replay && (cfg->dedupe || cfg->is_reflink)) {
+    if(cfg->replay && (cfg->dedupe || cfg->is_reflink || cfg->calibrate)) {
         error = g_error_new(
             RM_ERROR_QUARK, 0,
-            _("--replay (-Y) is incompatible with --dedupe or --is-reflink")
+            _("--replay (-Y) is incompatible with --dedupe, --is-reflink or --calibrate")
         ); goto cleanup;
     }
 
-    if(cfg->dedupe || cfg->is_reflink) {
-        /* dedupe or is-reflink session; regular rmlint configs are ignored */
+    if(cfg->dedupe || cfg->is_reflink || cfg->calibrate) {
+        /* dedupe, is-reflink or calibrate session; regular rmlint configs are ignored */
         goto cleanup;
     }
 
@@ -1632,6 +1671,29 @@ bool rm_cmd_parse_args(int argc, char **argv, RmSession *session) {
         rm_log_warning_line(_("will also disable --merge-directories and trigger this warning."));
     }
 
+    if(cfg->paranoid_lockstep && cfg->checksum_type == RM_DIGEST_PARANOID) {
+        /* groups get compared byte-by-byte after hashing anyway, so there is no
+         * need to keep all of their data in memory while hashing */
+        cfg->checksum_type = RM_DEFAULT_DIGEST;
+    }
+
+    if(cfg->pipeline && !cfg->find_duplicates) {
+        /* nothing to hash */
+        cfg->pipeline = false;
+    } else if(cfg->pipeline &&
+              (cfg->crossdev || cfg->follow_symlinks || cfg->fake_pathindex_as_disk ||
+               cfg->merge_directories || cfg->run_equal_mode ||
+               cfg->checksum_type == RM_DIGEST_PARANOID || cfg->mtime_window >= 0 ||
+               cfg->match_basename || cfg->match_with_extension ||
+               cfg->match_without_extension)) {
+        /* Devices are preprocessed one by one, so no file may be reachable from
+         * two devices; also duplicate groups are built incrementally, which only
+         * works when they are keyed by size alone */
+        rm_log_warning_line(_("--pipeline needs --no-crossdev (-x) and can't be used "
+                              "with -f, -p, -D, -b, -e, -i, -Z or --equal; ignoring it"));
+        cfg->pipeline = false;
+    }
+
     if(cfg->progress_enabled) {
         if(!rm_fmt_has_formatter(session->formats, "sh")) {
             rm_fmt_add(session->formats, "sh", "rmlint.sh");
@@ -1732,10 +1794,62 @@ static int rm_cmd_replay_main(RmSession *session) {
     return EXIT_SUCCESS;
 }
 
+/* true if --equal can be answered by comparing the given files directly,
+ * i.e. nothing but their content decides about equality and nobody wants
+ * to see more output than the exit code. */
+static bool rm_cmd_equal_is_plain(RmSession *session) {
+    RmCfg *cfg = session->cfg;
+    return rm_fmt_len(session->formats) == 1 &&
+           rm_fmt_has_formatter(session->formats, "_equal") &&
+           cfg->find_duplicates && cfg->mtime_window < 0 && !cfg->filter_mtime &&
+           !cfg->match_basename && !cfg->unmatched_basenames &&
+           !cfg->match_with_extension && !cfg->match_without_extension &&
+           !cfg->must_match_tagged && !cfg->must_match_untagged &&
+           !cfg->keep_all_tagged && !cfg->keep_all_untagged && !cfg->permissions &&
+           !cfg->clamp_is_used && cfg->minsize == 0 && cfg->maxsize == G_MAXUINT64 &&
+           !cfg->read_cksum_from_xattr && !cfg->write_cksum_to_xattr;
+}
+
+static int rm_cmd_equal_main(RmSession *session) {
+    RmCfg *cfg = session->cfg;
+    guint n = g_slist_length(cfg->paths);
+    if(n < 2 || !rm_cmd_equal_is_plain(session)) {
+        return -1;
+    }
+
+    const char **paths = g_new(const char *, n);
+    guint i = 0;
+    for(GSList *iter = cfg->paths; iter; iter = iter->next) {
+        RmPath *path = iter->data;
+        paths[i++] = path->path;
+    }
+
+    RmLockstepResult result = rm_lockstep_equal(paths, n);
+    g_free(paths);
+
+    switch(result) {
+    case RM_LOCKSTEP_EQUAL:
+        return EXIT_SUCCESS;
+    case RM_LOCKSTEP_DIFFERENT:
+        return EXIT_FAILURE;
+    default:
+        rm_log_debug_line("--equal needs a full run");
+        return -1;
+    }
+}
+
 int rm_cmd_main(RmSession *session) {
     int exit_state = EXIT_SUCCESS;
     RmCfg *cfg = session->cfg;
 
+    if(cfg->run_equal_mode) {
+        /* most calls just compare a few files; skip traversal and hashing */
+        int equal_exit_code = rm_cmd_equal_main(session);
+        if(equal_exit_code != -1) {
+            return equal_exit_code;
+        }
+    }
+
     rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_INIT);
 
     if(cfg->replay) {
@@ -1752,7 +1866,16 @@ int rm_cmd_main(RmSession *session) {
         rm_log_debug_line("No mount table created.");
     }
 
+    rm_calibrate_apply_profiles(session);
+
     session->mds = rm_mds_new(cfg->threads, session->mounts, cfg->fake_pathindex_as_disk);
+    rm_mds_set_throttle(session->mds, cfg->limit_read_rate, cfg->limit_read_ops,
+                        cfg->limit_adaptive);
+
+    if(cfg->pipeline) {
+        /* devices are fed to the shredder from rm_traverse_tree() */
+        rm_shred_pipeline_start(session);
+    }
 
     rm_traverse_tree(session);
 
@@ -1814,7 +1937,7 @@ int rm_cmd_main(RmSession *session) {
         }
     }
 
-    if(session->total_files >= 1) {
+    if(session->total_files >= 1 || session->shredder) {
 
         rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_PREPROCESS);
         rm_preprocess(session);
@@ -0,0 +1,239 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "dir-cache.h"
+#include "utilities.h"
+
+/* fds we never hand to the cache; leaves room for the files being hashed,
+ * the formatters' output files and whatever else the session opens */
+#define RM_DIR_CACHE_RESERVED_FDS (256)
+
+/* upper bound for the cache even if RLIMIT_NOFILE is huge or unlimited */
+#define RM_DIR_CACHE_MAX_FDS (4096)
+
+/* O_PATH is enough for openat() and does not need read permission */
+#ifdef O_PATH
+#define RM_DIR_CACHE_OPEN_FLAGS (O_PATH | O_DIRECTORY)
+#else
+#define RM_DIR_CACHE_OPEN_FLAGS (O_RDONLY | O_DIRECTORY)
+#endif
+
+typedef struct RmDirCacheEntry {
+    /* directory node in the trie */
+    RmNode *node;
+
+    /* open fd of the directory */
+    int fd;
+
+    /* number of threads currently using fd; pinned entries are never closed */
+    gint pins;
+
+    /* position in RmDirCache->lru; embedded to avoid allocations */
+    GList link;
+} RmDirCacheEntry;
+
+struct _RmDirCache {
+    /* trie for building fallback paths */
+    RmTrie *trie;
+
+    /* RmNode -> RmDirCacheEntry */
+    GHashTable *entries;
+
+    /* entries in order of use; head is most recently used */
+    GQueue lru;
+
+    guint max_fds;
+
+    GMutex lock;
+};
+
+static guint rm_dir_cache_default_max_fds(void) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        rm_log_perror("getrlimit(2) failed");
+        return 0;
+    }
+
+    if(limit.rlim_cur == RLIM_INFINITY) {
+        return RM_DIR_CACHE_MAX_FDS;
+    }
+
+    if(limit.rlim_cur <= 2 * RM_DIR_CACHE_RESERVED_FDS) {
+        /* not worth it; stay away from EMFILE */
+        return 0;
+    }
+
+    /* only use half of what's left */
+    return MIN(RM_DIR_CACHE_MAX_FDS, (limit.rlim_cur - RM_DIR_CACHE_RESERVED_FDS) / 2);
+}
+
+static void rm_dir_cache_entry_free(RmDirCacheEntry *entry) {
+    rm_sys_close(entry->fd);
+    g_slice_free(RmDirCacheEntry, entry);
+}
+
+/* call with self->lock held */
+static void rm_dir_cache_evict(RmDirCache *self) {
+    GList *iter = self->lru.tail;
+    while(iter && self->lru.length > self->max_fds) {
+        RmDirCacheEntry *entry = iter->data;
+        iter = iter->prev;
+        if(entry->pins > 0) {
+            /* somebody is in the middle of an openat() on this one */
+            continue;
+        }
+        g_queue_unlink(&self->lru, &entry->link);
+        g_hash_table_remove(self->entries, entry->node);
+        rm_dir_cache_entry_free(entry);
+    }
+}
+
+/* Find or open fd for dir and pin it; returns NULL if dir can't be opened */
+static RmDirCacheEntry *rm_dir_cache_pin(RmDirCache *self, RmNode *dir) {
+    RmDirCacheEntry *entry = NULL;
+
+    g_mutex_lock(&self->lock);
+    {
+        entry = g_hash_table_lookup(self->entries, dir);
+        if(entry) {
+            g_queue_unlink(&self->lru, &entry->link);
+            g_queue_push_head_link(&self->lru, &entry->link);
+            entry->pins++;
+        }
+    }
+    g_mutex_unlock(&self->lock);
+
+    if(entry) {
+        return entry;
+    }
+
+    /* open outside the lock; this is the slow part on network filesystems */
+    char dir_path[PATH_MAX];
+    if(!rm_trie_build_path(self->trie, dir, dir_path, sizeof(dir_path))) {
+        return NULL;
+    }
+
+    int fd = rm_sys_open(dir_path, RM_DIR_CACHE_OPEN_FLAGS);
+    if(fd == -1) {
+        rm_log_debug_line("Could not cache dir fd for %s: %s", dir_path,
+                          g_strerror(errno));
+        return NULL;
+    }
+
+    g_mutex_lock(&self->lock);
+    {
+        entry = g_hash_table_lookup(self->entries, dir);
+        if(entry) {
+            /* another thread beat us to it */
+            rm_sys_close(fd);
+        } else {
+            entry = g_slice_new0(RmDirCacheEntry);
+            entry->node = dir;
+            entry->fd = fd;
+            entry->link.data = entry;
+            g_hash_table_insert(self->entries, dir, entry);
+            g_queue_push_head_link(&self->lru, &entry->link);
+        }
+        entry->pins++;
+        rm_dir_cache_evict(self);
+    }
+    g_mutex_unlock(&self->lock);
+
+    return entry;
+}
+
+static void rm_dir_cache_unpin(RmDirCache *self, RmDirCacheEntry *entry) {
+    g_mutex_lock(&self->lock);
+    {
+        entry->pins--;
+        if(entry->pins == 0 && self->lru.length > self->max_fds) {
+            /* cache overflowed while all entries were pinned */
+            rm_dir_cache_evict(self);
+        }
+    }
+    g_mutex_unlock(&self->lock);
+}
+
+RmDirCache *rm_dir_cache_new(RmTrie *trie, guint max_fds) {
+    RmDirCache *self = g_slice_new0(RmDirCache);
+    self->trie = trie;
+    self->entries = g_hash_table_new(NULL, NULL);
+    self->max_fds = (max_fds > 0) ? max_fds : rm_dir_cache_default_max_fds();
+    g_queue_init(&self->lru);
+    g_mutex_init(&self->lock);
+
+    rm_log_debug_line("Caching up to %u directory fds", self->max_fds);
+    return self;
+}
+
+void rm_dir_cache_free(RmDirCache *self) {
+    GList *iter = self->lru.head;
+    while(iter) {
+        RmDirCacheEntry *entry = iter->data;
+        iter = iter->next;
+        g_assert(entry->pins == 0);
+        rm_dir_cache_entry_free(entry);
+    }
+
+    g_hash_table_unref(self->entries);
+    g_mutex_clear(&self->lock);
+    g_slice_free(RmDirCache, self);
+}
+
+int rm_dir_cache_at(RmDirCache *self, RmNode *node, RmDirCacheAtFunc func,
+                    gpointer user_data) {
+    RmNode *dir = node->parent;
+    RmDirCacheEntry *entry = NULL;
+
+    /* dir->parent == NULL means dir is the trie root, which has no path */
+    if(self->max_fds > 0 && dir && dir->parent) {
+        entry = rm_dir_cache_pin(self, dir);
+    }
+
+    if(entry) {
+        int result = func(entry->fd, node->basename, user_data);
+        rm_dir_cache_unpin(self, entry);
+        return result;
+    }
+
+    char path[PATH_MAX];
+    if(!rm_trie_build_path(self->trie, node, path, sizeof(path))) {
+        errno = ENOENT;
+        return -1;
+    }
+    return func(AT_FDCWD, path, user_data);
+}
+
+static int rm_dir_cache_openat(int dir_fd, const char *name, gpointer flags) {
+    return rm_sys_openat(dir_fd, name, GPOINTER_TO_INT(flags));
+}
+
+int rm_dir_cache_open(RmDirCache *self, RmNode *node, int flags) {
+    return rm_dir_cache_at(self, node, rm_dir_cache_openat, GINT_TO_POINTER(flags));
+}
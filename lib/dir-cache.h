@@ -0,0 +1,94 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#ifndef RM_DIR_CACHE_H
+#define RM_DIR_CACHE_H
+
+#include <glib.h>
+
+#include "config.h"
+#include "pathtricia.h"
+
+/**
+ * @file dir-cache.h
+ * @brief Bounded cache of open directory file descriptors.
+ *
+ * Opening a file by its absolute path makes the kernel resolve every
+ * path component again; for deep trees (or on NFS, where each component
+ * may cost a round trip) this adds up since the shredder re-opens each
+ * file once per increment.
+ *
+ * RmDirCache keeps an fd for recently used parent directories, keyed
+ * by their RmNode in the file trie, so that files can be opened via
+ * openat(dirfd, basename).  The number of cached fds is bounded (LRU)
+ * to stay well below RLIMIT_NOFILE.
+ *
+ * The cache is thread safe.
+ **/
+
+typedef struct _RmDirCache RmDirCache;
+
+/**
+ * @brief Allocate a new directory fd cache.
+ *
+ * @param trie The trie the nodes passed to rm_dir_cache_open() belong to.
+ * @param max_fds Maximum number of directory fds to keep open; pass 0 to
+ *        derive a limit from RLIMIT_NOFILE.
+ **/
+RmDirCache *rm_dir_cache_new(RmTrie *trie, guint max_fds);
+
+/**
+ * @brief Close all cached fds and free the cache.
+ **/
+void rm_dir_cache_free(RmDirCache *self);
+
+/**
+ * @brief Open the file represented by node, relative to its (cached) parent.
+ *
+ * Falls back to opening by absolute path if the parent directory could
+ * not be cached.
+ *
+ * @param node The file's node in the trie (i.e. RmFile->folder).
+ * @param flags Flags as for open(2).
+ * @retval fd of the opened file or -1 on error (errno is set).
+ **/
+int rm_dir_cache_open(RmDirCache *self, RmNode *node, int flags);
+
+typedef int (*RmDirCacheAtFunc)(int dir_fd, const char *name, gpointer user_data);
+
+/**
+ * @brief Call func with the (cached) fd of node's parent and node's basename,
+ *        for use with unlinkat(2), renameat(2) and friends.
+ *
+ * If the parent directory could not be cached, func gets AT_FDCWD and the
+ * absolute path of node instead.  The fd is only valid during the call.
+ *
+ * @retval return value of func, or -1 (errno set) if node's path could
+ *         not be built.
+ **/
+int rm_dir_cache_at(RmDirCache *self, RmNode *node, RmDirCacheAtFunc func,
+                    gpointer user_data);
+
+#endif /* end of include guard */
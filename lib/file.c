@@ -123,6 +123,7 @@ RmFile *rm_file_copy(RmFile *file) {
     copy->hardlinks = NULL;
     copy->shred_group = NULL;
     copy->signal = NULL;
+    copy->extents = NULL;
     copy->parent_dir = NULL;
     copy->n_children = 0;
 
@@ -137,6 +138,7 @@ void rm_file_destroy(RmFile *file) {
         }
     }
 
+    rm_extent_map_free(file->extents);
     if(file->ext_cksum) {
         g_free(file->ext_cksum);
     }
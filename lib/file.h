@@ -85,20 +85,18 @@ typedef enum RmLintType {
 
 struct RmSession;
 
-typedef guint16 RmPatternBitmask;
+/* One bit per pattern of the sort criteria (r<...> and x<...>, in order) that
+ * matches a file, plus the highest bit to mark that they were matched */
+typedef guint64 RmPatternBitmask;
 
 /* Get the number of usable fields in a RmPatternBitmask */
-#define RM_PATTERN_N_MAX (sizeof(RmPatternBitmask) * 8 / 2)
+#define RM_PATTERN_N_MAX (sizeof(RmPatternBitmask) * 8 - 1)
 
-/* Check if a field has been set already in the RmPatternBitmask */
-#define RM_PATTERN_IS_CACHED(mask, idx) (!!((*mask) & (1 << (idx + RM_PATTERN_N_MAX))))
+/* Set once all patterns were matched against the file */
+#define RM_PATTERN_MATCHED ((RmPatternBitmask)1 << RM_PATTERN_N_MAX)
 
-/* If the field was set, this will retrieve the previous result */
-#define RM_PATTERN_GET_CACHED(mask, idx) (!!((*mask) & (1 << idx)))
-
-/* Set a field and remember that it was set. */
-#define RM_PATTERN_SET_CACHED(mask, idx, match) \
-    ((*mask) |= ((!!match << idx) | (1 << (idx + RM_PATTERN_N_MAX))))
+/* Check if pattern idx matched */
+#define RM_PATTERN_GET(mask, idx) (!!((mask) & ((RmPatternBitmask)1 << (idx))))
 
 struct RmDirectory;
 
@@ -188,6 +186,9 @@ typedef struct RmFile {
     /* Set to true if file belongs to a subvolume-capable filesystem eg btrfs */
     bool is_on_subvol_fs : 1;
 
+    /* Set once rm_shred_push_queue() looked up disk_offset (and extents) */
+    bool disk_offset_known : 1;
+
     /* The pre-matched file cluster that this file belongs to (or NULL) */
     GQueue *cluster;
 
@@ -241,6 +242,10 @@ typedef struct RmFile {
         RmOff disk_offset;
     };
 
+    /* Cached extent map of the file (only built with --build-fiemap on rotational
+     * disks); used to update disk_offset before each hashing increment */
+    RmExtentMap *extents;
+
     /* What kind of lint this file is.
      */
     RmLintType lint_type;
@@ -253,12 +258,11 @@ typedef struct RmFile {
 
     struct RmSignal *signal;
 
-    /* Caching bitmasks to ensure each file is only matched once
-     * for every GRegex combination.
+    /* Results of all sort criteria patterns, so that each file is only
+     * matched (and its path only built) once.
      * See also preprocess.c for more explanation.
      * */
-    RmPatternBitmask pattern_bitmask_path;
-    RmPatternBitmask pattern_bitmask_basename;
+    RmPatternBitmask pattern_bitmask;
 
     /* Parent directory.
      * Only filled if type is RM_LINT_TYPE_PART_OF_DIRECTORY.
@@ -56,6 +56,158 @@ static void rm_fmt_group_destroy(_UNUSED RmFmtTable *self, RmFmtGroup *group) {
     g_slice_free(RmFmtGroup, group);
 }
 
+#if HAVE_FOPENCOOKIE
+
+/* Handlers format their output into a stdio buffer of this size; full
+ * buffers are written out by a separate thread, so that a slow output
+ * (network filesystem, pipe into a slow reader) does not stall the threads
+ * that call rm_fmt_write() */
+#define RM_FMT_WRITER_BUFFER_SIZE (1024 * 1024)
+
+/* Buffers in flight per output; once all are queued, the handler waits for
+ * the writer to catch up */
+#define RM_FMT_WRITER_MAX_QUEUED (8)
+
+typedef struct RmFmtWriter {
+    /* the real output */
+    FILE *target;
+    GThread *thread;
+
+    /* GByteArrays waiting to be written; the writer itself means stop */
+    GAsyncQueue *full;
+
+    /* emptied GByteArrays for reuse */
+    GAsyncQueue *spare;
+
+    /* set by the writer thread after the first failed write */
+    gint failed;
+} RmFmtWriter;
+
+static gpointer rm_fmt_writer_thread(RmFmtWriter *self) {
+    for(;;) {
+        gpointer item = g_async_queue_pop(self->full);
+        if(item == self) {
+            break;
+        }
+
+        GByteArray *chunk = item;
+        if(!g_atomic_int_get(&self->failed) &&
+           fwrite(chunk->data, 1, chunk->len, self->target) != chunk->len) {
+            rm_log_perror(_("Unable to write output"));
+            g_atomic_int_set(&self->failed, 1);
+        }
+
+        g_byte_array_set_size(chunk, 0);
+        g_async_queue_push(self->spare, chunk);
+
+        if(g_async_queue_length(self->full) <= 0) {
+            /* nothing more for now; pass on what the handler flushed */
+            fflush(self->target);
+        }
+    }
+    return NULL;
+}
+
+static ssize_t rm_fmt_writer_write(RmFmtWriter *self, const char *buf, size_t size) {
+    if(g_atomic_int_get(&self->failed)) {
+        errno = EIO;
+        return -1;
+    }
+
+    /* blocks while all buffers are queued */
+    GByteArray *chunk = g_async_queue_pop(self->spare);
+    g_byte_array_append(chunk, (const guint8 *)buf, size);
+    g_async_queue_push(self->full, chunk);
+    return size;
+}
+
+static int rm_fmt_writer_close(RmFmtWriter *self) {
+    g_async_queue_push(self->full, self);
+    g_thread_join(self->thread);
+
+    int result = fclose(self->target);
+    if(g_atomic_int_get(&self->failed)) {
+        result = EOF;
+    }
+
+    GByteArray *chunk = NULL;
+    while((chunk = g_async_queue_try_pop(self->spare))) {
+        g_byte_array_free(chunk, TRUE);
+    }
+
+    g_async_queue_unref(self->full);
+    g_async_queue_unref(self->spare);
+    g_slice_free(RmFmtWriter, self);
+    return result;
+}
+
+/* Wrap target into a stream whose data is written by a writer thread;
+ * closing the returned stream waits for all data and closes target. */
+static FILE *rm_fmt_writer_new(FILE *target) {
+    RmFmtWriter *self = g_slice_new0(RmFmtWriter);
+    self->target = target;
+    self->full = g_async_queue_new();
+    self->spare = g_async_queue_new();
+    for(int i = 0; i < RM_FMT_WRITER_MAX_QUEUED; ++i) {
+        g_async_queue_push(self->spare, g_byte_array_new());
+    }
+
+    cookie_io_functions_t funcs = {
+        .read = NULL,
+        .write = (cookie_write_function_t *)rm_fmt_writer_write,
+        .seek = NULL,
+        .close = (cookie_close_function_t *)rm_fmt_writer_close,
+    };
+
+    FILE *stream = fopencookie(self, "w", funcs);
+    if(stream == NULL) {
+        g_async_queue_unref(self->full);
+        g_async_queue_unref(self->spare);
+        g_slice_free(RmFmtWriter, self);
+        return target;
+    }
+
+    setvbuf(stream, NULL, _IOFBF, RM_FMT_WRITER_BUFFER_SIZE);
+    self->thread = g_thread_new("rm-fmt-writer", (GThreadFunc)rm_fmt_writer_thread, self);
+    return stream;
+}
+
+#endif
+
+/* Handlers that write to the same target (eg. stdout) share one stream, so
+ * their output keeps the order it was written in */
+static FILE *rm_fmt_writer_open(RmFmtTable *self, FILE *target) {
+#if HAVE_FOPENCOOKIE
+    /* terminals stay unbuffered so that progress and log lines interleave */
+    if(target == stdin || isatty(fileno(target))) {
+        return target;
+    }
+
+    FILE *stream = g_hash_table_lookup(self->writers, target);
+    if(stream == NULL) {
+        stream = rm_fmt_writer_new(target);
+        g_hash_table_insert(self->writers, target, stream);
+    }
+    return stream;
+#else
+    (void)self;
+    return target;
+#endif
+}
+
+int rm_fmt_fileno(RmFmtTable *self, FILE *out) {
+    GHashTableIter iter;
+    gpointer target = NULL, stream = NULL;
+
+    g_hash_table_iter_init(&iter, self->writers);
+    while(g_hash_table_iter_next(&iter, &target, &stream)) {
+        if(stream == out) {
+            return fileno((FILE *)target);
+        }
+    }
+    return fileno(out);
+}
+
 static void rm_fmt_handler_free(RmFmtHandler *handler) {
     g_assert(handler);
     g_free(handler->path);
@@ -79,6 +231,7 @@ RmFmtTable *rm_fmt_open(RmSession *session) {
                                          (GDestroyNotify)g_hash_table_unref);
 
     self->handler_order = g_queue_new();
+    self->writers = g_hash_table_new(NULL, NULL);
 
     self->session = session;
     g_queue_init(&self->groups);
@@ -123,6 +276,9 @@ RmFmtTable *rm_fmt_open(RmSession *session) {
     extern RmFmtHandler *EQUAL_HANDLER;
     rm_fmt_register(self, EQUAL_HANDLER);
 
+    extern RmFmtHandler *APPLY_HANDLER;
+    rm_fmt_register(self, APPLY_HANDLER);
+
     return self;
 }
 
@@ -279,6 +435,8 @@ bool rm_fmt_add(RmFmtTable *self, const char *handler_name, const char *path) {
         return false;
     }
 
+    file_handle = rm_fmt_writer_open(self, file_handle);
+
     /* Make a copy of the handler so we can more than one per handler type.
      * Plus we have to set the handler specific path.
      */
@@ -345,9 +503,6 @@ static gint rm_fmt_rank(const RmFmtGroup *ga, const RmFmtGroup *gb, RmFmtTable *
     RmFile *fa = ga->files.head->data;
     RmFile *fb = gb->files.head->data;
 
-    RM_DEFINE_PATH(fa);
-    RM_DEFINE_PATH(fb);
-
     int fa_order = rm_lint_type_order[fa->lint_type];
     int fb_order = rm_lint_type_order[fb->lint_type];
     if(fa_order != fb_order) {
@@ -413,7 +568,15 @@ void rm_fmt_close(RmFmtTable *self) {
 
     RM_FMT_FOR_EACH_HANDLER_BEGIN(self) {
         RM_FMT_CALLBACK(handler->foot);
-        fclose(file);
+
+        /* shared streams are closed after the foot of their last handler */
+        bool shared = false;
+        for(GList *next = iter->next; next && !shared; next = next->next) {
+            shared = (g_hash_table_lookup(self->handler_to_file, next->data) == file);
+        }
+        if(!shared) {
+            fclose(file);
+        }
         g_mutex_clear(&handler->print_mtx);
     }
     RM_FMT_FOR_EACH_HANDLER_END
@@ -424,6 +587,7 @@ void rm_fmt_close(RmFmtTable *self) {
     g_hash_table_unref(self->config);
     g_hash_table_unref(self->handler_set);
     g_queue_free(self->handler_order);
+    g_hash_table_unref(self->writers);
     g_rec_mutex_clear(&self->state_mtx);
 
     if(self->first_backup_timestamp) {
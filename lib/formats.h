@@ -57,6 +57,9 @@ typedef struct RmFmtTable {
     GHashTable *handler_set;
     GHashTable *config;
     GQueue *handler_order;
+
+    /* Buffered streams (written by a writer thread) by their target FILE */
+    GHashTable *writers;
     GRecMutex state_mtx;
     RmSession *session;
     GDateTime *first_backup_timestamp;
@@ -258,6 +261,13 @@ void rm_fmt_unlock_state(RmFmtTable *self);
  */
 bool rm_fmt_is_stream(RmFmtTable *self, RmFmtHandler *handler);
 
+/**
+ * @brief File descriptor of the file that `out` (as passed to the handler
+ * callbacks) ends up in. Use this instead of fileno(out), since `out` may be
+ * a buffered stream that is written by a separate thread.
+ */
+int rm_fmt_fileno(RmFmtTable *self, FILE *out);
+
 /**
  * @brief Check if there is at least one formatter with `name`.
  */
@@ -0,0 +1,557 @@
+
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#include "../config.h"
+#include "../dir-cache.h"
+#include "../formats.h"
+#include "../lockstep.h"
+#include "../preprocess.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+/* The apply formatter does what the sh script would do, but right away and
+ * in-process: no fork/exec per file, files are addressed relative to cached
+ * directory fds and each device gets its own worker thread.
+ *
+ * Typical use is on the json output of an earlier run:
+ *
+ *   rmlint --replay rmlint.json -o apply -c apply:handler=hardlink
+ */
+
+typedef enum RmApplyAction {
+    RM_APPLY_UNKNOWN = 0,
+    RM_APPLY_CLONE,
+    RM_APPLY_REFLINK,
+    RM_APPLY_HARDLINK,
+    RM_APPLY_SYMLINK,
+    RM_APPLY_REMOVE,
+    /* not a handler; used for empty directories */
+    RM_APPLY_REMOVE_DIR,
+    RM_APPLY_N
+} RmApplyAction;
+
+static const char *ACTION_TO_STRING[] = {
+    [RM_APPLY_UNKNOWN] = NULL,
+    [RM_APPLY_CLONE] = "clone",
+    [RM_APPLY_REFLINK] = "reflink",
+    [RM_APPLY_HARDLINK] = "hardlink",
+    [RM_APPLY_SYMLINK] = "symlink",
+    [RM_APPLY_REMOVE] = "remove",
+    [RM_APPLY_REMOVE_DIR] = NULL,
+    [RM_APPLY_N] = NULL
+};
+
+/* same wording as the sh script */
+static const char *ACTION_TO_MESSAGE[] = {
+    [RM_APPLY_UNKNOWN] = NULL,
+    [RM_APPLY_CLONE] = "Cloning to: ",
+    [RM_APPLY_REFLINK] = "Reflinking to original: ",
+    [RM_APPLY_HARDLINK] = "Hardlinking to original: ",
+    [RM_APPLY_SYMLINK] = "Symlinking to original: ",
+    [RM_APPLY_REMOVE] = "Deleting: ",
+    [RM_APPLY_REMOVE_DIR] = "Deleting empty directory: ",
+    [RM_APPLY_N] = NULL
+};
+
+typedef struct RmFmtHandlerApply {
+    RmFmtHandler parent;
+    RmSession *session;
+
+    /* handlers to try, in order of preference (RmApplyAction) */
+    GByteArray *order;
+    RmFile *last_original;
+
+    /* -c apply:paranoid - compare files byte by byte before acting */
+    bool paranoid : 1;
+    /* -c apply:keep_dir_timestamps - restore parent dir timestamps on remove */
+    bool keep_dir_timestamps : 1;
+    /* -c apply:dry_run - only print what would be done */
+    bool dry_run : 1;
+
+    /* own mount table if the session has none (e.g. with --replay) */
+    RmMountTable *mounts;
+
+    RmDirCache *dir_cache;
+
+    /* dev -> GThreadPool with a single worker */
+    GHashTable *pools;
+
+    /* protects out and the counters below */
+    GMutex lock;
+    FILE *out;
+    guint n_actions;
+    guint n_failed;
+} RmFmtHandlerApply;
+
+typedef struct RmApplyJob {
+    RmApplyAction action;
+
+    /* file to act on and (for duplicates) its original */
+    RmNode *node;
+    RmNode *orig;
+} RmApplyJob;
+
+static void rm_fmt_apply_print(RmFmtHandlerApply *self, const char *message,
+                               const char *path) {
+    g_mutex_lock(&self->lock);
+    { fprintf(self->out, "%s%s\n", message, path); }
+    g_mutex_unlock(&self->lock);
+}
+
+static bool rm_fmt_apply_cancel(RmFmtHandlerApply *self, const char *reason) {
+    rm_fmt_apply_print(self, "^^^^^^ Error: ", reason);
+    return false;
+}
+
+/* same checks as original_check() in the sh script */
+static bool rm_fmt_apply_original_check(RmFmtHandlerApply *self, RmApplyJob *job,
+                                        char *path, char *orig_path) {
+    RmStat stat_buf;
+    if(rm_sys_lstat(orig_path, &stat_buf) == -1) {
+        return rm_fmt_apply_cancel(self, "original has disappeared - cancelling.....");
+    }
+
+    if(rm_sys_lstat(path, &stat_buf) == -1) {
+        return rm_fmt_apply_cancel(self, "duplicate has disappeared - cancelling.....");
+    }
+
+    if(job->node == job->orig || strcmp(path, orig_path) == 0) {
+        return rm_fmt_apply_cancel(
+            self, "original and duplicate point to the *same* path - cancelling.....");
+    }
+
+    if(self->paranoid) {
+        const char *paths[] = {path, orig_path};
+        if(rm_lockstep_equal(paths, 2) != RM_LOCKSTEP_EQUAL) {
+            return rm_fmt_apply_cancel(self, "files no longer identical - cancelling.....");
+        }
+    }
+    return true;
+}
+
+static int rm_fmt_apply_unlinkat(int dir_fd, const char *name, gpointer flags) {
+    return unlinkat(dir_fd, name, GPOINTER_TO_INT(flags));
+}
+
+static bool rm_fmt_apply_remove(RmFmtHandlerApply *self, RmApplyJob *job) {
+    RmTrie *trie = &self->session->cfg->file_trie;
+    int flags = (job->action == RM_APPLY_REMOVE_DIR) ? AT_REMOVEDIR : 0;
+
+    char dir_path[PATH_MAX];
+    RmStat dir_stat;
+    bool keep_stamps = self->keep_dir_timestamps &&
+                       rm_trie_build_path(trie, job->node->parent, dir_path,
+                                          sizeof(dir_path)) &&
+                       rm_sys_stat(dir_path, &dir_stat) != -1;
+
+    if(rm_dir_cache_at(self->dir_cache, job->node, rm_fmt_apply_unlinkat,
+                       GINT_TO_POINTER(flags)) == -1) {
+        return false;
+    }
+
+    if(keep_stamps) {
+        struct timespec times[2] = {dir_stat.st_atim, dir_stat.st_mtim};
+        if(utimensat(AT_FDCWD, dir_path, times, 0) == -1) {
+            rm_log_perror("Could not restore directory timestamps");
+        }
+    }
+    return true;
+}
+
+#ifdef FICLONE
+
+/* create tmp as a reflink of orig_path with the mtime of the duplicate at path
+ * (as cp_reflink does) */
+static int rm_fmt_apply_reflink_at(int dir_fd, const char *tmp, const char *path,
+                                   const char *orig_path) {
+    RmStat dupe_stat, orig_stat;
+    if(rm_sys_lstat(path, &dupe_stat) == -1) {
+        return -1;
+    }
+
+    int orig_fd = rm_sys_open(orig_path, O_RDONLY);
+    if(orig_fd == -1) {
+        return -1;
+    }
+
+    int result = -1;
+    int tmp_fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(tmp_fd != -1 && rm_sys_fstat(orig_fd, &orig_stat) != -1 &&
+       ioctl(tmp_fd, FICLONE, orig_fd) == 0) {
+        /* like cp --archive, but with the duplicate's mtime */
+        if(fchown(tmp_fd, orig_stat.st_uid, orig_stat.st_gid) == -1) {
+            rm_log_debug_line("Could not chown %s: %s", path, g_strerror(errno));
+        }
+        struct timespec times[2] = {orig_stat.st_atim, dupe_stat.st_mtim};
+        if(fchmod(tmp_fd, orig_stat.st_mode & 07777) == 0 && futimens(tmp_fd, times) == 0) {
+            result = 0;
+        }
+    }
+
+    int error = errno;
+    if(tmp_fd != -1) {
+        rm_sys_close(tmp_fd);
+        if(result != 0) {
+            unlinkat(dir_fd, tmp, 0);
+        }
+    }
+    rm_sys_close(orig_fd);
+    errno = error;
+    return result;
+}
+
+#endif
+
+typedef struct RmApplyReplace {
+    RmApplyAction action;
+    const char *path;
+    const char *orig_path;
+} RmApplyReplace;
+
+/* build the replacement for name next to it and rename(2) it over name;
+ * name is never missing, even if we get interrupted halfway */
+static int rm_fmt_apply_replace_at(int dir_fd, const char *name, RmApplyReplace *replace) {
+    /* name may be a basename or (without cached dir) a full path;
+     * either way the tmp file ends up in the same directory */
+    char *tmp = g_strdup_printf("%s.rmlint-tmp", name);
+    int result = -1;
+
+    switch(replace->action) {
+    case RM_APPLY_HARDLINK:
+        result = linkat(AT_FDCWD, replace->orig_path, dir_fd, tmp, 0);
+        break;
+    case RM_APPLY_SYMLINK:
+        result = symlinkat(replace->orig_path, dir_fd, tmp);
+        if(result == 0) {
+            /* make the symlink's mtime the same as the original */
+            RmStat orig_stat;
+            if(rm_sys_stat(replace->orig_path, &orig_stat) != -1) {
+                struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, orig_stat.st_mtim};
+                utimensat(dir_fd, tmp, times, AT_SYMLINK_NOFOLLOW);
+            }
+        }
+        break;
+#ifdef FICLONE
+    case RM_APPLY_REFLINK:
+        result = rm_fmt_apply_reflink_at(dir_fd, tmp, replace->path, replace->orig_path);
+        break;
+#endif
+    default:
+        errno = EINVAL;
+        break;
+    }
+
+    if(result == 0) {
+        result = renameat(dir_fd, tmp, dir_fd, name);
+        if(result != 0) {
+            int error = errno;
+            unlinkat(dir_fd, tmp, 0);
+            errno = error;
+        }
+    }
+
+    g_free(tmp);
+    return result;
+}
+
+static bool rm_fmt_apply_replace(RmFmtHandlerApply *self, RmApplyJob *job,
+                                 char *path, char *orig_path) {
+    if(job->action == RM_APPLY_REFLINK && rm_util_link_type(path, orig_path) == RM_LINK_REFLINK) {
+        rm_fmt_apply_print(self, "Leaving as-is (already reflinked to original): ", path);
+        return true;
+    }
+
+    RmApplyReplace replace = {.action = job->action, .path = path, .orig_path = orig_path};
+    return rm_dir_cache_at(self->dir_cache, job->node,
+                           (RmDirCacheAtFunc)rm_fmt_apply_replace_at, &replace) == 0;
+}
+
+static void rm_fmt_apply_run(RmApplyJob *job, RmFmtHandlerApply *self) {
+    RmTrie *trie = &self->session->cfg->file_trie;
+    char path[PATH_MAX], orig_path[PATH_MAX];
+    bool success = false;
+
+    if(rm_session_was_aborted()) {
+        g_slice_free(RmApplyJob, job);
+        return;
+    }
+
+    rm_trie_build_path(trie, job->node, path, sizeof(path));
+    if(job->orig) {
+        rm_trie_build_path(trie, job->orig, orig_path, sizeof(orig_path));
+    }
+
+    rm_fmt_apply_print(self, ACTION_TO_MESSAGE[job->action], path);
+
+    if(job->orig && job->action != RM_APPLY_CLONE &&
+       !rm_fmt_apply_original_check(self, job, path, orig_path)) {
+        /* already reported */
+    } else if(self->dry_run) {
+        success = true;
+    } else {
+        switch(job->action) {
+        case RM_APPLY_REMOVE:
+        case RM_APPLY_REMOVE_DIR:
+            success = rm_fmt_apply_remove(self, job);
+            break;
+        case RM_APPLY_HARDLINK:
+        case RM_APPLY_SYMLINK:
+        case RM_APPLY_REFLINK:
+            success = rm_fmt_apply_replace(self, job, path, orig_path);
+            break;
+        case RM_APPLY_CLONE:
+            /* rm_session_dedupe_file() compares the data itself */
+            success = rm_session_dedupe_file(self->session->cfg, orig_path, path);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+
+        if(!success && job->action != RM_APPLY_CLONE) {
+            /* rm_session_dedupe_file() does its own error reporting */
+            rm_log_warning_line(_("apply: could not handle %s: %s"), path,
+                                g_strerror(errno));
+        }
+    }
+
+    g_mutex_lock(&self->lock);
+    {
+        self->n_actions++;
+        self->n_failed += !success;
+    }
+    g_mutex_unlock(&self->lock);
+
+    g_slice_free(RmApplyJob, job);
+}
+
+static void rm_fmt_apply_push(RmFmtHandlerApply *self, RmApplyAction action, RmFile *file,
+                              RmFile *orig) {
+    RmApplyJob *job = g_slice_new0(RmApplyJob);
+    job->action = action;
+    job->node = file->folder;
+    job->orig = orig ? orig->folder : NULL;
+
+    /* one worker per device; actions on a device run in the order of output */
+    GThreadPool *pool = g_hash_table_lookup(self->pools, GUINT_TO_POINTER(file->dev));
+    if(pool == NULL) {
+        pool = rm_util_thread_pool_new((GFunc)rm_fmt_apply_run, self, 1);
+        g_hash_table_insert(self->pools, GUINT_TO_POINTER(file->dev), pool);
+    }
+    rm_util_thread_pool_push(pool, job);
+}
+
+static RmMountTable *rm_fmt_apply_mounts(RmFmtHandlerApply *self) {
+    return self->session->mounts ? self->session->mounts : self->mounts;
+}
+
+/* whether action can be used for file (same rules as the sh formatter) */
+static bool rm_fmt_apply_can(RmFmtHandlerApply *self, RmApplyAction action, RmFile *file) {
+    RmFile *orig = self->last_original;
+    RmMountTable *mounts = rm_fmt_apply_mounts(self);
+
+    switch(action) {
+    case RM_APPLY_CLONE:
+        return mounts && rm_mounts_can_reflink(mounts, file->dev, orig->dev) &&
+               rm_session_check_kernel_version(4, 2);
+    case RM_APPLY_REFLINK:
+#ifdef FICLONE
+        return mounts && rm_mounts_can_reflink(mounts, orig->dev, file->dev);
+#else
+        return false;
+#endif
+    case RM_APPLY_HARDLINK:
+        return orig->dev == file->dev;
+    case RM_APPLY_SYMLINK:
+    case RM_APPLY_REMOVE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void rm_fmt_apply_duplicate(RmFmtHandlerApply *self, RmFile *file) {
+    if(file->is_original) {
+        self->last_original = file;
+        return;
+    }
+
+    if(self->last_original == NULL) {
+        return;
+    }
+
+    if(file->lint_type == RM_LINT_TYPE_DUPE_DIR_CANDIDATE) {
+        RM_DEFINE_PATH(file);
+        rm_log_warning_line(_("apply: leaving duplicate directory %s as-is "
+                              "(use the sh output for directories)"),
+                            file_path);
+        return;
+    }
+
+    for(guint i = 0; i < self->order->len; ++i) {
+        RmApplyAction action = self->order->data[i];
+        if(!rm_fmt_apply_can(self, action, file)) {
+            continue;
+        }
+
+        if(action == RM_APPLY_HARDLINK && file->inode == self->last_original->inode) {
+            RM_DEFINE_PATH(file);
+            rm_fmt_apply_print(self, "Leaving as-is (already hardlinked to original): ",
+                               file_path);
+        } else {
+            rm_fmt_apply_push(self, action, file, self->last_original);
+        }
+        return;
+    }
+}
+
+static void rm_fmt_apply_parse_handlers(RmFmtHandlerApply *self, const char *handler_cfg) {
+    self->order = g_byte_array_new();
+
+    char **order_vec = g_strsplit(handler_cfg, ",", -1);
+    for(int i = 0; order_vec && order_vec[i]; ++i) {
+        bool found = false;
+        for(RmApplyAction n = 0; n < RM_APPLY_N && !found; ++n) {
+            if(ACTION_TO_STRING[n] && strcasecmp(order_vec[i], ACTION_TO_STRING[n]) == 0) {
+                g_byte_array_append(self->order, (guint8 *)&n, 1);
+                found = true;
+            }
+        }
+
+        if(!found) {
+            rm_log_error_line(_("%s is an invalid handler."), order_vec[i]);
+        }
+    }
+
+    g_strfreev(order_vec);
+}
+
+static void rm_fmt_head(RmSession *session, RmFmtHandler *parent, FILE *out) {
+    RmFmtHandlerApply *self = (RmFmtHandlerApply *)parent;
+    RmFmtTable *formats = session->formats;
+
+    self->session = session;
+    self->out = out;
+    self->paranoid = rm_fmt_get_config_value(formats, "apply", "paranoid") != NULL;
+    self->keep_dir_timestamps =
+        rm_fmt_get_config_value(formats, "apply", "keep_dir_timestamps") != NULL;
+    self->dry_run = rm_fmt_get_config_value(formats, "apply", "dry_run") != NULL;
+
+    const char *handler_cfg = rm_fmt_get_config_value(formats, "apply", "handler");
+    if(!session->cfg->replay && handler_cfg == NULL && !self->dry_run) {
+        /* results of a fresh scan were never looked at; don't act on them
+         * unless explicitly asked to */
+        rm_log_warning_line(_("apply: not changing any files without --replay or "
+                              "-c apply:handler=...; doing a dry run"));
+        self->dry_run = true;
+    }
+    rm_fmt_apply_parse_handlers(self, handler_cfg ? handler_cfg : "remove");
+
+    for(guint i = 0; i < self->order->len && !session->mounts && !self->mounts; ++i) {
+        RmApplyAction action = self->order->data[i];
+        if(action == RM_APPLY_CLONE || action == RM_APPLY_REFLINK) {
+            self->mounts = rm_mounts_table_new(session->cfg->fake_fiemap);
+        }
+    }
+
+    self->dir_cache = rm_dir_cache_new(&session->cfg->file_trie, 0);
+    self->pools = g_hash_table_new(NULL, NULL);
+    g_mutex_init(&self->lock);
+}
+
+static void rm_fmt_elem(_UNUSED RmSession *session, RmFmtHandler *parent,
+                        _UNUSED FILE *out, RmFile *file) {
+    RmFmtHandlerApply *self = (RmFmtHandlerApply *)parent;
+
+    switch(file->lint_type) {
+    case RM_LINT_TYPE_EMPTY_FILE:
+    case RM_LINT_TYPE_BADLINK:
+        rm_fmt_apply_push(self, RM_APPLY_REMOVE, file, NULL);
+        break;
+    case RM_LINT_TYPE_EMPTY_DIR:
+        rm_fmt_apply_push(self, RM_APPLY_REMOVE_DIR, file, NULL);
+        break;
+    case RM_LINT_TYPE_DUPE_DIR_CANDIDATE:
+    case RM_LINT_TYPE_DUPE_CANDIDATE:
+        rm_fmt_apply_duplicate(self, file);
+        break;
+    default:
+        /* stripping binaries and fixing ids is left to the sh script */
+        break;
+    }
+}
+
+static void rm_fmt_foot(_UNUSED RmSession *session, RmFmtHandler *parent,
+                        _UNUSED FILE *out) {
+    RmFmtHandlerApply *self = (RmFmtHandlerApply *)parent;
+
+    GHashTableIter iter;
+    gpointer pool = NULL;
+    g_hash_table_iter_init(&iter, self->pools);
+    while(g_hash_table_iter_next(&iter, NULL, &pool)) {
+        /* waits for the queued actions */
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+    g_hash_table_unref(self->pools);
+
+    if(self->n_failed > 0) {
+        rm_log_warning_line(_("apply: %u of %u actions failed"), self->n_failed,
+                            self->n_actions);
+    }
+
+    rm_dir_cache_free(self->dir_cache);
+    if(self->mounts) {
+        rm_mounts_table_destroy(self->mounts);
+    }
+    g_byte_array_free(self->order, true);
+    g_mutex_clear(&self->lock);
+}
+
+static RmFmtHandlerApply APPLY_HANDLER_IMPL = {
+    /* Initialize parent */
+    .parent = {
+        .size = sizeof(APPLY_HANDLER_IMPL),
+        .name = "apply",
+        .head = rm_fmt_head,
+        .elem = rm_fmt_elem,
+        .prog = NULL,
+        .foot = rm_fmt_foot,
+        .valid_keys = {"handler", "paranoid", "keep_dir_timestamps", "dry_run", NULL},
+    },
+    .last_original = NULL,
+};
+
+RmFmtHandler *APPLY_HANDLER = (RmFmtHandler *)&APPLY_HANDLER_IMPL;
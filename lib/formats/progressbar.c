@@ -443,7 +443,7 @@ static void rm_fmt_prog(RmSession *session,
     }
 
     /* Try to get terminal width, might fail on some terminals. */
-    ioctl(fileno(out), TIOCGWINSZ, &self->terminal);
+    ioctl(rm_fmt_fileno(session->formats, out), TIOCGWINSZ, &self->terminal);
 
     // Adjust the text width if we have not a lot of space.
     // Favour text over progress bar in this case until we run out of space.
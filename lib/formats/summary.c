@@ -64,7 +64,7 @@ static void rm_fmt_prog(RmSession *session,
          * Progressbar might leave some junk.
          */
         struct winsize terminal;
-        ioctl(fileno(out), TIOCGWINSZ, &terminal);
+        ioctl(rm_fmt_fileno(session->formats, out), TIOCGWINSZ, &terminal);
         for(int i = 0; i < terminal.ws_col; ++i) {
             fprintf(out, " ");
         }
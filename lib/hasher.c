@@ -23,9 +23,11 @@
  *
  */
 
+#include <errno.h>
 #include <glib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <fcntl.h>
 
@@ -55,6 +57,10 @@
 /* how many buffers to read? */
 const guint16 N_PREADV_BUFFERS = 4;
 
+/* only look for holes (SEEK_DATA/SEEK_HOLE) when reading at least this much;
+ * for smaller reads the extra lseek(2) calls cost more than they could save */
+#define HASHER_SPARSE_MIN_READ (1024 * 1024)
+
 struct _RmHasher {
     RmDigestType digest_type;
     gboolean use_buffered_read;
@@ -87,6 +93,9 @@ struct _RmHasherTask {
     /* user data associated with this specific task */
     gpointer task_user_data;
 
+    /* optional limit for read bandwidth */
+    RmThrottle *throttle;
+
     /* if true then hasher->callback will be called by rm_hashpipe_worker() */
     gboolean finalise;
 };
@@ -99,7 +108,7 @@ static void rm_hasher_task_free(RmHasherTask *self) {
 /* GThreadPool Worker for hashing */
 static void rm_hasher_hashpipe_worker(RmBuffer *buffer, RmHasher *hasher) {
     g_assert(buffer);
-    if(buffer->len > 0) {
+    if(buffer->len > 0 || buffer->zero_run > 0) {
         /* Update digest with buffer->data */
         g_assert(buffer->user_data == NULL);
         rm_digest_buffered_update(hasher->buf_sem, buffer);
@@ -140,6 +149,21 @@ static void rm_hasher_request_readahead(int fd, RmOff seek_offset, RmOff bytes_t
 #endif
 }
 
+/* per-thread read buffer for rm_hasher_hash_small() */
+static GPrivate rm_hasher_small_buf = G_PRIVATE_INIT((GDestroyNotify)g_byte_array_unref);
+
+static guint8 *rm_hasher_small_buf_get(gsize size) {
+    GByteArray *buf = g_private_get(&rm_hasher_small_buf);
+    if(!buf) {
+        buf = g_byte_array_sized_new(size);
+        g_private_set(&rm_hasher_small_buf, buf);
+    }
+    if(buf->len < size) {
+        g_byte_array_set_size(buf, size);
+    }
+    return buf->data;
+}
+
 static gboolean rm_hasher_symlink_read(RmHasher *hasher, GThreadPool *hashpipe,
                                        RmDigest *digest, char *path,
                                        guint64 *bytes_actually_read) {
@@ -168,22 +192,16 @@ static gboolean rm_hasher_symlink_read(RmHasher *hasher, GThreadPool *hashpipe,
  * increments *bytes_read by the actual bytes read */
 
 static gboolean rm_hasher_buffered_read(RmHasher *hasher, GThreadPool *hashpipe,
-                                        RmDigest *digest, char *path, guint64 start_offset,
-                                        guint64 bytes_to_read, guint64 *bytes_actually_read) {
-    FILE *fd = NULL;
-    fd = fopen(path, "rb");
-    if(fd == NULL) {
-        rm_log_info("fopen(3) failed for %s: %s\n", path, g_strerror(errno));
-        return FALSE;
-    }
-
+                                        RmDigest *digest, RmThrottle *throttle,
+                                        FILE *fd, const char *path,
+                                        guint64 start_offset, guint64 bytes_to_read,
+                                        guint64 *bytes_actually_read) {
     gboolean read_to_eof = (bytes_to_read == 0);
     rm_hasher_request_readahead(fileno(fd), start_offset,
                                 read_to_eof ? G_MAXSIZE : bytes_to_read);
 
     if(fseek(fd, start_offset, SEEK_SET) == -1) {
         rm_log_perror("fseek(3) failed");
-        fclose(fd);
         return FALSE;
     }
 
@@ -193,7 +211,13 @@ static gboolean rm_hasher_buffered_read(RmHasher *hasher, GThreadPool *hashpipe,
     while(TRUE) {
         RmBuffer *buffer = rm_buffer_new(hasher->buf_sem, hasher->buf_size);
         gsize want_bytes = MIN(bytes_remaining, hasher->buf_size);
+
+        rm_throttle_take(throttle, want_bytes);
+        gint64 read_start = throttle ? g_get_monotonic_time() : 0;
         gsize bytes_read = fread(buffer->data, 1, want_bytes, fd);
+        if(throttle) {
+            rm_throttle_report_latency(throttle, g_get_monotonic_time() - read_start);
+        }
 
         if(ferror(fd) != 0) {
             rm_log_perror("fread(3) failed");
@@ -226,16 +250,71 @@ static gboolean rm_hasher_buffered_read(RmHasher *hasher, GThreadPool *hashpipe,
             break;
         }
     }
-    fclose(fd);
     return success;
 }
 
+/* Return the number of zero bytes (ie the length of the hole of a sparse file)
+ * starting at file_offset and set *data_end to the end of the data following
+ * them.  Sets *sparse to false if the filesystem can't tell. */
+static guint64 rm_hasher_hole_at(int fd, guint64 file_offset, guint64 *data_end,
+                                 bool *sparse) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t data = lseek(fd, file_offset, SEEK_DATA);
+    if(data == -1 && errno == ENXIO) {
+        /* no data after file_offset; hole up to the end of file */
+        off_t eof = lseek(fd, 0, SEEK_END);
+        *data_end = G_MAXUINT64;
+        return (eof > (off_t)file_offset) ? (guint64)eof - file_offset : 0;
+    } else if(data == -1) {
+        *sparse = false;
+        return 0;
+    }
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    *data_end = (hole > data) ? (guint64)hole : G_MAXUINT64;
+    return data - file_offset;
+#else
+    (void)fd;
+    (void)file_offset;
+    (void)data_end;
+    *sparse = false;
+    return 0;
+#endif
+}
+
+/* Send n_zeros zero bytes to the hasher threadpool without reading them */
+static void rm_hasher_push_zeros(RmHasher *hasher, GThreadPool *hashpipe,
+                                 RmDigest *digest, guint64 n_zeros) {
+    if(digest->type != RM_DIGEST_PARANOID) {
+        /* dataless buffer; see rm_digest_zero_update() */
+        RmBuffer *buffer = rm_buffer_new(hasher->buf_sem, 0);
+        buffer->zero_run = n_zeros;
+        buffer->digest = digest;
+        buffer->user_data = NULL;
+        rm_util_thread_pool_push(hashpipe, buffer);
+        return;
+    }
+
+    /* paranoid digests keep the actual data for comparison */
+    while(n_zeros > 0) {
+        RmBuffer *buffer = rm_buffer_new(hasher->buf_sem, hasher->buf_size);
+        buffer->len = MIN(n_zeros, hasher->buf_size);
+        memset(buffer->data, 0, buffer->len);
+        buffer->digest = digest;
+        buffer->user_data = NULL;
+        rm_util_thread_pool_push(hashpipe, buffer);
+        n_zeros -= buffer->len;
+    }
+}
+
 /* Reads data from file and sends to hasher threadpool
  * returns true if no errors encountered;
- * increments *bytes_read by the actual bytes read */
+ * increments *bytes_read by the actual bytes read
+ * (holes of sparse files are hashed as zeros without reading them) */
 
 static gboolean rm_hasher_unbuffered_read(RmHasher *hasher, GThreadPool *hashpipe,
-                                          RmDigest *digest, char *path,
+                                          RmDigest *digest, RmThrottle *throttle,
+                                          int fd, const char *path,
                                           guint64 start_offset, guint64 bytes_to_read,
                                           guint64 *bytes_actually_read) {
     gint32 bytes_read = 0;
@@ -243,12 +322,6 @@ static gboolean rm_hasher_unbuffered_read(RmHasher *hasher, GThreadPool *hashpip
 
     gboolean read_to_eof = (bytes_to_read == 0);
 
-    int fd = rm_sys_open(path, O_RDONLY);
-    if(fd == -1) {
-        rm_log_info("open(2) failed for %s: %s\n", path, g_strerror(errno));
-        return FALSE;
-    }
-
     /* preadv() is beneficial for large files since it can cut the
      * number of syscall heavily.  I suggest N_PREADV_BUFFERS=4 as good
      * compromise between memory and cpu.
@@ -278,15 +351,52 @@ static gboolean rm_hasher_unbuffered_read(RmHasher *hasher, GThreadPool *hashpip
     gboolean success = FALSE;
     guint64 bytes_remaining = bytes_to_read;
 
+    /* end of the data region file_offset is in (if sparse) */
+    bool sparse = !read_to_eof && bytes_to_read >= HASHER_SPARSE_MIN_READ;
+    guint64 data_end = 0;
+
     while(TRUE) {
+        if(sparse && file_offset >= data_end) {
+            guint64 n_zeros = MIN(rm_hasher_hole_at(fd, file_offset, &data_end, &sparse),
+                                  bytes_remaining);
+            if(n_zeros > 0) {
+                rm_hasher_push_zeros(hasher, hashpipe, digest, n_zeros);
+                file_offset += n_zeros;
+                *bytes_actually_read += n_zeros;
+                bytes_remaining -= n_zeros;
+                if(bytes_remaining == 0) {
+                    success = TRUE;
+                    break;
+                }
+                continue;
+            }
+        }
+
+        /* don't read into the next hole */
+        guint64 vec_bytes = (guint64)n_preadv_buffers * hasher->buf_size;
+        if(sparse) {
+            vec_bytes = MIN(vec_bytes, data_end - file_offset);
+        }
+
         /* allocate buffers for preadv */
         for(int i = 0; i < n_preadv_buffers; ++i) {
+            guint64 vec_offset = MIN((guint64)i * hasher->buf_size, vec_bytes);
             buffers[i] = rm_buffer_new(hasher->buf_sem, hasher->buf_size);
             readvec[i].iov_base = buffers[i]->data;
-            readvec[i].iov_len = hasher->buf_size;
+            readvec[i].iov_len = MIN(hasher->buf_size, vec_bytes - vec_offset);
         }
 
+        guint64 want_bytes = vec_bytes;
+        if(!read_to_eof) {
+            want_bytes = MIN(want_bytes, bytes_remaining);
+        }
+
+        rm_throttle_take(throttle, want_bytes);
+        gint64 read_start = throttle ? g_get_monotonic_time() : 0;
         bytes_read = rm_sys_preadv(fd, readvec, n_preadv_buffers, file_offset);
+        if(throttle) {
+            rm_throttle_report_latency(throttle, g_get_monotonic_time() - read_start);
+        }
 
         if(bytes_read == -1) {
             /* error occurred */
@@ -338,7 +448,6 @@ static gboolean rm_hasher_unbuffered_read(RmHasher *hasher, GThreadPool *hashpip
     }
 
     g_slice_free1(sizeof(*buffers) * n_preadv_buffers, buffers);
-    rm_sys_close(fd);
 
     return success;
 }
@@ -474,6 +583,10 @@ RmHasherTask *rm_hasher_task_new(RmHasher *hasher, RmDigest *digest,
     return self;
 }
 
+void rm_hasher_task_set_throttle(RmHasherTask *task, RmThrottle *throttle) {
+    task->throttle = throttle;
+}
+
 gboolean rm_hasher_task_hash(RmHasherTask *task, char *path, guint64 start_offset,
                              guint64 bytes_to_read, gboolean is_symlink,
                              guint64 *bytes_read_out) {
@@ -484,19 +597,112 @@ gboolean rm_hasher_task_hash(RmHasherTask *task, char *path, guint64 start_offse
         success = rm_hasher_symlink_read(task->hasher, task->hashpipe, task->digest,
                                          path, &bytes_read);
     } else if(task->hasher->use_buffered_read) {
-        success = rm_hasher_buffered_read(task->hasher, task->hashpipe, task->digest,
-                                          path, start_offset, bytes_to_read, &bytes_read);
+        FILE *fd = fopen(path, "rb");
+        if(fd == NULL) {
+            rm_log_info("fopen(3) failed for %s: %s\n", path, g_strerror(errno));
+        } else {
+            success = rm_hasher_buffered_read(task->hasher, task->hashpipe, task->digest,
+                                              task->throttle, fd, path, start_offset,
+                                              bytes_to_read, &bytes_read);
+            fclose(fd);
+        }
+    } else {
+        int fd = rm_sys_open(path, O_RDONLY);
+        if(fd == -1) {
+            rm_log_info("open(2) failed for %s: %s\n", path, g_strerror(errno));
+        } else {
+            success = rm_hasher_unbuffered_read(task->hasher, task->hashpipe,
+                                                task->digest, task->throttle, fd, path,
+                                                start_offset, bytes_to_read, &bytes_read);
+            rm_sys_close(fd);
+        }
+    }
+
+    if(bytes_read_out != NULL) {
+        *bytes_read_out = bytes_read;
+
+    }
+
+    return success;
+}
+
+gboolean rm_hasher_task_hash_fd(RmHasherTask *task, int fd, const char *name,
+                                guint64 start_offset, guint64 bytes_to_read,
+                                guint64 *bytes_read_out) {
+    guint64 bytes_read = 0;
+    gboolean success = false;
+
+    if(task->hasher->use_buffered_read) {
+        /* fclose() would close the caller's fd otherwise */
+        int dup_fd = dup(fd);
+        FILE *stream = (dup_fd == -1) ? NULL : fdopen(dup_fd, "rb");
+        if(stream == NULL) {
+            rm_log_info("fdopen(3) failed for %s: %s\n", name, g_strerror(errno));
+            if(dup_fd != -1) {
+                rm_sys_close(dup_fd);
+            }
+        } else {
+            success = rm_hasher_buffered_read(task->hasher, task->hashpipe, task->digest,
+                                              task->throttle, stream, name, start_offset,
+                                              bytes_to_read, &bytes_read);
+            fclose(stream);
+        }
     } else {
-        success =
-            rm_hasher_unbuffered_read(task->hasher, task->hashpipe, task->digest, path,
-                                      start_offset, bytes_to_read, &bytes_read);
+        success = rm_hasher_unbuffered_read(task->hasher, task->hashpipe, task->digest,
+                                            task->throttle, fd, name, start_offset,
+                                            bytes_to_read, &bytes_read);
     }
 
     if(bytes_read_out != NULL) {
         *bytes_read_out = bytes_read;
+    }
+
+    return success;
+}
+
+gboolean rm_hasher_can_hash_small(RmHasher *hasher, RmDigest *digest, guint64 bytes) {
+    /* paranoid digests keep the buffers, so they need the RmBuffer path */
+    return bytes <= hasher->buf_size && digest->type != RM_DIGEST_PARANOID;
+}
+
+gboolean rm_hasher_hash_small(RmHasher *hasher, RmDigest *digest, RmThrottle *throttle,
+                              int fd, const char *name, guint64 start_offset,
+                              guint64 bytes_to_read, guint64 *bytes_read_out) {
+    g_assert(rm_hasher_can_hash_small(hasher, digest, bytes_to_read));
 
+    guint8 *data = rm_hasher_small_buf_get(hasher->buf_size);
+    guint64 bytes_read = 0;
+    gboolean success = TRUE;
+
+    rm_throttle_take(throttle, bytes_to_read);
+    gint64 read_start = throttle ? g_get_monotonic_time() : 0;
+    while(bytes_read < bytes_to_read) {
+        ssize_t result = pread(fd, data + bytes_read, bytes_to_read - bytes_read,
+                               start_offset + bytes_read);
+        if(result == -1 && errno == EINTR) {
+            continue;
+        } else if(result == -1) {
+            rm_log_perror("pread(2) failed");
+            success = FALSE;
+            break;
+        } else if(result == 0) {
+            rm_log_warning_line(_("Something went wrong reading %s; expected %lli bytes, "
+                                  "got %lli; ignoring"),
+                                name, (long long)bytes_to_read, (long long)bytes_read);
+            success = FALSE;
+            break;
+        }
+        bytes_read += result;
     }
+    if(throttle) {
+        rm_throttle_report_latency(throttle, g_get_monotonic_time() - read_start);
+    }
+
+    rm_digest_update(digest, data, bytes_read);
 
+    if(bytes_read_out != NULL) {
+        *bytes_read_out = bytes_read;
+    }
     return success;
 }
 
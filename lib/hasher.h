@@ -29,6 +29,7 @@
 #include <glib.h>
 #include "checksum.h"
 #include "config.h"
+#include "throttle.h"
 
 /**
  * @file hasher.h
@@ -126,6 +127,15 @@ RmHasherTask *rm_hasher_task_new(RmHasher *hasher,
                                  RmDigest *digest,
                                  gpointer task_user_data);
 
+/**
+ * @brief Pace the reads of a task; latency of each read is reported back to
+ * the throttle.
+ *
+ * @param task  An existing RmHasherTask
+ * @param throttle  Bytes/sec limiter or NULL for no limit
+ **/
+void rm_hasher_task_set_throttle(RmHasherTask *task, RmThrottle *throttle);
+
 /**
  * @brief Read data from a file and send it for hashing in separate thread
  *
@@ -145,6 +155,58 @@ gboolean rm_hasher_task_hash(RmHasherTask *task,
                              gboolean is_symlink,
                              guint64 *bytes_read_out);
 
+/**
+ * @brief Like rm_hasher_task_hash() but read from an already opened file.
+ *
+ * @param task  An existing RmHasherTask
+ * @param fd  Open (readable) fd of the file; stays owned by the caller
+ * @param name  Name of the file, only used for log messages
+ * @param start_offset  Where to start reading the file (number of bytes from start)
+ * @param bytes_to_read  How many bytes to read (pass 0 to read whole file)
+ * @param bytes_read_out Out parameter for the number of bytes physically read.
+ * @retval FALSE if read errors occurred
+ **/
+gboolean rm_hasher_task_hash_fd(RmHasherTask *task,
+                                int fd,
+                                const char *name,
+                                guint64 start_offset,
+                                guint64 bytes_to_read,
+                                guint64 *bytes_read_out);
+
+/**
+ * @brief Check whether rm_hasher_hash_small() can do a read of this size.
+ *
+ * @param digest  The digest that is to be updated
+ * @param bytes  Size of the read; at most the read buffer size
+ **/
+gboolean rm_hasher_can_hash_small(RmHasher *hasher, RmDigest *digest, guint64 bytes);
+
+/**
+ * @brief Read and hash a small file (or the rest of it) in the calling thread.
+ *
+ * For small files the per-task cost of rm_hasher_task_new() and friends
+ * (hashpipe handoff, read buffers, finisher and callback) is far above the cost
+ * of the data itself.  This reads into a per-thread buffer and updates the
+ * digest right away; the hasher's callback is not called.
+ *
+ * @param digest  The digest to update (see rm_hasher_can_hash_small())
+ * @param throttle  Bytes/sec limiter or NULL for no limit
+ * @param fd  Open (readable) fd of the file; stays owned by the caller
+ * @param name  Name of the file, only used for log messages
+ * @param start_offset  Where to start reading the file
+ * @param bytes_to_read  How many bytes to read
+ * @param bytes_read_out Out parameter for the number of bytes physically read.
+ * @retval FALSE if read errors occurred
+ **/
+gboolean rm_hasher_hash_small(RmHasher *hasher,
+                              RmDigest *digest,
+                              RmThrottle *throttle,
+                              int fd,
+                              const char *name,
+                              guint64 start_offset,
+                              guint64 bytes_to_read,
+                              guint64 *bytes_read_out);
+
 /**
  * @brief Finalise a hashing task
  *
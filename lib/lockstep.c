@@ -0,0 +1,383 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lockstep.h"
+#include "md-scheduler.h"
+#include "utilities.h"
+
+/* smallest block that is worth a round of reads */
+#define RM_LOCKSTEP_MIN_BLOCK (4096)
+
+/* groups with more (distinct) files than this don't keep their files open
+ * between steps but reopen them for each block */
+#define RM_LOCKSTEP_MAX_OPEN (256)
+
+/* bytes per read in rm_lockstep_equal() */
+#define RM_LOCKSTEP_EQUAL_BLOCK (128 * 1024)
+
+/* settings shared by all files of one rm_lockstep_split() call */
+typedef struct RmLockstep {
+    RmOff block_size;
+    bool keep_open;
+} RmLockstep;
+
+typedef struct RmLockstepFile {
+    /* the file that is read */
+    RmFile *file;
+
+    /* hardlinks of file; they share its data so are not read themselves */
+    GSList *links;
+
+    /* open fd, or -1 */
+    int fd;
+
+    /* read limit of the file's device (see rm_mds_device_get_throttle), or NULL */
+    RmThrottle *throttle;
+
+    /* data of the current step; allocated on first use */
+    guint8 *block;
+} RmLockstepFile;
+
+static RmLockstepFile *rm_lockstep_file_new(RmFile *file, GSList *links) {
+    RmLockstepFile *self = g_slice_new0(RmLockstepFile);
+    self->file = file;
+    self->links = links;
+    self->fd = -1;
+    self->throttle = (file->disk) ? rm_mds_device_get_throttle(file->disk) : NULL;
+    return self;
+}
+
+/* move the file and its links to queue and free self */
+static void rm_lockstep_file_finish(RmLockstepFile *self, GQueue *queue) {
+    g_queue_push_tail(queue, self->file);
+    for(GSList *iter = self->links; iter; iter = iter->next) {
+        g_queue_push_tail(queue, iter->data);
+    }
+
+    if(self->fd != -1) {
+        rm_sys_close(self->fd);
+    }
+    g_slist_free(self->links);
+    g_free(self->block);
+    g_slice_free(RmLockstepFile, self);
+}
+
+/* read len bytes at offset into self->block */
+static bool rm_lockstep_file_pread(RmLockstepFile *self, RmOff offset, RmOff len,
+                                   RmLockstep *lockstep) {
+    if(!self->block) {
+        self->block = g_malloc(lockstep->block_size);
+    }
+
+    rm_throttle_take(self->throttle, len);
+    gint64 read_start = self->throttle ? g_get_monotonic_time() : 0;
+
+    RmOff done = 0;
+    while(done < len) {
+        ssize_t result = pread(self->fd, self->block + done, len - done, offset + done);
+        if(result == -1 && errno == EINTR) {
+            continue;
+        } else if(result <= 0) {
+            RmFile *file = self->file;
+            RM_DEFINE_PATH(file);
+            rm_log_info("pread(2) failed for %s: %s\n", file_path,
+                        (result == 0) ? "unexpected end of file" : g_strerror(errno));
+            break;
+        }
+        done += result;
+    }
+
+    if(self->throttle) {
+        rm_throttle_report_latency(self->throttle, g_get_monotonic_time() - read_start);
+    }
+    return done == len;
+}
+
+/* read len bytes at offset into self->block; files are read rather than
+ * mmap(2)ed since a file that shrinks while being compared would make the
+ * mapping fault (SIGBUS) instead of failing the read */
+static bool rm_lockstep_file_read(RmLockstepFile *self, RmOff offset, RmOff len,
+                                  RmLockstep *lockstep) {
+    if(self->fd == -1) {
+        RmFile *file = self->file;
+        RM_DEFINE_PATH(file);
+        self->fd = rm_sys_open(file_path, O_RDONLY);
+        if(self->fd == -1) {
+            rm_log_info("open(2) failed for %s: %s\n", file_path, g_strerror(errno));
+            return false;
+        }
+#if HAVE_POSIX_FADVISE
+        if(lockstep->keep_open) {
+            posix_fadvise(self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+    }
+
+    bool success = rm_lockstep_file_pread(self, offset, len, lockstep);
+
+    if(!lockstep->keep_open) {
+        rm_sys_close(self->fd);
+        self->fd = -1;
+    }
+    return success;
+}
+
+static guint rm_lockstep_inode_hash(const RmFile *file) {
+    return (guint)(file->inode ^ file->dev);
+}
+
+static gboolean rm_lockstep_inode_equal(const RmFile *a, const RmFile *b) {
+    return a->inode == b->inode && a->dev == b->dev;
+}
+
+static gint rm_lockstep_cmp_length(const GQueue *a, const GQueue *b) {
+    return SIGN_DIFF(b->length, a->length);
+}
+
+GList *rm_lockstep_split(GQueue *files, RmOff block_size, RmOff mem_limit,
+                         GQueue *failed) {
+    if(files->length == 0) {
+        return NULL;
+    }
+
+    RmOff file_size = ((RmFile *)files->head->data)->file_size;
+
+    /* one reader per inode; the other paths of it ride along */
+    GHashTable *inodes = g_hash_table_new((GHashFunc)rm_lockstep_inode_hash,
+                                          (GEqualFunc)rm_lockstep_inode_equal);
+    GPtrArray *readers = g_ptr_array_new();
+    RmFile *file = NULL;
+    while((file = g_queue_pop_head(files))) {
+        gpointer links = NULL;
+        if(g_hash_table_lookup_extended(inodes, file, NULL, &links)) {
+            /* keeps the reader as key */
+            g_hash_table_insert(inodes, file, g_slist_prepend(links, file));
+        } else {
+            g_hash_table_insert(inodes, file, NULL);
+            g_ptr_array_add(readers, file);
+        }
+    }
+
+    guint n = readers->len;
+    RmLockstep lockstep;
+    lockstep.keep_open = (n <= RM_LOCKSTEP_MAX_OPEN);
+    lockstep.block_size = MIN(block_size, MAX(RM_LOCKSTEP_MIN_BLOCK, mem_limit / n));
+
+    /* sets of files that were identical so far */
+    GPtrArray *cohorts = g_ptr_array_new();
+    GPtrArray *first = g_ptr_array_sized_new(n);
+    for(guint i = 0; i < n; ++i) {
+        file = readers->pdata[i];
+        GSList *links = g_hash_table_lookup(inodes, file);
+        g_ptr_array_add(first, rm_lockstep_file_new(file, links));
+    }
+    g_ptr_array_add(cohorts, first);
+    g_ptr_array_free(readers, TRUE);
+    g_hash_table_destroy(inodes);
+
+    GList *sets = NULL;
+    RmOff len = 0;
+    for(RmOff offset = 0; offset < file_size && cohorts->len > 0; offset += len) {
+        len = MIN(lockstep.block_size, file_size - offset);
+        GPtrArray *next_cohorts = g_ptr_array_new();
+
+        for(guint c = 0; c < cohorts->len; ++c) {
+            GPtrArray *cohort = cohorts->pdata[c];
+
+            /* split the cohort by the content of this block */
+            GPtrArray *buckets = g_ptr_array_new();
+            for(guint i = 0; i < cohort->len; ++i) {
+                RmLockstepFile *member = cohort->pdata[i];
+                if(!rm_lockstep_file_read(member, offset, len, &lockstep)) {
+                    rm_lockstep_file_finish(member, failed);
+                    continue;
+                }
+
+                GPtrArray *bucket = NULL;
+                for(guint b = 0; b < buckets->len && !bucket; ++b) {
+                    GPtrArray *candidate = buckets->pdata[b];
+                    RmLockstepFile *head = candidate->pdata[0];
+                    if(memcmp(head->block, member->block, len) == 0) {
+                        bucket = candidate;
+                    }
+                }
+                if(!bucket) {
+                    bucket = g_ptr_array_new();
+                    g_ptr_array_add(buckets, bucket);
+                }
+                g_ptr_array_add(bucket, member);
+            }
+
+            for(guint b = 0; b < buckets->len; ++b) {
+                GPtrArray *bucket = buckets->pdata[b];
+                if(bucket->len > 1) {
+                    g_ptr_array_add(next_cohorts, bucket);
+                } else {
+                    /* unique from here on; no need to read any further */
+                    GQueue *set = g_queue_new();
+                    rm_lockstep_file_finish(bucket->pdata[0], set);
+                    sets = g_list_prepend(sets, set);
+                    g_ptr_array_free(bucket, TRUE);
+                }
+            }
+            g_ptr_array_free(buckets, TRUE);
+            g_ptr_array_free(cohort, TRUE);
+        }
+
+        g_ptr_array_free(cohorts, TRUE);
+        cohorts = next_cohorts;
+    }
+
+    /* what is left matched all the way */
+    for(guint c = 0; c < cohorts->len; ++c) {
+        GPtrArray *cohort = cohorts->pdata[c];
+        GQueue *set = g_queue_new();
+        for(guint i = 0; i < cohort->len; ++i) {
+            rm_lockstep_file_finish(cohort->pdata[i], set);
+        }
+        sets = g_list_prepend(sets, set);
+        g_ptr_array_free(cohort, TRUE);
+    }
+    g_ptr_array_free(cohorts, TRUE);
+
+    return g_list_sort(sets, (GCompareFunc)rm_lockstep_cmp_length);
+}
+
+void rm_lockstep_free(GList *sets) {
+    g_list_free_full(sets, (GDestroyNotify)g_queue_free);
+}
+
+/* read exactly len bytes from fd's current position */
+static bool rm_lockstep_read_full(int fd, guint8 *buf, RmOff len, const char *path) {
+    RmOff done = 0;
+    while(done < len) {
+        ssize_t result = read(fd, buf + done, len - done);
+        if(result == -1 && errno == EINTR) {
+            continue;
+        } else if(result <= 0) {
+            rm_log_info("read(2) failed for %s: %s\n", path,
+                        (result == 0) ? "unexpected end of file" : g_strerror(errno));
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+RmLockstepResult rm_lockstep_equal(const char **paths, guint n) {
+    if(n > RM_LOCKSTEP_MAX_OPEN) {
+        return RM_LOCKSTEP_UNDECIDED;
+    }
+
+    /* stat everything before judging sizes; a directory among the paths
+     * needs the full session even if sizes differ */
+    RmStat *stats = g_new0(RmStat, n);
+    for(guint i = 0; i < n; ++i) {
+        if(rm_sys_lstat(paths[i], &stats[i]) == -1 || !S_ISREG(stats[i].st_mode)) {
+            g_free(stats);
+            return RM_LOCKSTEP_UNDECIDED;
+        }
+    }
+
+    RmOff file_size = stats[0].st_size;
+    for(guint i = 1; i < n; ++i) {
+        if((RmOff)stats[i].st_size != file_size) {
+            g_free(stats);
+            return RM_LOCKSTEP_DIFFERENT;
+        }
+    }
+
+    /* one fd per distinct inode */
+    int *fds = g_new(int, n);
+    guint n_fds = 0;
+    RmLockstepResult result = RM_LOCKSTEP_EQUAL;
+    const char **fd_paths = g_new(const char *, n);
+
+    for(guint i = 0; i < n && result == RM_LOCKSTEP_EQUAL; ++i) {
+        bool is_link = false;
+        for(guint j = 0; j < i && !is_link; ++j) {
+            is_link = stats[i].st_dev == stats[j].st_dev &&
+                      stats[i].st_ino == stats[j].st_ino;
+        }
+        if(is_link) {
+            continue;
+        }
+
+        int fd = rm_sys_open(paths[i], O_RDONLY);
+        if(fd == -1) {
+            rm_log_info("open(2) failed for %s: %s\n", paths[i], g_strerror(errno));
+            result = RM_LOCKSTEP_UNDECIDED;
+            break;
+        }
+#if HAVE_POSIX_FADVISE
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        fd_paths[n_fds] = paths[i];
+        fds[n_fds++] = fd;
+    }
+
+    /* the first file's block is the reference for all others */
+    RmOff block_size = MIN(RM_LOCKSTEP_EQUAL_BLOCK, MAX(file_size, 1));
+    guint8 *first = g_malloc(block_size);
+    guint8 *other = g_malloc(block_size);
+
+    for(RmOff offset = 0; offset < file_size && n_fds > 1 &&
+                          result == RM_LOCKSTEP_EQUAL; offset += block_size) {
+        RmOff len = MIN(block_size, file_size - offset);
+        if(!rm_lockstep_read_full(fds[0], first, len, fd_paths[0])) {
+            result = RM_LOCKSTEP_UNDECIDED;
+            break;
+        }
+
+        for(guint i = 1; i < n_fds; ++i) {
+            if(!rm_lockstep_read_full(fds[i], other, len, fd_paths[i])) {
+                result = RM_LOCKSTEP_UNDECIDED;
+                break;
+            }
+            if(memcmp(first, other, len) != 0) {
+                rm_log_debug_line("%s and %s differ in block at %" LLU, fd_paths[0],
+                                  fd_paths[i], offset);
+                result = RM_LOCKSTEP_DIFFERENT;
+                break;
+            }
+        }
+    }
+
+    for(guint i = 0; i < n_fds; ++i) {
+        rm_sys_close(fds[i]);
+    }
+    g_free(first);
+    g_free(other);
+    g_free(fd_paths);
+    g_free(fds);
+    g_free(stats);
+    return result;
+}
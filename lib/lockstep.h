@@ -0,0 +1,94 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#ifndef RM_LOCKSTEP_H
+#define RM_LOCKSTEP_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "file.h"
+
+/**
+ * @file lockstep.h
+ * @brief Byte-by-byte comparison of a group of files read side by side.
+ *
+ * All members of a group are read one block per file at a time.  After each
+ * step the group is split wherever the blocks differ, and files that end up
+ * alone are dropped (and closed) right away, so memory use stays at
+ * files × block no matter how large the files are.  Hardlinks are only read
+ * once.
+ *
+ * Used by the shredder to verify hash-matched groups (--lockstep), which gives
+ * the same guarantee as --paranoid without holding whole increments of every
+ * file in memory.  Also used for --paranoid groups that were too big for the
+ * paranoid memory budget.
+ **/
+
+/**
+ * @brief Split files of the same size into sets of byte-identical files.
+ *
+ * Reads are charged to the throttle of each file's device (file->disk, if
+ * set), so they respect --limit-read-rate like the hashing reads.
+ *
+ * @param files  RmFiles of equal size (regular files only); emptied on return
+ * @param block_size  Max. bytes read per file and step
+ * @param mem_limit  Max. bytes for the blocks of all files together; the
+ *                   block size is reduced to stay within it
+ * @param failed  Files that could not be read are appended here
+ * @retval GList of GQueues of RmFiles with identical content, largest set
+ *         first; sets of single files are included.  Free with
+ *         rm_lockstep_free().
+ **/
+GList *rm_lockstep_split(GQueue *files, RmOff block_size, RmOff mem_limit,
+                         GQueue *failed);
+
+/**
+ * @brief Free the result of rm_lockstep_split() (but not the files).
+ **/
+void rm_lockstep_free(GList *sets);
+
+typedef enum RmLockstepResult {
+    RM_LOCKSTEP_EQUAL,
+    RM_LOCKSTEP_DIFFERENT,
+    /* not something we can answer (or an error); use the full session */
+    RM_LOCKSTEP_UNDECIDED,
+} RmLockstepResult;
+
+/**
+ * @brief Check if all paths are regular files with the same content.
+ *
+ * Sizes are compared first; then the files are read block by block, each
+ * block compared against the first file, stopping at the first difference.
+ * Paths that point to the same inode are read only once.  Used by --equal to
+ * answer the common case without traversal and hashing.
+ *
+ * @retval RM_LOCKSTEP_UNDECIDED if a path is not a regular file, there are
+ *         too many paths to keep open, or a file could not be read.
+ **/
+RmLockstepResult rm_lockstep_equal(const char **paths, guint n);
+
+#endif /* end of include guard */
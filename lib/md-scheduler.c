@@ -28,16 +28,6 @@
 
 #define _RM_MDS_DEBUG 0
 
-/* How many milliseconds to sleep if we encounter an empty file queue.
- * This prevents a "starving" RmShredDevice from hogging cpu and cluttering up
- * debug messages by continually recycling back to the joiner.
- */
-#if _RM_MDS_DEBUG
-#define MDS_EMPTYQUEUE_SLEEP_US (60 * 1000 * 1000) /* 60 seconds */
-#else
-#define MDS_EMPTYQUEUE_SLEEP_US (50 * 1000) /* 0.05 second */
-#endif
-
 ///////////////////////////////////////
 //            Structures             //
 ///////////////////////////////////////
@@ -80,6 +70,23 @@ struct _RmMDS {
     gint max_threads;
     gint threads_per_disk;
 
+    /* least number of threads for rotational disks when threads_per_disk is 0
+     * (see rm_mds_set_rotational_threads) */
+    gint rotational_threads;
+
+    /* per-device read limits (see rm_mds_set_throttle) */
+    gdouble bytes_per_sec;
+    gdouble ops_per_sec;
+    bool adaptive_throttle;
+
+    /* called for tasks that are coming up soon (see rm_mds_set_prefetch) */
+    RmMDSPrefetchFunc prefetch;
+    gint prefetch_depth;
+
+    /* incremented by rm_mds_kick(); lets a stalled device worker notice a kick
+     * that happened during its pass */
+    gint kick_gen;
+
     /* pointer to user data to be passed to func */
     gpointer user_data;
 };
@@ -93,19 +100,36 @@ struct _RmMDSDevice {
     /* Device's physical disk ID (only used for debug info) */
     dev_t disk;
 
-    /* Sorted list of tasks queued for execution */
-    GSList *sorted_tasks;
+    /* Binary heap of tasks in the current sweep, ordered by rm_mds_task_cmp() */
+    GPtrArray *tasks;
+
+    /* Binary heap of tasks which are behind the current sweep position;
+     * they become the next sweep */
+    GPtrArray *next_tasks;
+
+    /* Position of the most recently started task */
+    RmMDSTask head;
+    bool has_head;
 
-    /* Stack for tasks that will be sorted and carried out next pass */
-    GSList *unsorted_tasks;
+    /* Sequence number for the next pushed task */
+    guint64 seq;
+
+    /* Number of worker threads waiting for work outside of the threadpool */
+    gint parked;
+
+    /* True if the last pass had tasks but none of them could be processed;
+     * parked workers then wait for rm_mds_kick() */
+    bool stalled;
 
     /* Lock for access to:
-     *  self->sorted_tasks
-     *  self->unsorted_tasks
+     *  self->tasks
+     *  self->next_tasks
+     *  self->head
+     *  self->parked
+     *  self->stalled
      *  self->ref_count
      */
     GMutex lock;
-    GCond cond;
 
     /* Reference count for self */
     gint ref_count;
@@ -115,8 +139,18 @@ struct _RmMDSDevice {
 
     /* is disk rotational? */
     gboolean is_rotational;
+
+    /* number of concurrent readers the disk performs best with */
+    gint queue_depth;
+
+    /* rate limits for bytes read / tasks started; NULL if unlimited */
+    RmThrottle *bytes_throttle;
+    RmThrottle *ops_throttle;
 };
 
+/* device whose worker is running in the current thread (if any) */
+static GPrivate rm_mds_current_device = G_PRIVATE_INIT(NULL);
+
 //////////////////////////////////////////////
 //  Internal Structure Init's & Destroyers  //
 //////////////////////////////////////////////
@@ -140,108 +174,294 @@ static RmMDSDevice *rm_mds_device_new(RmMDS *mds, const dev_t disk) {
     RmMDSDevice *self = g_slice_new0(RmMDSDevice);
 
     g_mutex_init(&self->lock);
-    g_cond_init(&self->cond);
 
     self->mds = mds;
     self->ref_count = 0;
     self->threads = 0;
     self->disk = disk;
+    self->tasks = g_ptr_array_new();
+    self->next_tasks = g_ptr_array_new();
+    self->bytes_throttle = rm_throttle_new(mds->bytes_per_sec, mds->adaptive_throttle);
+    self->ops_throttle = rm_throttle_new(mds->ops_per_sec, false);
 
     if(mds->fake_disk) {
         self->is_rotational = (disk % 2 == 0);
+        self->queue_depth =
+            self->is_rotational ? RM_QUEUE_DEPTH_ROTATIONAL : RM_QUEUE_DEPTH_SSD;
     } else {
         self->is_rotational = !rm_mounts_is_nonrotational(mds->mount_table, disk);
+        self->queue_depth = rm_mounts_get_queue_depth(mds->mount_table, disk);
     }
 
-    rm_log_debug_line("Created new RmMDSDevice for %srotational disk #%" LLU,
-                      self->is_rotational ? "" : "non-", (RmOff)disk);
+    rm_log_debug_line("Created new RmMDSDevice for %srotational disk #%" LLU
+                      " (queue depth %d)",
+                      self->is_rotational ? "" : "non-", (RmOff)disk, self->queue_depth);
     return self;
 }
 
 /** @brief  Free mem allocated to an RmMDSDevice
  **/
 static void rm_mds_device_free(RmMDSDevice *self) {
+    g_ptr_array_foreach(self->tasks, (GFunc)rm_mds_task_free, NULL);
+    g_ptr_array_foreach(self->next_tasks, (GFunc)rm_mds_task_free, NULL);
+    g_ptr_array_free(self->tasks, TRUE);
+    g_ptr_array_free(self->next_tasks, TRUE);
+    rm_throttle_free(self->bytes_throttle);
+    rm_throttle_free(self->ops_throttle);
     g_mutex_clear(&self->lock);
-    g_cond_clear(&self->cond);
     g_slice_free(RmMDSDevice, self);
 }
 
+///////////////////////////////////////
+//          Task Heap              //
+///////////////////////////////////////
+
+/** @brief Task order: mds->prioritiser, then first come first served; without
+ * a prioritiser the newest task goes first.
+ **/
+static gint rm_mds_task_cmp(const RmMDS *mds, const RmMDSTask *a, const RmMDSTask *b) {
+    if(mds->prioritiser) {
+        gint result = mds->prioritiser(a, b);
+        if(result != 0) {
+            return result;
+        }
+        return SIGN_DIFF(a->seq, b->seq);
+    }
+    return SIGN_DIFF(b->seq, a->seq);
+}
+
+static void rm_mds_heap_push(const RmMDS *mds, GPtrArray *heap, RmMDSTask *task) {
+    g_ptr_array_add(heap, task);
+
+    /* sift up */
+    guint i = heap->len - 1;
+    while(i > 0) {
+        guint parent = (i - 1) / 2;
+        if(rm_mds_task_cmp(mds, task, heap->pdata[parent]) >= 0) {
+            break;
+        }
+        heap->pdata[i] = heap->pdata[parent];
+        i = parent;
+    }
+    heap->pdata[i] = task;
+}
+
+static RmMDSTask *rm_mds_heap_pop(const RmMDS *mds, GPtrArray *heap) {
+    if(heap->len == 0) {
+        return NULL;
+    }
+
+    RmMDSTask *result = heap->pdata[0];
+    RmMDSTask *last = g_ptr_array_steal_index(heap, heap->len - 1);
+    guint n = heap->len;
+    if(n == 0) {
+        return result;
+    }
+
+    /* sift down */
+    guint i = 0;
+    while(2 * i + 1 < n) {
+        guint child = 2 * i + 1;
+        if(child + 1 < n &&
+           rm_mds_task_cmp(mds, heap->pdata[child + 1], heap->pdata[child]) < 0) {
+            child++;
+        }
+        if(rm_mds_task_cmp(mds, last, heap->pdata[child]) <= 0) {
+            break;
+        }
+        heap->pdata[i] = heap->pdata[child];
+        i = child;
+    }
+    heap->pdata[i] = last;
+    return result;
+}
+
+/** @brief Find (in order) the first n tasks that rm_mds_heap_pop() would return,
+ * without popping them.  Walks the heap best-first; n is expected to be small.
+ * @retval number of tasks written to result
+ **/
+static gint rm_mds_heap_peek(const RmMDS *mds, GPtrArray *heap, gint n,
+                             RmMDSTask **result) {
+    /* frontier of heap indices whose parents have already been visited */
+    guint frontier[2 * RM_MDS_PREFETCH_MAX + 1];
+    gint frontier_len = 0;
+    gint found = 0;
+
+    if(heap->len > 0) {
+        frontier[frontier_len++] = 0;
+    }
+
+    while(found < n && frontier_len > 0) {
+        gint best = 0;
+        for(gint i = 1; i < frontier_len; ++i) {
+            if(rm_mds_task_cmp(mds, heap->pdata[frontier[i]],
+                               heap->pdata[frontier[best]]) < 0) {
+                best = i;
+            }
+        }
+
+        guint index = frontier[best];
+        frontier[best] = frontier[--frontier_len];
+        result[found++] = heap->pdata[index];
+
+        for(guint child = 2 * index + 1; child <= 2 * index + 2; ++child) {
+            if(child < heap->len) {
+                frontier[frontier_len++] = child;
+            }
+        }
+    }
+    return found;
+}
+
 ///////////////////////////////////////
 //    RmMDSDevice Implementation   //
 ///////////////////////////////////////
 
+/** @brief Hand up to count parked workers back to the threadpool.
+ *  Needs device->lock.
+ **/
+static void rm_mds_device_wake(RmMDSDevice *device, gint count) {
+    count = MIN(count, device->parked);
+    device->parked -= count;
+    for(gint i = 0; i < count; ++i) {
+        rm_util_thread_pool_push(device->mds->pool, device);
+    }
+}
+
 /** @brief Mutex-protected task pusher
  **/
 
 static void rm_mds_push_task_impl(RmMDSDevice *device, RmMDSTask *task) {
+    RmMDS *mds = device->mds;
     g_mutex_lock(&device->lock);
     {
-        device->unsorted_tasks = g_slist_prepend(device->unsorted_tasks, task);
-        g_cond_signal(&device->cond);
+        task->seq = device->seq++;
+
+        if(!mds->prioritiser || !device->has_head ||
+           mds->prioritiser(task, &device->head) > 0) {
+            /* still ahead of us; can join the current sweep */
+            rm_mds_heap_push(mds, device->tasks, task);
+        } else {
+            rm_mds_heap_push(mds, device->next_tasks, task);
+        }
+
+        if(g_private_get(&rm_mds_current_device) != device) {
+            /* outside news; might be something a stalled device can do */
+            device->stalled = FALSE;
+        }
+
+        if(!device->stalled) {
+            rm_mds_device_wake(device, 1);
+        }
     }
     g_mutex_unlock(&device->lock);
 }
 
-/** @brief GCompareDataFunc wrapper for mds->prioritiser
+/** @brief Hint the tasks which will be popped next so that their IO can
+ * overlap with the task being started.  Only done for non-rotational devices;
+ * on a rotational disk the extra requests would just compete with the sweep.
+ * Needs device->lock.
  **/
-static gint rm_mds_compare(const RmMDSTask *a, const RmMDSTask *b,
-                           RmMDSSortFunc prioritiser) {
-    gint result = prioritiser(a, b);
-    return result;
+static void rm_mds_device_prefetch(RmMDSDevice *device) {
+    RmMDS *mds = device->mds;
+    if(!mds->prefetch || device->is_rotational) {
+        return;
+    }
+
+    RmMDSTask *upcoming[RM_MDS_PREFETCH_MAX];
+    gint n = rm_mds_heap_peek(mds, device->tasks, mds->prefetch_depth, upcoming);
+    for(gint i = 0; i < n; ++i) {
+        if(!upcoming[i]->prefetched) {
+            upcoming[i]->prefetched = TRUE;
+            mds->prefetch(upcoming[i], mds->user_data);
+        }
+    }
+}
+
+/** @brief Pop the next task of the current sweep
+ **/
+static RmMDSTask *rm_mds_device_pop(RmMDSDevice *device) {
+    RmMDSTask *task = NULL;
+    g_mutex_lock(&device->lock);
+    {
+        task = rm_mds_heap_pop(device->mds, device->tasks);
+        if(task) {
+            device->head = *task;
+            device->has_head = TRUE;
+            rm_mds_device_prefetch(device);
+        }
+    }
+    g_mutex_unlock(&device->lock);
+    return task;
 }
 
 /** @brief RmMDSDevice worker thread
  **/
 static void rm_mds_factory(RmMDSDevice *device, RmMDS *mds) {
-    /* rm_mds_factory processes tasks from device->task_list.
+    /* rm_mds_factory processes the current sweep of tasks from device->tasks.
      * After completing one pass of the device, returns self to the
-     * mds->pool threadpool. */
+     * mds->pool threadpool, or parks itself until there is more to do. */
     gint processed = 0;
+    gint refused = 0;
+    gint kick_gen = g_atomic_int_get(&mds->kick_gen);
+
     g_mutex_lock(&device->lock);
     {
-        /* check for empty queues - if so then wait a little while before giving up */
-        if(!device->sorted_tasks && !device->unsorted_tasks && device->ref_count > 0) {
-            /* timed wait for signal from rm_mds_push_task_impl() */
-            gint64 end_time = g_get_monotonic_time() + MDS_EMPTYQUEUE_SLEEP_US;
-            g_cond_wait_until(&device->cond, &device->lock, end_time);
-        }
-
-        /* sort and merge task lists */
-        if(device->unsorted_tasks) {
-            if(mds->prioritiser) {
-                device->sorted_tasks = g_slist_concat(
-                    g_slist_sort_with_data(device->unsorted_tasks,
-                                           (GCompareDataFunc)rm_mds_compare,
-                                           (RmMDSSortFunc)mds->prioritiser),
-                    device->sorted_tasks);
-            } else {
-                device->sorted_tasks =
-                    g_slist_concat(device->unsorted_tasks, device->sorted_tasks);
-            }
-            device->unsorted_tasks = NULL;
+        if(device->tasks->len == 0) {
+            /* start the next sweep */
+            GPtrArray *swap = device->tasks;
+            device->tasks = device->next_tasks;
+            device->next_tasks = swap;
         }
     }
     g_mutex_unlock(&device->lock);
 
-    /* process tasks from device->sorted_tasks */
+    g_private_set(&rm_mds_current_device, device);
+
     RmMDSTask *task = NULL;
-    while(processed < mds->pass_quota &&
-          (task = rm_util_slist_pop(&device->sorted_tasks, &device->lock))) {
-        if(mds->func(task->task_data, mds->user_data)) {
+    while(processed < mds->pass_quota && (task = rm_mds_device_pop(device))) {
+        rm_throttle_take(device->ops_throttle, 1);
+        gint result = mds->func(task->task_data, mds->user_data);
+        rm_mds_task_free(task);
+
+        if(result) {
             /* task succeeded; update counters */
             ++processed;
+        } else {
+            ++refused;
+            if(!mds->prioritiser) {
+                /* refused task went back to the top of the stack; don't spin on it */
+                break;
+            }
         }
-        rm_mds_task_free(task);
     }
 
-    if(rm_mds_device_ref(device, 0) > 0) {
-        /* return self to pool for further processing */
-        if(processed == 0) {
-            /* stalled queue; chill for a bit */
-            g_usleep(1000);
+    g_private_set(&rm_mds_current_device, NULL);
+
+    bool finished = FALSE;
+    g_mutex_lock(&device->lock);
+    {
+        bool is_empty = (device->tasks->len + device->next_tasks->len == 0);
+
+        if(device->ref_count == 0) {
+            finished = TRUE;
+        } else if(is_empty) {
+            /* idle; rm_mds_push_task_impl() will hand us back to the pool */
+            device->parked++;
+        } else if(processed == 0 && refused > 0 &&
+                  kick_gen == g_atomic_int_get(&mds->kick_gen)) {
+            /* all tasks were refused; wait for rm_mds_kick() */
+            device->stalled = TRUE;
+            device->parked++;
+        } else {
+            /* return self to pool for further processing */
+            device->stalled = FALSE;
+            rm_util_thread_pool_push(mds->pool, device);
         }
-        rm_util_thread_pool_push(mds->pool, device);
-    } else if(g_atomic_int_dec_and_test(&device->threads)) {
+    }
+    g_mutex_unlock(&device->lock);
+
+    if(finished && g_atomic_int_dec_and_test(&device->threads)) {
         /* free self and signal to rm_mds_free() */
         g_mutex_lock(&mds->lock);
         {
@@ -255,6 +475,20 @@ static void rm_mds_factory(RmMDSDevice *device, RmMDS *mds) {
     }
 }
 
+/** @brief Number of worker threads for device; mds->threads_per_disk if set,
+ *  else the disk's own queue depth (but at least mds->rotational_threads on
+ *  rotational disks)
+ **/
+static gint rm_mds_device_threads(RmMDSDevice *device, RmMDS *mds) {
+    if(mds->threads_per_disk > 0) {
+        return mds->threads_per_disk;
+    }
+    if(device->is_rotational) {
+        return MAX(device->queue_depth, mds->rotational_threads);
+    }
+    return device->queue_depth;
+}
+
 /** @brief Push an RmMDSDevice to the threadpool
  **/
 void rm_mds_device_start(RmMDSDevice *device, RmMDS *mds) {
@@ -262,10 +496,11 @@ void rm_mds_device_start(RmMDSDevice *device, RmMDS *mds) {
     g_assert(device->threads == 0);
 
     g_assert(mds);
-    device->threads = mds->threads_per_disk;
+    gint threads = rm_mds_device_threads(device, mds);
+    device->threads = threads;
     g_mutex_lock(&device->lock);
     {
-        for(int i = 0; i < mds->threads_per_disk; ++i) {
+        for(int i = 0; i < threads; ++i) {
             rm_log_debug_line("Starting disk %" LLU " (pointer %p) thread #%i",
                               (RmOff)device->disk, device, i + 1);
             rm_util_thread_pool_push(mds->pool, device);
@@ -276,12 +511,20 @@ void rm_mds_device_start(RmMDSDevice *device, RmMDS *mds) {
 
 void rm_mds_start(RmMDS *mds) {
     guint disk_count = g_hash_table_size(mds->disks);
-    guint threads = CLAMP(mds->threads_per_disk * disk_count, 1, (guint)mds->max_threads);
+    GList *disks = g_hash_table_get_values(mds->disks);
+
+    guint wanted = 0;
+    for(GList *iter = disks; iter; iter = iter->next) {
+        wanted += rm_mds_device_threads(iter->data, mds);
+    }
+
+    /* if no disks are known yet, they will be added while running */
+    guint threads = (disk_count > 0) ? CLAMP(wanted, 1, (guint)mds->max_threads)
+                                     : (guint)mds->max_threads;
     rm_log_debug_line("Starting MDS scheduler with %i threads", threads);
 
     mds->pool = rm_util_thread_pool_new((GFunc)rm_mds_factory, mds, threads);
     mds->running = TRUE;
-    GList *disks = g_hash_table_get_values(mds->disks);
     g_list_foreach(disks, (GFunc)rm_mds_device_start, mds);
     g_list_free(disks);
 }
@@ -342,10 +585,33 @@ void rm_mds_configure(RmMDS *self,
     self->func = func;
     self->user_data = user_data;
     self->threads_per_disk = threads_per_disk;
+    self->rotational_threads = RM_QUEUE_DEPTH_ROTATIONAL;
     self->pass_quota = (pass_quota > 0) ? pass_quota : G_MAXINT;
     self->prioritiser = prioritiser;
 }
 
+void rm_mds_set_throttle(RmMDS *self, gdouble bytes_per_sec, gdouble ops_per_sec,
+                         bool adaptive) {
+    g_assert(self);
+    g_assert(g_hash_table_size(self->disks) == 0);
+    self->bytes_per_sec = bytes_per_sec;
+    self->ops_per_sec = ops_per_sec;
+    self->adaptive_throttle = adaptive;
+}
+
+void rm_mds_set_prefetch(RmMDS *self, RmMDSPrefetchFunc func, gint depth) {
+    g_assert(self);
+    g_assert(self->running == FALSE);
+    self->prefetch = (depth > 0) ? func : NULL;
+    self->prefetch_depth = CLAMP(depth, 0, RM_MDS_PREFETCH_MAX);
+}
+
+void rm_mds_set_rotational_threads(RmMDS *self, gint threads) {
+    g_assert(self);
+    g_assert(self->running == FALSE);
+    self->rotational_threads = MAX(threads, 1);
+}
+
 void rm_mds_finish(RmMDS *mds) {
     g_mutex_lock(&mds->lock);
     /* wait for any pending threads to finish */
@@ -360,6 +626,7 @@ void rm_mds_finish(RmMDS *mds) {
     mds->running = FALSE;
     if(mds->pool) {
         g_thread_pool_free(mds->pool, false, true);
+        mds->pool = NULL;
     }
 }
 
@@ -382,11 +649,38 @@ gint rm_mds_device_ref(RmMDSDevice *device, const gint ref_count) {
     {
         device->ref_count += ref_count;
         result = device->ref_count;
+        if(result == 0) {
+            /* let parked workers see that they are done */
+            rm_mds_device_wake(device, device->parked);
+        }
     }
     g_mutex_unlock(&device->lock);
     return result;
 }
 
+void rm_mds_kick(RmMDS *mds) {
+    g_atomic_int_inc(&mds->kick_gen);
+
+    g_mutex_lock(&mds->lock);
+    {
+        GHashTableIter iter;
+        gpointer value = NULL;
+        g_hash_table_iter_init(&iter, mds->disks);
+        while(g_hash_table_iter_next(&iter, NULL, &value)) {
+            RmMDSDevice *device = value;
+            g_mutex_lock(&device->lock);
+            {
+                if(device->stalled) {
+                    device->stalled = FALSE;
+                    rm_mds_device_wake(device, device->parked);
+                }
+            }
+            g_mutex_unlock(&device->lock);
+        }
+    }
+    g_mutex_unlock(&mds->lock);
+}
+
 RmMDSDevice *rm_mds_device_get(RmMDS *mds, const char *path, dev_t dev) {
     dev_t disk = 0;
     if(dev == 0) {
@@ -404,6 +698,10 @@ gboolean rm_mds_device_is_rotational(RmMDSDevice *device) {
     return device->is_rotational;
 }
 
+RmThrottle *rm_mds_device_get_throttle(RmMDSDevice *device) {
+    return device->bytes_throttle;
+}
+
 void rm_mds_push_task(RmMDSDevice *device, dev_t dev, gint64 offset, const char *path,
                       const gpointer task_data) {
     if(device->is_rotational && offset == -1) {
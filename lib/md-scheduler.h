@@ -29,6 +29,7 @@
 #include <glib.h>
 #include "config.h"
 #include "session.h"
+#include "throttle.h"
 #include "utilities.h"
 
 /**
@@ -42,7 +43,9 @@
  *
  * Tasks sent to each worker thread are queued and processed in order
  * according to a prioritisation function (eg an elevator algorithm
- * based on disk offsets).
+ * based on disk offsets).  The queue is a binary heap worked through in
+ * sweeps; tasks which sort after the current position join the current
+ * sweep, the others wait for the next one.
  *
  * Device workers are reference-counted, which may be useful eg in cases
  * where there are known future tasks on a device, eg tasks which can't
@@ -92,6 +95,10 @@ typedef struct RmMDSTask {
     dev_t dev;
     guint64 offset;
     gpointer task_data;
+    /* order of arrival on the device; used internally as tie-breaker */
+    guint64 seq;
+    /* used internally; true once the task was passed to the prefetch func */
+    bool prefetched;
 } RmMDSTask;
 
 /**
@@ -106,6 +113,10 @@ typedef struct RmMDSTask {
  * is accessed several times in quick succession, since the file
  * metadata and data may still be cached.
  *
+ * A return value of 0 means the task could not be processed right now (and was
+ * pushed again).  If a whole pass of a device gets refused, its worker sleeps
+ * until rm_mds_kick() is called or another thread pushes to the device.
+ *
  **/
 typedef gint (*RmMDSFunc)(RmMDSTask *task, gpointer session_user_data);
 
@@ -123,6 +134,19 @@ typedef gint (*RmMDSFunc)(RmMDSTask *task, gpointer session_user_data);
  **/
 typedef gint (*RmMDSSortFunc)(const RmMDSTask *task_a, const RmMDSTask *task_b);
 
+/**
+ * @brief RmMDSPrefetchFunc prototype, called once for each task that is among
+ * the next few to be processed on its device (see rm_mds_set_prefetch).
+ *
+ * It is called with the device locked, so it should only hint the IO (or hand
+ * it to another thread) and must not push to the scheduler.  The task itself
+ * stays queued.
+ **/
+typedef void (*RmMDSPrefetchFunc)(RmMDSTask *task, gpointer session_user_data);
+
+/* upper limit for the prefetch depth */
+#define RM_MDS_PREFETCH_MAX (32)
+
 /**
  * @brief Allocate and initialise a new MDS scheduler
  *
@@ -142,6 +166,8 @@ RmMDS *rm_mds_new(const gint max_threads, RmMountTable *mount_table, bool fake_d
  * @param func The callback function called for each task
  * @param user_data Pointer to user data associated with the scheduler
  * @param pass_quota  Quota tasks per pass (refer RmMDSTask)
+ * @param threads_per_disk  Worker threads per disk; 0 picks the queue depth
+ *                          that suits each disk (see rm_mounts_get_queue_depth)
  * @param prioritiser  Compare function for prioritising
  *
  **/
@@ -152,8 +178,39 @@ void rm_mds_configure(RmMDS *self,
                       const gint threads_per_disk,
                       RmMDSSortFunc prioritiser);
 
+/**
+ * @brief Limit the IO done on each device; must be called before any device is
+ * added.
+ *
+ * @param bytes_per_sec  Limit for rm_mds_device_get_throttle(); 0 for unlimited
+ * @param ops_per_sec  Limit for the number of tasks started; 0 for unlimited
+ * @param adaptive  Also back off when the latency of reads rises
+ **/
+void rm_mds_set_throttle(RmMDS *self, gdouble bytes_per_sec, gdouble ops_per_sec,
+                         bool adaptive);
+
+/**
+ * @brief Let IO of upcoming tasks overlap with the current ones; whenever a
+ * task is started, func is called for the next depth tasks of the sweep that
+ * have not been prefetched yet.  Only used on non-rotational devices.
+ *
+ * @param func  Callback that issues the readahead; see RmMDSPrefetchFunc
+ * @param depth  How many tasks to look ahead (max RM_MDS_PREFETCH_MAX);
+ *               0 disables prefetching
+ **/
+void rm_mds_set_prefetch(RmMDS *self, RmMDSPrefetchFunc func, gint depth);
+
+/**
+ * @brief Run at least threads workers on each rotational disk when the
+ * threads_per_disk given to rm_mds_configure is 0 (auto).  Reset by
+ * rm_mds_configure to RM_QUEUE_DEPTH_ROTATIONAL.
+ **/
+void rm_mds_set_rotational_threads(RmMDS *self, gint threads);
+
 /**
  * @brief start a paused MDS scheduler
+ *
+ * Tasks may still be pushed after starting, also for new devices.
  **/
 void rm_mds_start(RmMDS *mds);
 
@@ -186,6 +243,12 @@ RmMDSDevice *rm_mds_device_get(RmMDS *mds, const char *path, dev_t dev);
  * */
 gboolean rm_mds_device_is_rotational(RmMDSDevice *device);
 
+/**
+ * @brief return the device's bytes/sec limiter (may be NULL) for whoever does
+ * the actual reading (see rm_hasher_task_set_throttle)
+ * */
+RmThrottle *rm_mds_device_get_throttle(RmMDSDevice *device);
+
 /**
  * @brief increase or decrease MDS reference count for an RmMDSDevice
  *
@@ -212,6 +275,13 @@ void rm_mds_push_task(RmMDSDevice *device,
                       const char *path,
                       const gpointer task_data);
 
+/**
+ * @brief Wake device workers that are waiting because all of their tasks were
+ * refused (see RmMDSFunc); call when whatever the tasks were waiting for
+ * (eg memory) becomes available.
+ **/
+void rm_mds_kick(RmMDS *mds);
+
 /**
  * @brief prioritiser function for basic elevator algorithm
  **/
@@ -149,6 +149,30 @@ RmNode *rm_trie_insert(RmTrie *self, const char *path, void *value) {
     return curr_node;
 }
 
+RmNode *rm_trie_insert_dir(RmTrie *self, const char *path, dev_t dev, ino_t inode) {
+    g_assert(self);
+    g_assert(path);
+
+    RmPathIter iter;
+    rm_path_iter_init(&iter, path);
+
+    g_mutex_lock(&self->lock);
+
+    char *path_elem = NULL;
+    RmNode *curr_node = self->root;
+
+    while((path_elem = rm_path_iter_next(&iter))) {
+        curr_node = rm_node_insert(self, curr_node, path_elem);
+    }
+
+    curr_node->dev = dev;
+    curr_node->inode = inode;
+
+    g_mutex_unlock(&self->lock);
+
+    return curr_node;
+}
+
 RmNode *rm_trie_search_node(RmTrie *self, const char *path) {
     g_assert(self);
     g_assert(path);
@@ -29,6 +29,7 @@
 #include <glib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 typedef struct _RmNode {
     /* Element of the path */
@@ -45,6 +46,10 @@ typedef struct _RmNode {
 
     /* User specific data */
     gpointer data;
+
+    /* st_dev and st_ino of directory nodes, if known (inode is 0 otherwise) */
+    dev_t dev;
+    ino_t inode;
 } RmNode;
 
 typedef struct _RmTrie {
@@ -84,6 +89,13 @@ void rm_trie_destroy(RmTrie *self);
 RmNode *rm_trie_insert(RmTrie *self, const char *path, void *value);
 RmNode *rm_trie_insert_unlocked(RmTrie *self, const char *path, void *value);
 
+/**
+ * rm_trie_insert_dir:
+ * Insert a directory path to the trie (without associating a value)
+ * and remember its device and inode number on the node.
+ */
+RmNode *rm_trie_insert_dir(RmTrie *self, const char *path, dev_t dev, ino_t inode);
+
 /**
  * rm_trie_search_node:
  * Search a node in the trie by path.
@@ -121,6 +121,81 @@ static gint rm_file_cmp_split(const RmFile *file_a, const RmFile *file_b,
     return 0;
 }
 
+/* wrappers for sorting arrays of RmFile pointers */
+static gint rm_file_cmp_full_p(RmFile **file_a, RmFile **file_b,
+                               const RmSession *session) {
+    return rm_file_cmp_full(*file_a, *file_b, session);
+}
+
+/* sorts inode clusters together, highest ranked file first within cluster */
+static gint rm_file_cmp_node_p(RmFile **file_a, RmFile **file_b,
+                               const RmSession *session) {
+    RETURN_IF_NONZERO(SIGN_DIFF((*file_a)->dev, (*file_b)->dev));
+    RETURN_IF_NONZERO(SIGN_DIFF((*file_a)->inode, (*file_b)->inode));
+    return rm_file_cmp_full(*file_a, *file_b, session);
+}
+
+typedef struct RmPPSortItem {
+    RmOff key;
+    RmFile *file;
+} RmPPSortItem;
+
+/* Stable LSD radix sort of files by file_size, 8 bits per pass.
+ * Keys are copied next to the file pointers so the passes run over
+ * contiguous memory; passes where all files share the same digit (eg the
+ * high bytes of the sizes) are skipped.
+ */
+static void rm_pp_radix_sort_by_size(RmFile **files, gsize n_files) {
+    if(n_files < 2) {
+        return;
+    }
+
+    RmPPSortItem *items = g_new(RmPPSortItem, n_files);
+    RmPPSortItem *scratch = g_new(RmPPSortItem, n_files);
+
+    /* histograms for all 8 digits in a single pass */
+    gsize counts[sizeof(RmOff)][256];
+    memset(counts, 0, sizeof(counts));
+
+    for(gsize i = 0; i < n_files; ++i) {
+        items[i].key = files[i]->file_size;
+        items[i].file = files[i];
+        for(guint digit = 0; digit < sizeof(RmOff); ++digit) {
+            counts[digit][(items[i].key >> (8 * digit)) & 0xFF]++;
+        }
+    }
+
+    for(guint digit = 0; digit < sizeof(RmOff); ++digit) {
+        guint shift = 8 * digit;
+        if(counts[digit][(items[0].key >> shift) & 0xFF] == n_files) {
+            /* nothing to do for this digit */
+            continue;
+        }
+
+        gsize offset = 0;
+        for(guint bucket = 0; bucket < 256; ++bucket) {
+            gsize count = counts[digit][bucket];
+            counts[digit][bucket] = offset;
+            offset += count;
+        }
+
+        for(gsize i = 0; i < n_files; ++i) {
+            scratch[counts[digit][(items[i].key >> shift) & 0xFF]++] = items[i];
+        }
+
+        RmPPSortItem *tmp = items;
+        items = scratch;
+        scratch = tmp;
+    }
+
+    for(gsize i = 0; i < n_files; ++i) {
+        files[i] = items[i].file;
+    }
+
+    g_free(items);
+    g_free(scratch);
+}
+
 static guint rm_node_hash(const RmFile *file) {
     return file->inode ^ file->dev;
 }
@@ -134,9 +209,6 @@ static gboolean rm_node_equal(const RmFile *file_a, const RmFile *file_b) {
  * also point to the real path
  */
 typedef struct RmPathDoubleKey {
-    /* stat(dirname(file->path)).st_ino */
-    ino_t parent_inode;
-
     /* File the key points to */
     RmFile *file;
 
@@ -148,11 +220,19 @@ static guint rm_path_double_hash(const RmPathDoubleKey *key) {
     return rm_node_hash(key->file);
 }
 
-static ino_t rm_path_parent_inode(RmFile *file) {
+/* Get the parent directory's trie node with dev and inode filled in.
+ * Those are normally recorded during traversal; only parents that were not
+ * traversed (eg files given directly on the command line) need a stat(). */
+static RmNode *rm_path_parent_node(RmFile *file) {
+    RmNode *parent = file->folder->parent;
+    if(parent->inode != 0) {
+        return parent;
+    }
+
     char parent_path[PATH_MAX];
     rm_trie_build_path(
         (RmTrie *)&file->session->cfg->file_trie,
-        file->folder->parent,
+        parent,
         parent_path,
         PATH_MAX
     );
@@ -166,16 +246,24 @@ static ino_t rm_path_parent_inode(RmFile *file) {
             file_path,
             g_strerror(errno)
         );
-        return 0;
+        return parent;
     }
 
-    return stat_buf.st_ino;
+    /* cache for the next comparison */
+    parent->dev = stat_buf.st_dev;
+    parent->inode = stat_buf.st_ino;
+    return parent;
 }
 
 static bool rm_path_have_same_parent(RmPathDoubleKey *key_a, RmPathDoubleKey *key_b) {
     RmFile *file_a = key_a->file, *file_b = key_b->file;
-    return (file_a->folder->parent == file_b->folder->parent ||
-            rm_path_parent_inode(file_a) == rm_path_parent_inode(file_b));
+    if(file_a->folder->parent == file_b->folder->parent) {
+        return true;
+    }
+
+    RmNode *parent_a = rm_path_parent_node(file_a);
+    RmNode *parent_b = rm_path_parent_node(file_b);
+    return parent_a->inode == parent_b->inode && parent_a->dev == parent_b->dev;
 }
 
 static gboolean rm_path_double_equal(RmPathDoubleKey *key_a, RmPathDoubleKey *key_b) {
@@ -210,10 +298,8 @@ static void rm_path_double_free(RmPathDoubleKey *key) {
 RmFileTables *rm_file_tables_new(_UNUSED const RmSession *session) {
     RmFileTables *tables = g_slice_new0(RmFileTables);
 
-    tables->all_files = g_queue_new();
-    tables->node_table =
-        g_hash_table_new_full((GHashFunc)rm_node_hash, (GEqualFunc)rm_node_equal, NULL,
-                              (GDestroyNotify)g_queue_free);
+    tables->all_files = g_ptr_array_new();
+    tables->size_groups = g_array_new(FALSE, FALSE, sizeof(guint));
     tables->unique_paths_table =
         g_hash_table_new_full((GHashFunc)rm_path_double_hash,
                               (GEqualFunc)rm_path_double_equal,
@@ -225,16 +311,8 @@ RmFileTables *rm_file_tables_new(_UNUSED const RmSession *session) {
 }
 
 void rm_file_tables_destroy(RmFileTables *tables) {
-    g_queue_free(tables->all_files);
-
-    if(tables->size_groups) {
-        g_slist_free(tables->size_groups);
-        tables->size_groups = NULL;
-    }
-
-    if(tables->node_table) {
-        g_hash_table_unref(tables->node_table);
-    }
+    g_ptr_array_free(tables->all_files, TRUE);
+    g_array_free(tables->size_groups, TRUE);
 
     g_hash_table_unref(tables->unique_paths_table);
 
@@ -355,39 +433,51 @@ char *rm_pp_compile_patterns(RmSession *session, const char *sortcrit, GError **
     return minified_sortcrit;
 }
 
-static int rm_pp_cmp_by_regex(GRegex *regex, int idx, RmPatternBitmask *mask_a,
-                              const char *path_a, RmPatternBitmask *mask_b,
-                              const char *path_b) {
-    int result_a = 0;
-    int result_b = 0;
-
-    if(RM_PATTERN_IS_CACHED(mask_a, idx)) {
-        /* Get the previous match result */
-        result_a = RM_PATTERN_GET_CACHED(mask_a, idx);
-    } else {
-        /* Match for the first time */
-        result_a = g_regex_match(regex, path_a, 0, NULL);
-        RM_PATTERN_SET_CACHED(mask_a, idx, result_a);
+/* Match file against all patterns of the sort criteria on first use;
+ * comparisons after that only need to look at the bits */
+static RmPatternBitmask rm_pp_get_pattern_bitmask(const RmFile *file,
+                                                  const RmSession *session) {
+    RmFile *self = (RmFile *)file;
+    if(self->pattern_bitmask & RM_PATTERN_MATCHED) {
+        return self->pattern_bitmask;
     }
 
-    if(RM_PATTERN_IS_CACHED(mask_b, idx)) {
-        /* Get the previous match result */
-        result_b = RM_PATTERN_GET_CACHED(mask_b, idx);
-    } else {
-        /* Match for the first time */
-        result_b = g_regex_match(regex, path_b, 0, NULL);
-        RM_PATTERN_SET_CACHED(mask_b, idx, result_b);
+    const char *criteria = session->cfg->sort_criteria;
+    RmPatternBitmask mask = RM_PATTERN_MATCHED;
+    char path[PATH_MAX];
+    bool path_built = false;
+
+    for(guint i = 0, idx = 0; criteria[i] && idx < session->pattern_cache->len; i++) {
+        char criterion = tolower((unsigned char)criteria[i]);
+        if(criterion != 'r' && criterion != 'x') {
+            continue;
+        }
+
+        const char *subject = self->folder->basename;
+        if(criterion == 'r') {
+            if(!path_built) {
+                rm_file_build_path(self, path);
+                path_built = true;
+            }
+            subject = path;
+        }
+
+        GRegex *regex = g_ptr_array_index(session->pattern_cache, idx);
+        if(g_regex_match(regex, subject, 0, NULL)) {
+            mask |= (RmPatternBitmask)1 << idx;
+        }
+        idx++;
     }
 
-    return SIGN_DIFF(result_b, result_a);
+    self->pattern_bitmask = mask;
+    return mask;
 }
 
 /*
  * Sort two files in accordance with single criterion
  */
 static int rm_pp_cmp_criterion(unsigned char criterion, const RmFile *a, const RmFile *b,
-                               const char *a_path, const char *b_path, int *regex_cursor,
-                               const RmSession *session) {
+                               int *regex_cursor, const RmSession *session) {
     int sign = (isupper(criterion) ? -1 : 1);
     switch(tolower(criterion)) {
     case 'm':
@@ -404,21 +494,12 @@ static int rm_pp_cmp_criterion(unsigned char criterion, const RmFile *a, const R
         return sign * SIGN_DIFF(a->outer_link_count, b->outer_link_count);
     case 'p':
         return sign * SIGN_DIFF(a->path_index, b->path_index);
-    case 'x': {
-        int cmp = rm_pp_cmp_by_regex(
-            g_ptr_array_index(session->pattern_cache, *regex_cursor), *regex_cursor,
-            (RmPatternBitmask *)&a->pattern_bitmask_basename, a->folder->basename,
-            (RmPatternBitmask *)&b->pattern_bitmask_basename, b->folder->basename);
-        (*regex_cursor)++;
-        return sign * cmp;
-    }
+    case 'x':
     case 'r': {
-        int cmp = rm_pp_cmp_by_regex(
-            g_ptr_array_index(session->pattern_cache, *regex_cursor), *regex_cursor,
-            (RmPatternBitmask *)&a->pattern_bitmask_path, a_path,
-            (RmPatternBitmask *)&b->pattern_bitmask_path, b_path);
-        (*regex_cursor)++;
-        return sign * cmp;
+        int idx = (*regex_cursor)++;
+        int match_a = RM_PATTERN_GET(rm_pp_get_pattern_bitmask(a, session), idx);
+        int match_b = RM_PATTERN_GET(rm_pp_get_pattern_bitmask(b, session), idx);
+        return sign * SIGN_DIFF(match_b, match_a);
     }
     default:
         g_assert_not_reached();
@@ -440,15 +521,9 @@ int rm_pp_cmp_orig_criteria(const RmFile *a, const RmFile *b, const RmSession *s
 
     RETURN_IF_NONZERO(SIGN_DIFF(b->is_prefd, a->is_prefd))
 
-    /* Only fill in path if we have a pattern in sort_criteria */
-    bool path_needed = (session->pattern_cache->len > 0);
-    RM_DEFINE_PATH_IF_NEEDED(a, path_needed);
-    RM_DEFINE_PATH_IF_NEEDED(b, path_needed);
-
     RmCfg *cfg = session->cfg;
     for(int i = 0, regex_cursor = 0; cfg->sort_criteria[i]; i++) {
-        int res = rm_pp_cmp_criterion(cfg->sort_criteria[i], a, b, a_path, b_path,
-                                      &regex_cursor, session);
+        int res = rm_pp_cmp_criterion(cfg->sort_criteria[i], a, b, &regex_cursor, session);
         RETURN_IF_NONZERO(res);
     }
     return 0;
@@ -456,21 +531,32 @@ int rm_pp_cmp_orig_criteria(const RmFile *a, const RmFile *b, const RmSession *s
 
 void rm_file_list_insert_file(RmFile *file, const RmSession *session) {
     g_mutex_lock(&session->tables->lock);
-    { g_queue_push_tail(session->tables->all_files, file); }
+    { g_ptr_array_add(session->tables->all_files, file); }
     g_mutex_unlock(&session->tables->lock);
 }
 
-void rm_file_tables_clear(const RmSession *session) {
-    GHashTableIter iter;
-    gpointer key;
+void rm_file_list_insert_batch(GPtrArray *batch, const RmSession *session) {
+    if(batch->len == 0) {
+        return;
+    }
+
+    g_mutex_lock(&session->tables->lock);
+    { g_ptr_array_extend(session->tables->all_files, batch, NULL, NULL); }
+    g_mutex_unlock(&session->tables->lock);
 
-    g_hash_table_iter_init(&iter, session->tables->node_table);
-    while(g_hash_table_iter_next(&iter, &key, NULL)) {
-        RmFile *file = key;
+    g_ptr_array_set_size(batch, 0);
+}
+
+void rm_file_tables_clear(const RmSession *session) {
+    RmFileTables *tables = session->tables;
+    for(guint i = 0; i < tables->all_files->len; ++i) {
+        RmFile *file = g_ptr_array_index(tables->all_files, i);
         if(file) {
             rm_file_destroy(file);
         }
     }
+    g_ptr_array_set_size(tables->all_files, 0);
+    g_array_set_size(tables->size_groups, 0);
 }
 
 /* if file is not DUPE_CANDIDATE then send it to session->tables->other_lint and
@@ -511,33 +597,19 @@ static gboolean rm_pp_check_path_double(RmFile *file, GHashTable *unique_paths_t
     return TRUE;
 }
 
-static gint rm_pp_handle_hardlink(RmFile *file, RmFile *head) {
-    if(file == head) {
-        return FALSE;
-    }
-
-    if(head->hardlinks) {
-        /* bundle hardlink */
-        rm_file_hardlink_add(head, file);
-    }
-
-    /* remove file from inode_cluster queue */
-    return TRUE;
-}
-
-/* Preprocess files, including embedded hardlinks.  Any embedded hardlinks
- * that are "other lint" types are sent to rm_pp_handle_other_lint.  If the
- * file itself is "other lint" types it is likewise sent to rm_pp_handle_other_lint.
- * If there are no files left after this then return TRUE so that the
- * cluster can be deleted from the node_table hash table.
- * NOTE: we rely on rm_file_list_insert to select an RM_LINT_TYPE_DUPE_CANDIDATE as
- * head
- * file (unless ALL the files are "other lint"). */
-static gboolean rm_pp_handle_inode_clusters(_UNUSED gpointer key, GQueue *inode_cluster,
-                                            RmSession *session) {
+/* Preprocess a cluster of files with the same dev and inode (ie hardlinks and
+ * path doubles), highest ranked first.  Path doubles are removed, "other lint"
+ * is sent to rm_pp_handle_other_lint and the remaining hardlinks are bundled
+ * under (or, without --hardlinked, replaced by) the first remaining file, which
+ * is returned.  Returns NULL if no duplicate candidate is left.
+ * NOTE: since "other lint" is filtered first, the head is always an
+ * RM_LINT_TYPE_DUPE_CANDIDATE. */
+static RmFile *rm_pp_handle_inode_cluster(RmFile **cluster, guint n_files,
+                                          RmSession *session) {
     RmCfg *cfg = session->cfg;
+    guint remaining = n_files;
 
-    if(inode_cluster->length > 1) {
+    if(n_files > 1) {
         /* there is a cluster of inode matches */
 
         /* remove path doubles.
@@ -549,9 +621,13 @@ static gboolean rm_pp_handle_inode_clusters(_UNUSED gpointer key, GQueue *inode_
          * and remove the paths double later on here. Disable for --equal therefore.
          * */
         if(!session->cfg->run_equal_mode) {
-            session->total_filtered_files -=
-                rm_util_queue_foreach_remove(inode_cluster, (RmRFunc)rm_pp_check_path_double,
-                                             session->tables->unique_paths_table);
+            for(guint i = 0; i < n_files; ++i) {
+                if(rm_pp_check_path_double(cluster[i],
+                                           session->tables->unique_paths_table)) {
+                    cluster[i] = NULL;
+                    remaining--;
+                }
+            }
         }
 
         /* clear the hashtable ready for the next cluster */
@@ -559,36 +635,43 @@ static gboolean rm_pp_handle_inode_clusters(_UNUSED gpointer key, GQueue *inode_
     }
 
     /* process and remove other lint */
-    session->total_filtered_files -= rm_util_queue_foreach_remove(
-        inode_cluster, (RmRFunc)rm_pp_handle_other_lint, (RmSession *)session);
-
-    if(inode_cluster->length > 1) {
-        /* bundle or free the non-head files */
-        RmFile *headfile = inode_cluster->head->data;
-        if(cfg->find_hardlinked_dupes) {
-            /* prepare to bundle files under the hardlink head */
-            rm_file_hardlink_add(headfile, headfile);
+    for(guint i = 0; i < n_files; ++i) {
+        if(cluster[i] && rm_pp_handle_other_lint(cluster[i], session)) {
+            cluster[i] = NULL;
+            remaining--;
         }
-
-        /* hardlink cluster are counted as filtered files since they are either
-         * ignored or treated as automatic duplicates depending on settings (so
-         * no effort either way); rm_pp_handle_hardlink will either free or bundle
-         * the hardlinks depending on value of headfile->hardlinks.is_head.
-         */
-        session->total_filtered_files -= rm_util_queue_foreach_remove(
-            inode_cluster, (RmRFunc)rm_pp_handle_hardlink, headfile);
     }
 
-    /* update counters */
-    rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_PREPROCESS);
+    /* bundle or drop the non-head files; they are counted as filtered files
+     * since they are either ignored or treated as automatic duplicates
+     * depending on settings (so no effort either way) */
+    RmFile *head = NULL;
+    for(guint i = 0; i < n_files; ++i) {
+        RmFile *file = cluster[i];
+        if(!file) {
+            continue;
+        }
 
-    g_assert(inode_cluster->length <= 1);
-    if(inode_cluster->length == 1) {
-        session->tables->size_groups->data = g_slist_prepend(
-            session->tables->size_groups->data, inode_cluster->head->data);
+        if(!head) {
+            head = file;
+            if(remaining > 1 && cfg->find_hardlinked_dupes) {
+                /* prepare to bundle files under the hardlink head */
+                rm_file_hardlink_add(head, head);
+            }
+        } else if(head->hardlinks) {
+            /* bundle hardlink */
+            rm_file_hardlink_add(head, file);
+        }
     }
 
-    return TRUE;
+    session->total_filtered_files -= n_files - (head ? 1 : 0);
+
+    /* update counters (with cfg->pipeline, traversal may still be running) */
+    rm_fmt_set_state(session->formats, (session->traverse_finished)
+                                           ? RM_PROGRESS_STATE_PREPROCESS
+                                           : RM_PROGRESS_STATE_TRAVERSE);
+
+    return head;
 }
 
 static int rm_pp_cmp_reverse_alphabetical(const RmFile *a, const RmFile *b) {
@@ -630,73 +713,115 @@ static RmOff rm_pp_handler_other_lint(const RmSession *session) {
     return num_handled;
 }
 
-/* This does preprocessing including handling of "other lint" (non-dupes)
- * After rm_preprocess(), all remaining duplicate candidates are in
- * a jagged GSList of GSLists as follows:
- * session->tables->size_groups->group1->file1a
- *                                     ->file1b
- *                                     ->file1c
- *                             ->group2->file2a
- *                                     ->file2b
- *                                       etc
+/* Sort files by size (and other grouping criteria), remove path doubles,
+ * handle "other lint" and bundle hardlinks.  The surviving files are
+ * compacted to the front of files, as consecutive slices of files with the
+ * same size (and other grouping criteria); the end index of each slice is
+ * appended to size_groups:
+ *
+ * files:       [file1a, file1b, file1c, file2a, file2b, ...]
+ * size_groups: [3, 5, ...]
  */
-void rm_preprocess(RmSession *session) {
-    RmFileTables *tables = session->tables;
-    GQueue *all_files = tables->all_files;
-
-    session->total_filtered_files = session->total_files;
-
-    /* initial sort by size */
-    g_queue_sort(all_files, (GCompareDataFunc)rm_file_cmp_full, session);
-    rm_log_debug_line("initial size sort finished at time %.3f; sorted %d files",
-                      g_timer_elapsed(session->timer, NULL),
-                      session->total_files);
-
-    /* split into file size groups; for each size, remove path doubles and bundle
-     * hardlinks */
-    g_assert(all_files->head);
-    RmFile *file = g_queue_pop_head(all_files);
-    RmFile *current_size_file = file;
-    guint removed = 0;
-    GHashTable *node_table = tables->node_table;
-    while(file && !rm_session_was_aborted()) {
-        /* group files into inode clusters */
-        GQueue *inode_cluster =
-            rm_hash_table_setdefault(node_table, file, (RmNewFunc)g_queue_new);
-
-        g_queue_push_tail(inode_cluster, file);
-
-        /* get next file and check if it is part of the same group */
-        file = g_queue_pop_head(all_files);
-        if(!file || rm_file_cmp_split(file, current_size_file, session) != 0) {
-            /* process completed group (all same size & other criteria)*/
-            /* remove path doubles and handle "other" lint */
-
-            /* add an empty GSlist to our list of lists */
-            tables->size_groups = g_slist_prepend(tables->size_groups, NULL);
-
-            removed += g_hash_table_foreach_remove(
-                node_table, (GHRFunc)rm_pp_handle_inode_clusters, session);
-
-            /* free up the node table for the next group */
-            g_hash_table_steal_all(node_table);
-            if(tables->size_groups->data == NULL) {
-                /* zero size group after handling other lint; remove it */
-                tables->size_groups =
-                    g_slist_delete_link(tables->size_groups, tables->size_groups);
+void rm_preprocess_files(RmSession *session, GPtrArray *all_files, GArray *size_groups) {
+    RmFile **files = (RmFile **)all_files->pdata;
+    guint n_files = all_files->len;
+
+    if(n_files == 0) {
+        return;
+    }
+
+    /* initial sort by size, then by the remaining criteria within each size */
+    rm_pp_radix_sort_by_size(files, n_files);
+    for(guint start = 0, end = 0; start < n_files; start = end) {
+        for(end = start + 1;
+            end < n_files && files[end]->file_size == files[start]->file_size; ++end) {
+        }
+        if(end - start > 1) {
+            g_qsort_with_data(&files[start], end - start, sizeof(RmFile *),
+                              (GCompareDataFunc)rm_file_cmp_full_p, session);
+        }
+    }
+    rm_log_debug_line("initial size sort finished at time %.3f; sorted %u files",
+                      g_timer_elapsed(session->timer, NULL), n_files);
+
+    /* split into groups (all same size & other criteria); for each group, remove
+     * path doubles, handle "other" lint and bundle hardlinks.  Surviving files
+     * are compacted towards the front of the array */
+    guint kept = 0, start = 0;
+    for(guint end = 0; start < n_files && !rm_session_was_aborted(); start = end) {
+        for(end = start + 1;
+            end < n_files && rm_file_cmp_split(files[end], files[end - 1], session) == 0;
+            ++end) {
+        }
+
+        /* bring inode clusters together */
+        if(end - start > 1) {
+            g_qsort_with_data(&files[start], end - start, sizeof(RmFile *),
+                              (GCompareDataFunc)rm_file_cmp_node_p, session);
+        }
+
+        guint group_start = kept;
+        for(guint cluster = start, cluster_end = start; cluster < end;
+            cluster = cluster_end) {
+            for(cluster_end = cluster + 1;
+                cluster_end < end && rm_node_equal(files[cluster_end], files[cluster]);
+                ++cluster_end) {
+            }
+
+            RmFile *head =
+                rm_pp_handle_inode_cluster(&files[cluster], cluster_end - cluster, session);
+            if(head) {
+                /* never overtakes cluster, so this can't clobber unhandled files */
+                files[kept++] = head;
             }
         }
 
-        current_size_file = file;
+        if(kept > group_start) {
+            g_array_append_val(size_groups, kept);
+        }
     }
 
-    session->other_lint_cnt += rm_pp_handler_other_lint(session);
+    /* if aborted, files from start on were never handled; the slots between
+     * kept and start only hold stale pointers */
+    for(guint i = start; i < n_files; ++i) {
+        rm_file_destroy(files[i]);
+    }
+    g_ptr_array_set_size(all_files, kept);
 
     rm_log_debug_line(
         "path doubles removal/hardlink bundling/other lint finished at %.3f; removed "
         "%u "
-        "of %d",
-        g_timer_elapsed(session->timer, NULL), removed, session->total_files);
+        "of %u",
+        g_timer_elapsed(session->timer, NULL), n_files - kept, n_files);
+}
+
+/* This does preprocessing including handling of "other lint" (non-dupes)
+ * After rm_preprocess(), all remaining duplicate candidates are in
+ * session->tables->all_files, as slices described by
+ * session->tables->size_groups (see rm_preprocess_files()).
+ *
+ * With cfg->pipeline, the files found in directories were already handed to
+ * the shredder device by device, together with the files given on the command
+ * line that are on one of those devices; only the other command line files
+ * are left here.
+ */
+void rm_preprocess(RmSession *session) {
+    RmFileTables *tables = session->tables;
+
+    g_mutex_lock(&tables->lock);
+    {
+        if(session->cfg->pipeline) {
+            session->total_filtered_files += tables->all_files->len;
+        } else {
+            g_assert(tables->all_files->len > 0);
+            session->total_filtered_files = session->total_files;
+        }
+
+        rm_preprocess_files(session, tables->all_files, tables->size_groups);
+    }
+    g_mutex_unlock(&tables->lock);
+
+    session->other_lint_cnt += rm_pp_handler_other_lint(session);
 
     rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_PREPROCESS);
 }
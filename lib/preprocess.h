@@ -36,6 +36,17 @@
  */
 void rm_preprocess(RmSession *session);
 
+/**
+ * @brief The path double / hardlink / "other lint" part of rm_preprocess(),
+ * for an arbitrary array of files (eg all files found on one device).
+ *
+ * Surviving duplicate candidates are compacted to the front of files, grouped
+ * by size; the end index of each group is appended to size_groups.  "Other
+ * lint" is collected in session->tables and output by rm_preprocess().
+ * Call with session->tables->lock held.
+ */
+void rm_preprocess_files(RmSession *session, GPtrArray *files, GArray *size_groups);
+
 /**
  * @brief Create a new RmFileTable object.
  *
@@ -55,6 +66,13 @@ void rm_file_tables_destroy(RmFileTables *list);
 
 void rm_file_list_insert_file(RmFile *file, const RmSession *session);
 
+/**
+ * @brief Appends a batch of files in RmFileTables->all_files at once.
+ * @param batch GPtrArray of files to insert; ownership of the files is taken
+ *        and the batch is left empty for re-use.
+ */
+void rm_file_list_insert_batch(GPtrArray *batch, const RmSession *session);
+
 /**
  * @brief Clear potential leftover files when shredder was not used.
  */
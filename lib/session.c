@@ -56,6 +56,10 @@
 #include "sys/utsname.h"
 #endif
 
+#if HAVE_JSON_GLIB
+#include <json-glib/json-glib.h>
+#endif
+
 static gpointer rm_session_read_kernel_version(_UNUSED gpointer arg) {
     static int version[2] = {-1, -1};
 #if HAVE_UNAME
@@ -201,11 +205,462 @@ void rm_session_acknowledge_abort(const gint abort_count) {
 # define _MIN_LINUX_SUBVERSION     2
 #endif
 
+/* read all of stdin */
+static GString *rm_session_read_stdin(void) {
+    GString *data = g_string_new(NULL);
+    char buf[4096];
+    size_t n_read = 0;
+    while((n_read = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        g_string_append_len(data, buf, n_read);
+    }
+    return data;
+}
+
+#if HAVE_JSON_GLIB
+
+typedef struct RmDupeGroup {
+    char *original;
+    GPtrArray *dupes;
+} RmDupeGroup;
+
+static void rm_session_dupe_group_free(RmDupeGroup *group) {
+    g_free(group->original);
+    g_ptr_array_free(group->dupes, TRUE);
+    g_slice_free(RmDupeGroup, group);
+}
+
+/* turn the duplicate_file entries of a rmlint json document into groups;
+ * the first file of each group is its original, all others are dupes */
+static bool rm_session_load_groups(JsonParser *parser, GPtrArray *groups) {
+    JsonNode *root = json_parser_get_root(parser);
+    if(root == NULL || JSON_NODE_TYPE(root) != JSON_NODE_ARRAY) {
+        return false;
+    }
+
+    JsonArray *array = json_node_get_array(root);
+    RmDupeGroup *group = NULL;
+    const char *last_cksum = NULL;
+    bool last_was_original = false;
+
+    for(guint i = 0; i < json_array_get_length(array); ++i) {
+        JsonObject *object = json_array_get_object_element(array, i);
+        if(object == NULL || !json_object_has_member(object, "type") ||
+           !json_object_has_member(object, "path") ||
+           g_strcmp0(json_object_get_string_member(object, "type"), "duplicate_file")) {
+            group = NULL;
+            continue;
+        }
+
+        const char *path = json_object_get_string_member(object, "path");
+        const char *cksum = json_object_has_member(object, "checksum")
+                                ? json_object_get_string_member(object, "checksum")
+                                : NULL;
+        bool is_original = json_object_has_member(object, "is_original") &&
+                           json_object_get_boolean_member(object, "is_original");
+
+        /* groups are printed one after another, originals first */
+        if(group == NULL || g_strcmp0(cksum, last_cksum) != 0 ||
+           (is_original && !last_was_original)) {
+            group = g_slice_new0(RmDupeGroup);
+            group->dupes = g_ptr_array_new_with_free_func(g_free);
+            g_ptr_array_add(groups, group);
+        }
+
+        if(group->original == NULL) {
+            group->original = g_strdup(path);
+        } else {
+            g_ptr_array_add(group->dupes, g_strdup(path));
+        }
+
+        last_cksum = cksum;
+        last_was_original = is_original;
+    }
+    return true;
+}
+
+#endif
+
+#if HAVE_FIDEDUPERANGE || HAVE_BTRFS_H
+
+/* a poorly-documented limit for dedupe ioctl's */
+#define RM_DEDUPE_MAX_CHUNK (16 * 1024 * 1024)
+
+/* how fine a resolution to use once difference detected;
+ * use btrfs default node size (16k): */
+#define RM_DEDUPE_MIN_CHUNK (16 * 1024)
+
+/* max. destinations per ioctl; the kernel refuses argument structs that
+ * are bigger than a page */
+#define RM_DEDUPE_MAX_DESTS (64)
+
+typedef struct RmDedupeDest {
+    char *path;
+    int fd;
+
+    /* bytes deduped so far, counted from the start of the file */
+    gint64 bytes_deduped;
+
+    /* set once we gave up on this dest (data differs or error) */
+    bool done;
+
+    /* extents before we started, or NULL */
+    RmExtentMap *extents;
+} RmDedupeDest;
+
+/* dedupe len bytes at offset from source_fd into all of dests; dests whose data
+ * differs are added to differ, dests that failed otherwise are marked done */
+static void rm_session_dedupe_range(int source_fd, RmDedupeDest **dests, guint n_dests,
+                                    gint64 offset, gint64 len, GPtrArray *differ) {
+    for(guint start = 0; start < n_dests; start += RM_DEDUPE_MAX_DESTS) {
+        guint count = MIN(n_dests - start, RM_DEDUPE_MAX_DESTS);
+        struct _FILE_DEDUPE_RANGE *args =
+            g_malloc0(sizeof(struct _FILE_DEDUPE_RANGE) +
+                      count * sizeof(struct _FILE_DEDUPE_RANGE_INFO));
+
+        args->dest_count = count;
+        args->_SRC_OFFSET = offset;
+        args->_SRC_LENGTH = len;
+        for(guint i = 0; i < count; ++i) {
+            args->info[i]._DEST_FD = dests[start + i]->fd;
+            args->info[i]._DEST_OFFSET = offset;
+        }
+
+        int ret = ioctl(source_fd, _DEDUPE_IOCTL, args);
+        if(ret != 0) {
+            rm_log_perrorf(_("%s returned error: (%d)"), _DEDUPE_IOCTL_NAME, ret);
+        }
+
+        for(guint i = 0; i < count; ++i) {
+            RmDedupeDest *dest = dests[start + i];
+            struct _FILE_DEDUPE_RANGE_INFO *info = &args->info[i];
+            if(ret != 0) {
+                dest->done = true;
+            } else if(info->status == _DATA_DIFFERS) {
+                g_ptr_array_add(differ, dest);
+            } else if(info->status != 0) {
+                errno = -info->status;
+                rm_log_perrorf(_("%s returned error: (%d)"), _DEDUPE_IOCTL_NAME,
+                               -info->status);
+                dest->done = true;
+            } else {
+                dest->bytes_deduped += info->bytes_deduped;
+                /* a short dedupe would put this dest out of step with the others */
+                dest->done = ((gint64)info->bytes_deduped < len);
+            }
+        }
+        g_free(args);
+    }
+}
+
+/* fill todo with those of dests that do not share len bytes at offset with the
+ * source yet; the others already are deduped there and are moved past it */
+static void rm_session_dedupe_unshared(RmExtentMap *source_extents, GPtrArray *dests,
+                                       gint64 offset, gint64 len, GPtrArray *todo) {
+    g_ptr_array_set_size(todo, 0);
+    for(guint i = 0; i < dests->len; ++i) {
+        RmDedupeDest *dest = g_ptr_array_index(dests, i);
+        if(rm_extent_map_shared(source_extents, dest->extents, offset, len) == (RmOff)len) {
+            rm_log_debug_line("Skipping %" G_GINT64_FORMAT " bytes at %" G_GINT64_FORMAT
+                              ", already shared with %s",
+                              len, offset, dest->path);
+            dest->bytes_deduped += len;
+        } else {
+            g_ptr_array_add(todo, dest);
+        }
+    }
+}
+
+/* remove dests that are done */
+static void rm_session_dedupe_prune(GPtrArray *dests) {
+    for(guint i = dests->len; i > 0; --i) {
+        RmDedupeDest *dest = g_ptr_array_index(dests, i - 1);
+        if(dest->done) {
+            g_ptr_array_remove_index_fast(dests, i - 1);
+        }
+    }
+}
+
+/* dedupe source_path into each of dest_paths; all dests are handled by the same
+ * ioctl calls.  Returns the number of dests that share all of source's data now */
+static guint rm_session_dedupe_group(RmCfg *cfg, char *source_path,
+                                     char **dest_paths, guint n_dests) {
+    guint n_deduped = 0;
+    int source_fd = rm_sys_open(source_path, O_RDONLY);
+    if(source_fd < 0) {
+        rm_log_error_line(_("dedupe: failed to open source file"));
+        return 0;
+    }
+
+    RmStat source_stat;
+    if(rm_sys_fstat(source_fd, &source_stat) == -1) {
+        rm_log_perror("fstat");
+        rm_sys_close(source_fd);
+        return 0;
+    }
+
+    RmDedupeDest *all = g_new0(RmDedupeDest, n_dests);
+    GPtrArray *active = g_ptr_array_sized_new(n_dests);
+
+    for(guint i = 0; i < n_dests; ++i) {
+        RmDedupeDest *dest = &all[i];
+        dest->path = dest_paths[i];
+        dest->fd = -1;
+        dest->done = true;
+        rm_log_debug_line("Cloning %s -> %s", source_path, dest->path);
+
+        if(cfg->dedupe_check_xattr) {
+            // Check if we actually need to deduplicate.
+            // This utility will write a value to the extended attributes
+            // of the file so we know that we do not need to do it again
+            // next time. This is supposed to avoid disk thrashing.
+            // (See also: https://github.com/sahib/rmlint/issues/349)
+            if(rm_xattr_is_deduplicated(dest->path, cfg->follow_symlinks)) {
+                rm_log_debug_line("Already deduplicated according to xattr!");
+                n_deduped++;
+                continue;
+            }
+        }
+
+        // Also use --is-reflink on both files before doing extra work;
+        // files sharing an inode have nothing left to share (and the
+        // dedupe ioctl rejects them with EINVAL):
+        switch(rm_util_link_type(source_path, dest->path)) {
+        case RM_LINK_REFLINK:
+            rm_log_debug_line("Already an exact reflink!");
+            n_deduped++;
+            continue;
+        case RM_LINK_HARDLINK:
+        case RM_LINK_PATH_DOUBLE:
+        case RM_LINK_SAME_FILE:
+            rm_log_debug_line("Already the same inode!");
+            n_deduped++;
+            continue;
+        default:
+            break;
+        }
+
+        dest->fd = rm_sys_open(dest->path, cfg->dedupe_readonly ? O_RDONLY : O_RDWR);
+        if(dest->fd < 0) {
+            rm_log_error_line(
+                _("dedupe: error %i: failed to open dest file.%s"),
+                errno,
+                cfg->dedupe_readonly ? "" : _("\n\t(if target is a read-only snapshot "
+                                              "then -r option is required)"));
+            continue;
+        }
+
+        /* fsync's needed to flush extent mapping */
+        if(fsync(dest->fd) != 0) {
+            rm_log_warning_line("Error syncing dest file %s: %s", dest->path,
+                                strerror(errno));
+        }
+
+        dest->done = false;
+        dest->extents = rm_extent_map_new(dest->fd);
+        if(!rm_extent_map_comparable(dest->extents)) {
+            rm_log_debug_line("Can't compare extents of %s; deduping all of it",
+                              dest->path);
+        }
+        g_ptr_array_add(active, dest);
+    }
+
+    if(active->len > 0 && fsync(source_fd) != 0) {
+        rm_log_warning_line("Error syncing source file %s: %s", source_path,
+                            strerror(errno));
+    }
+
+    /* extents that the source already shares with a dest (eg. after an
+     * interrupted run) are skipped, so only the rest costs reads */
+    RmExtentMap *source_extents = (active->len > 0) ? rm_extent_map_new(source_fd) : NULL;
+    if(active->len > 0 && !rm_extent_map_comparable(source_extents)) {
+        rm_log_debug_line("Can't compare extents of %s; deduping all of it",
+                          source_path);
+    }
+
+    /* all active dests move through the file together, so each chunk takes a
+     * single ioctl for up to RM_DEDUPE_MAX_DESTS of them */
+    GPtrArray *differ = g_ptr_array_new();
+    GPtrArray *todo = g_ptr_array_new();
+    for(gint64 offset = 0; offset < source_stat.st_size && active->len > 0 &&
+                           !rm_session_was_aborted();
+        offset += RM_DEDUPE_MAX_CHUNK) {
+        gint64 len = MIN(RM_DEDUPE_MAX_CHUNK, source_stat.st_size - offset);
+        rm_session_dedupe_unshared(source_extents, active, offset, len, todo);
+        rm_session_dedupe_range(source_fd, (RmDedupeDest **)todo->pdata, todo->len,
+                                offset, len, differ);
+
+        if(differ->len > 0) {
+            rm_log_debug_line("Dropping to %d-byte chunks after %" G_GINT64_FORMAT
+                              " bytes for %u files",
+                              RM_DEDUPE_MIN_CHUNK, offset, differ->len);
+        }
+
+        /* dedupe what matches of the differing dests, up to the first
+         * min-size chunk that differs */
+        GPtrArray *fine = differ;
+        differ = g_ptr_array_new();
+        for(gint64 sub = offset; sub < offset + len && fine->len > 0;
+            sub += RM_DEDUPE_MIN_CHUNK) {
+            gint64 sub_len = MIN(RM_DEDUPE_MIN_CHUNK, offset + len - sub);
+            rm_session_dedupe_unshared(source_extents, fine, sub, sub_len, todo);
+            rm_session_dedupe_range(source_fd, (RmDedupeDest **)todo->pdata, todo->len,
+                                    sub, sub_len, differ);
+            for(guint i = 0; i < differ->len; ++i) {
+                RmDedupeDest *dest = g_ptr_array_index(differ, i);
+                dest->done = true;
+            }
+            g_ptr_array_set_size(differ, 0);
+            rm_session_dedupe_prune(fine);
+        }
+        g_ptr_array_free(fine, TRUE);
+
+        rm_session_dedupe_prune(active);
+    }
+    g_ptr_array_free(differ, TRUE);
+    g_ptr_array_free(todo, TRUE);
+    g_ptr_array_free(active, TRUE);
+    rm_extent_map_free(source_extents);
+
+    for(guint i = 0; i < n_dests; ++i) {
+        RmDedupeDest *dest = &all[i];
+        if(dest->fd < 0) {
+            continue;
+        }
+        rm_sys_close(dest->fd);
+        rm_extent_map_free(dest->extents);
+
+        rm_log_debug_line("Bytes deduped: %" G_GINT64_FORMAT, dest->bytes_deduped);
+        if(dest->bytes_deduped == source_stat.st_size) {
+            if(cfg->dedupe_check_xattr && !cfg->dedupe_readonly) {
+                rm_xattr_mark_deduplicated(dest->path, cfg->follow_symlinks);
+            }
+            n_deduped++;
+        } else if(dest->bytes_deduped == 0) {
+            rm_log_info_line(_("Files don't match - not deduped"));
+        } else {
+            rm_log_info_line(_("Only first %" G_GINT64_FORMAT " bytes deduped "
+                               "- files not fully identical"),
+                             dest->bytes_deduped);
+        }
+    }
+
+    rm_sys_close(source_fd);
+    g_free(all);
+    return n_deduped;
+}
+
+#if HAVE_JSON_GLIB
+
+typedef struct RmDedupeBatch {
+    RmCfg *cfg;
+    gint n_failed;
+} RmDedupeBatch;
+
+static void rm_session_dedupe_batch_factory(RmDupeGroup *group, RmDedupeBatch *batch) {
+    if(!rm_session_was_aborted()) {
+        guint n_dests = group->dupes->len;
+        guint n_deduped = rm_session_dedupe_group(
+            batch->cfg, group->original, (char **)group->dupes->pdata, n_dests);
+        if(n_deduped < n_dests) {
+            g_atomic_int_add(&batch->n_failed, n_dests - n_deduped);
+        }
+    }
+}
+
+static int rm_session_dedupe_batch_main(RmCfg *cfg) {
+    GPtrArray *groups =
+        g_ptr_array_new_with_free_func((GDestroyNotify)rm_session_dupe_group_free);
+    bool all_valid = true;
+
+    /* with no .json files given, the json is read from stdin */
+    guint n_inputs = g_slist_length(cfg->paths);
+    bool read_stdin = cfg->read_stdin || n_inputs == 0;
+
+    for(guint i = 0; i < n_inputs + (read_stdin ? 1 : 0); ++i) {
+        JsonParser *parser = json_parser_new();
+        GError *error = NULL;
+        const char *name = "stdin";
+        bool loaded = false;
+
+        if(i < n_inputs) {
+            RmPath *path = g_slist_nth_data(cfg->paths, i);
+            name = path->path;
+            loaded = json_parser_load_from_file(parser, name, &error);
+        } else {
+            GString *data = rm_session_read_stdin();
+            loaded = json_parser_load_from_data(parser, data->str, data->len, &error);
+            g_string_free(data, TRUE);
+        }
+
+        if(!loaded || !rm_session_load_groups(parser, groups)) {
+            rm_log_error_line(_("dedupe: %s is no valid rmlint json: %s"), name,
+                              error ? error->message : _("no array in /"));
+            all_valid = false;
+        }
+
+        g_clear_error(&error);
+        g_object_unref(parser);
+    }
+
+    RmDedupeBatch batch = {.cfg = cfg, .n_failed = 0};
+    guint n_files = 0;
+
+    GThreadPool *pool = rm_util_thread_pool_new(
+        (GFunc)rm_session_dedupe_batch_factory, &batch, CLAMP(cfg->threads, 1, 128));
+    for(guint i = 0; i < groups->len; ++i) {
+        RmDupeGroup *group = g_ptr_array_index(groups, i);
+        n_files += group->dupes->len;
+        if(group->dupes->len > 0) {
+            rm_util_thread_pool_push(pool, group);
+        }
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    rm_log_info_line(_("Deduped %u of %u files"), n_files - batch.n_failed, n_files);
+    g_ptr_array_free(groups, TRUE);
+
+    if(all_valid && batch.n_failed == 0 && !rm_session_was_aborted()) {
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+#endif
+#endif
+
+bool rm_session_dedupe_file(RmCfg *cfg, char *source_path, char *dest_path) {
+#if HAVE_FIDEDUPERANGE || HAVE_BTRFS_H
+    return rm_session_dedupe_group(cfg, source_path, &dest_path, 1) == 1;
+#else
+    (void)cfg;
+    (void)source_path;
+    (void)dest_path;
+    rm_log_error_line(_("rmlint was not compiled with file cloning support."));
+    return false;
+#endif
+}
+
 /**
  * *********** dedupe session main ************
  **/
 int rm_session_dedupe_main(RmCfg *cfg) {
 #if HAVE_FIDEDUPERANGE || HAVE_BTRFS_H
+    rm_log_debug_line("Cloning using %s", _DEDUPE_IOCTL_NAME);
+
+    if(!rm_session_check_kernel_version(4, _MIN_LINUX_SUBVERSION)) {
+        rm_log_warning_line("This needs at least linux >= 4.%d.", _MIN_LINUX_SUBVERSION);
+        return EXIT_FAILURE;
+    }
+
+    if(cfg->dedupe_batch) {
+#if HAVE_JSON_GLIB
+        return rm_session_dedupe_batch_main(cfg);
+#else
+        rm_log_error_line(_("json-glib is needed for using --dedupe-batch."));
+        return EXIT_FAILURE;
+#endif
+    }
+
     g_assert(cfg->path_count == g_slist_length(cfg->paths));
     if(cfg->path_count != 2) {
         rm_log_error(_("Usage: rmlint --dedupe [-r] [-v|V] source dest\n"));
@@ -216,143 +671,194 @@ int rm_session_dedupe_main(RmCfg *cfg) {
     RmPath *dest = cfg->paths->data;
     g_assert(cfg->paths->next);
     RmPath *source = cfg->paths->next->data;
-    rm_log_debug_line("Cloning %s -> %s", source->path, dest->path);
-
-    if(cfg->dedupe_check_xattr) {
-        // Check if we actually need to deduplicate.
-        // This utility will write a value to the extended attributes
-        // of the file so we know that we do not need to do it again
-        // next time. This is supposed to avoid disk thrashing.
-        // (See also: https://github.com/sahib/rmlint/issues/349)
-        if(rm_xattr_is_deduplicated(dest->path, cfg->follow_symlinks)) {
-            rm_log_debug_line("Already deduplicated according to xattr!");
-            return EXIT_SUCCESS;
-        }
-    }
 
-    // Also use --is-reflink on both files before doing extra work:
-    if(rm_util_link_type(source->path, dest->path) == RM_LINK_REFLINK) {
-        rm_log_debug_line("Already an exact reflink!");
+    if(rm_session_dedupe_group(cfg, source->path, &dest->path, 1) == 1) {
         return EXIT_SUCCESS;
     }
 
-    int source_fd = rm_sys_open(source->path, O_RDONLY);
-    if(source_fd < 0) {
-        rm_log_error_line(_("dedupe: failed to open source file"));
-        return EXIT_FAILURE;
-    }
+#else
+    (void)cfg;
+    rm_log_error_line(_("rmlint was not compiled with file cloning support."))
+#endif
 
-    struct stat source_stat;
-    fstat(source_fd, &source_stat);
-    gint64 bytes_deduped = 0;
+    return EXIT_FAILURE;
+}
 
-    /* a poorly-documented limit for dedupe ioctl's */
-    static const gint64 max_dedupe_chunk = 16 * 1024 * 1024;
+/* a file of a --is-reflink-batch pair, kept open for as long as the
+ * following pairs name it again */
+typedef struct RmReflinkFile {
+    char *path;
+    int fd;
+    RmStat stat;
 
-    /* how fine a resolution to use once difference detected;
-     * use btrfs default node size (16k): */
-    static const gint64 min_dedupe_chunk = 16 * 1024;
+    /* RM_LINK_NONE unless the file can't be compared at all */
+    RmLinkType state;
 
-    rm_log_debug_line("Cloning using %s", _DEDUPE_IOCTL_NAME);
+    /* read on first use */
+    RmExtentMap *extents;
+    bool extents_read;
+} RmReflinkFile;
 
-    if(!rm_session_check_kernel_version(4, _MIN_LINUX_SUBVERSION)) {
-        rm_log_warning_line("This needs at least linux >= 4.%d.", _MIN_LINUX_SUBVERSION);
-        return EXIT_FAILURE;
+static void rm_session_reflink_file_clear(RmReflinkFile *file) {
+    if(file->fd != -1) {
+        rm_sys_close(file->fd);
     }
+    rm_extent_map_free(file->extents);
+    g_free(file->path);
 
-    struct {
-        struct _FILE_DEDUPE_RANGE args;
-        struct _FILE_DEDUPE_RANGE_INFO info;
-    } dedupe;
-    memset(&dedupe, 0, sizeof(dedupe));
+    memset(file, 0, sizeof(RmReflinkFile));
+    file->fd = -1;
+}
 
-    dedupe.info._DEST_FD =
-        rm_sys_open(dest->path, cfg->dedupe_readonly ? O_RDONLY : O_RDWR);
+static void rm_session_reflink_file_open(RmReflinkFile *file, char *path) {
+    if(g_strcmp0(file->path, path) == 0) {
+        return;
+    }
 
-    if(dedupe.info._DEST_FD < 0) {
-        rm_log_error_line(
-            _("dedupe: error %i: failed to open dest file.%s"),
-            errno,
-            cfg->dedupe_readonly ? "" : _("\n\t(if target is a read-only snapshot "
-                                          "then -r option is required)"));
-        rm_sys_close(source_fd);
-        return EXIT_FAILURE;
+    rm_session_reflink_file_clear(file);
+    file->path = g_strdup(path);
+    file->state = RM_LINK_NONE;
+
+    file->fd = rm_sys_open(path, O_RDONLY);
+    if(file->fd == -1) {
+        rm_log_perrorf("Error opening %s", path);
+        file->state = RM_LINK_ERROR;
+    } else if(rm_sys_lstat(path, &file->stat) == -1) {
+        rm_log_perrorf("Unable to stat file %s", path);
+        file->state = RM_LINK_ERROR;
+    } else if(!S_ISREG(file->stat.st_mode)) {
+        file->state = RM_LINK_NOT_FILE;
     }
+}
 
-    /* fsync's needed to flush extent mapping */
-    if(fsync(source_fd) != 0) {
-        rm_log_warning_line("Error syncing source file %s: %s", source->path,
-                            strerror(errno));
+static RmExtentMap *rm_session_reflink_file_extents(RmReflinkFile *file) {
+    if(!file->extents_read) {
+        file->extents = rm_extent_map_new(file->fd);
+        file->extents_read = true;
     }
+    return file->extents;
+}
 
-    if(fsync(dedupe.info._DEST_FD) != 0) {
-        rm_log_warning_line("Error syncing dest file %s: %s", dest->path,
-                            strerror(errno));
+/* same answer as rm_util_link_type(), but on (possibly) cached files */
+static RmLinkType rm_session_reflink_pair(RmReflinkFile *a, RmReflinkFile *b) {
+    if(a->state != RM_LINK_NONE) {
+        return a->state;
+    }
+    if(b->state != RM_LINK_NONE) {
+        return b->state;
     }
 
-    int ret = 0;
-    gint64 dedupe_chunk = max_dedupe_chunk;
-    while(bytes_deduped < source_stat.st_size && !rm_session_was_aborted()) {
-        dedupe.args.dest_count = 1;
-        /* TODO: multiple destinations at same time? */
-        dedupe.args._SRC_OFFSET = bytes_deduped;
-        dedupe.info._DEST_OFFSET = bytes_deduped;
+    RmLinkType result = rm_util_link_type_stat(a->path, &a->stat, b->path, &b->stat);
+    if(result != RM_LINK_NONE) {
+        return result;
+    }
+    return rm_extent_map_link_type(rm_session_reflink_file_extents(a),
+                                   rm_session_reflink_file_extents(b));
+}
 
-        /* try to dedupe the rest of the file */
-        dedupe.args._SRC_LENGTH = MIN(dedupe_chunk, source_stat.st_size - bytes_deduped);
+/* split stdin into a flat list of pairs: either rmlint json (one pair of
+ * original and dupe per duplicate) or paths, one per line (or \0 separated) */
+static bool rm_session_reflink_load_stdin(RmCfg *cfg, GPtrArray *pairs) {
+    GString *data = rm_session_read_stdin();
+    bool success = true;
 
-        ret = ioctl(source_fd, _DEDUPE_IOCTL, &dedupe);
+    const char *start = data->str;
+    while(g_ascii_isspace(*start)) {
+        start++;
+    }
 
-        if(ret != 0) {
-            break;
-        } else if(dedupe.info.status == _DATA_DIFFERS) {
-            if(dedupe_chunk != min_dedupe_chunk) {
-                dedupe_chunk = min_dedupe_chunk;
-                rm_log_debug_line("Dropping to %"G_GINT64_FORMAT"-byte chunks "
-                                  "after %"G_GINT64_FORMAT" bytes",
-                                  dedupe_chunk, bytes_deduped);
-                continue;
-            } else {
-                break;
+    if(*start == '[') {
+#if HAVE_JSON_GLIB
+        JsonParser *parser = json_parser_new();
+        GPtrArray *groups =
+            g_ptr_array_new_with_free_func((GDestroyNotify)rm_session_dupe_group_free);
+        GError *error = NULL;
+
+        if(!json_parser_load_from_data(parser, data->str, data->len, &error) ||
+           !rm_session_load_groups(parser, groups)) {
+            rm_log_error_line(_("is-reflink: stdin is no valid rmlint json: %s"),
+                              error ? error->message : _("no array in /"));
+            success = false;
+        }
+
+        for(guint i = 0; i < groups->len; ++i) {
+            RmDupeGroup *group = g_ptr_array_index(groups, i);
+            for(guint j = 0; j < group->dupes->len; ++j) {
+                g_ptr_array_add(pairs, g_strdup(group->original));
+                g_ptr_array_add(pairs, g_strdup(g_ptr_array_index(group->dupes, j)));
             }
-        } else if(dedupe.info.status != 0) {
-            ret = -dedupe.info.status;
-            errno = ret;
-            break;
-        } else if(dedupe.info.bytes_deduped == 0) {
-            break;
         }
 
-        bytes_deduped += dedupe.info.bytes_deduped;
+        g_clear_error(&error);
+        g_ptr_array_free(groups, TRUE);
+        g_object_unref(parser);
+#else
+        rm_log_error_line(_("json-glib is needed for reading json with --is-reflink-batch."));
+        success = false;
+#endif
+    } else {
+        char delim = cfg->read_stdin0 ? '\0' : '\n';
+        const char *end = data->str + data->len;
+        for(const char *line = data->str; line < end;) {
+            const char *next = memchr(line, delim, end - line);
+            if(next == NULL) {
+                next = end;
+            }
+            if(next > line) {
+                g_ptr_array_add(pairs, g_strndup(line, next - line));
+            }
+            line = next + 1;
+        }
     }
-    rm_log_debug_line("Bytes deduped: %"G_GINT64_FORMAT, bytes_deduped);
 
-    if (ret!=0) {
-        rm_log_perrorf(_("%s returned error: (%d)"), _DEDUPE_IOCTL_NAME, ret);
-    } else if(bytes_deduped == 0) {
-        rm_log_info_line(_("Files don't match - not deduped"));
-    } else if(bytes_deduped < source_stat.st_size) {
-        rm_log_info_line(_("Only first %"G_GINT64_FORMAT" bytes deduped "
-                           "- files not fully identical"),
-                         bytes_deduped);
-    }
+    g_string_free(data, TRUE);
+    return success;
+}
 
-    rm_sys_close(source_fd);
-    rm_sys_close(dedupe.info._DEST_FD);
+static int rm_session_is_reflink_batch_main(RmCfg *cfg) {
+    GPtrArray *pairs = g_ptr_array_new_with_free_func(g_free);
+    bool all_reflinks = rm_session_reflink_load_stdin(cfg, pairs);
+
+    if(pairs->len % 2 != 0) {
+        rm_log_warning_line(_("Odd number of paths; ignoring the last one (%s)"),
+                            (char *)g_ptr_array_index(pairs, pairs->len - 1));
+        all_reflinks = false;
+    }
 
-    if(bytes_deduped == source_stat.st_size) {
-        if(cfg->dedupe_check_xattr && !cfg->dedupe_readonly) {
-            rm_xattr_mark_deduplicated(dest->path, cfg->follow_symlinks);
+    /* consecutive pairs that share a file (usually the original) only open
+     * and map it once */
+    RmReflinkFile files[2];
+    memset(files, 0, sizeof(files));
+    files[0].fd = files[1].fd = -1;
+
+    guint n_reflinks = 0;
+    for(guint i = 0; i + 1 < pairs->len && !rm_session_was_aborted(); i += 2) {
+        char *path_a = g_ptr_array_index(pairs, i);
+        char *path_b = g_ptr_array_index(pairs, i + 1);
+        rm_session_reflink_file_open(&files[0], path_a);
+        rm_session_reflink_file_open(&files[1], path_b);
+
+        RmLinkType result = rm_session_reflink_pair(&files[0], &files[1]);
+        if(result == RM_LINK_REFLINK) {
+            n_reflinks++;
+        } else {
+            all_reflinks = false;
         }
 
-        return EXIT_SUCCESS;
+        /* same codes as the exit status of --is-reflink */
+        printf("%d\t%s\t%s\n", result, path_a, path_b);
     }
 
-#else
-    (void)cfg;
-    rm_log_error_line(_("rmlint was not compiled with file cloning support."))
-#endif
+    for(int i = 0; i < 2; ++i) {
+        rm_session_reflink_file_clear(&files[i]);
+    }
 
+    rm_log_info_line(_("%u of %u pairs are reflinks"), n_reflinks, pairs->len / 2);
+    g_ptr_array_free(pairs, TRUE);
+
+    if(all_reflinks && !rm_session_was_aborted()) {
+        return EXIT_SUCCESS;
+    }
     return EXIT_FAILURE;
 }
 
@@ -371,6 +877,10 @@ int rm_session_is_reflink_main(RmCfg *cfg) {
      * Other return values defined in utilities.h 'RmOffsetsMatchCode' enum
      */
 
+    if(cfg->is_reflink_batch) {
+        return rm_session_is_reflink_batch_main(cfg);
+    }
+
     g_assert(cfg->path_count == g_slist_length(cfg->paths));
     if(cfg->path_count != 2) {
         rm_log_error(_("Usage: rmlint --is-reflink [-v|V] file1 file2\n"));
@@ -35,14 +35,12 @@
 #include "treemerge.h"  // RmTreeMerger
 
 typedef struct RmFileTables {
-    /* List of all files found during traversal */
-    GQueue *all_files;
+    /* Array of all files found during traversal; after preprocessing it holds
+     * only the duplicate candidates, ordered by size group */
+    GPtrArray *all_files;
 
-    /* GSList of GList's, one for each file size */
-    GSList *size_groups;
-
-    /* Used for finding inode matches */
-    GHashTable *node_table;
+    /* Array of guint; end index (exclusive) in all_files of each size group */
+    GArray *size_groups;
 
     /* Used for finding path doubles */
     GHashTable *unique_paths_table;
@@ -50,7 +48,9 @@ typedef struct RmFileTables {
     /*array of lists, one for each "other lint" type */
     GList *other_lint[RM_LINT_TYPE_DUPE_CANDIDATE];
 
-    /* lock for access to *list during traversal */
+    /* lock for access to *list during traversal; also serialises
+     * preprocessing and session->total_filtered_files updates while
+     * traversal and shredder run side by side (cfg->pipeline) */
     GMutex lock;
 } RmFileTables;
 
@@ -190,6 +190,13 @@ static INLINE bool rm_session_was_aborted(void) {
  */
 bool rm_session_check_kernel_version(int need_major, int need_minor);
 
+/**
+ * @brief Dedupe a single dest from source, as `rmlint --dedupe source dest` does.
+ *
+ * @return true if dest shares all of source's data afterwards.
+ */
+bool rm_session_dedupe_file(RmCfg *cfg, char *source_path, char *dest_path);
+
 /**
  * @brief Trigger rmlint in --dedupe mode.
  *
@@ -32,11 +32,13 @@
 
 #include "checksum.h"
 #include "hasher.h"
+#include "lockstep.h"
 
 #include "formats.h"
 #include "preprocess.h"
 #include "utilities.h"
 
+#include "dir-cache.h"
 #include "md-scheduler.h"
 #include "shredder.h"
 #include "xattr.h"
@@ -284,6 +286,12 @@
  * rate = 160ms read vs typical seek time 10ms*/
 #define SHRED_PARANOID_BYTES (16 * 1024 * 1024)
 
+/* Paranoid groups that need more than 1/SHRED_PARANOID_FALLBACK_DIVISOR of the
+ * paranoid memory budget don't wait for memory when refused; they are hashed
+ * with RM_DEFAULT_DIGEST instead and compared block by block at the end, using
+ * no more than that share of the budget (see rm_shred_lockstep_verify) */
+#define SHRED_PARANOID_FALLBACK_DIVISOR (4)
+
 /* When paranoid hashing, if a file increments is larger
  * than SHRED_PREMATCH_THRESHOLD, we take a guess at the likely
  * matching file and do a progressive memcmp() on each buffer
@@ -298,6 +306,15 @@
 /* Maximum number of bytes before worth_waiting becomes false */
 #define SHRED_TOO_MANY_BYTES_TO_WAIT (64 * 1024 * 1024)
 
+/* How much of a queued file to read ahead while the files before it are being
+ * hashed (see rm_shred_prefetch); hints for all queued files together may use
+ * up to 1/SHRED_PREFETCH_MEM_DIVISOR of cfg->total_mem of page cache */
+#define SHRED_PREFETCH_BYTES (1024 * 1024)
+#define SHRED_PREFETCH_MEM_DIVISOR (16)
+
+/* Threads issuing the readahead hints; open(2) may block on network mounts */
+#define SHRED_PREFETCH_THREADS (2)
+
 ///////////////////////////////////////////////////////////////////////
 //    INTERNAL STRUCTURES, WITH THEIR INITIALISERS AND DESTROYERS    //
 ///////////////////////////////////////////////////////////////////////
@@ -308,13 +325,33 @@ typedef struct RmShredTag {
     RmSession *session;
     GMutex hash_mem_mtx;
     gint64 paranoid_mem_alloc; /* how much memory to allocate for paranoid checks */
+    gint64 paranoid_mem_total; /* paranoid_mem_alloc at the start */
     gint32 active_groups; /* how many shred groups active (only used with paranoid) */
     RmHasher *hasher;
+    /* scheduler for the hashing tasks; this is session->mds unless running
+     * alongside traversal (cfg->pipeline) */
+    RmMDS *mds;
+    /* cfg->pipeline: first generation RmShredGroups by file size (indexed by
+     * RmFile.is_symlink); each holds an extra num_pending reference so that
+     * it stays open for files from devices that are still being traversed */
+    GHashTable *held_groups[2];
+    /* cached parent dir fds so files can be opened via openat() */
+    RmDirCache *dir_cache;
+    /* cfg->build_fiemap: GETFSMAP space map per device (dev_t -> RmFsMap, or
+     * NULL if the filesystem/privileges don't allow it) */
+    GHashTable *fsmaps;
+    GMutex fsmap_lock;
     GThreadPool *result_pool;
     /* threadpool for progress counters to avoid blocking delays in
      * rm_shred_adjust_counters */
     GThreadPool *counter_pool;
+    /* threadpool for readahead of files that are next in the scheduler's queue;
+     * NULL if prefetching is not used */
+    GThreadPool *prefetch_pool;
     gint32 page_size;
+    /* size of the first increment; tag->page_size * SHRED_BALANCED_PAGES
+     * unless measured by --calibrate */
+    RmOff balanced_bytes;
     bool mem_refusing;
 
     GMutex lock;
@@ -381,6 +418,13 @@ typedef struct RmShredGroup {
     /* set if group has been greenlighted by paranoid mem manager */
     bool is_active : 1;
 
+    /* set once cfg->paranoid_lockstep compared the group's files */
+    bool is_verified : 1;
+
+    /* set if split off by rm_shred_lockstep_verify; its digest was inherited
+     * from files with different content, so it must not be stored */
+    bool is_lockstep_reject : 1;
+
     /* if whole group has same basename, pointer to first file, else null */
     RmFile *unique_basename;
 
@@ -502,7 +546,7 @@ static gint32 rm_shred_get_read_size(RmFile *file, RmShredTag *tag) {
 
     /* calculate next_offset property of the RmShredGroup */
     g_assert(tag);
-    RmOff balanced_bytes = tag->page_size * SHRED_BALANCED_PAGES;
+    RmOff balanced_bytes = tag->balanced_bytes;
     RmOff target_bytes = balanced_bytes * group->offset_factor;
     if(group->next_offset == 2) {
         file->fadvise_requested = 1;
@@ -558,6 +602,11 @@ static void rm_shred_mem_return(RmShredGroup *group) {
                 rm_digest_free(group->digest);
                 group->digest = NULL;
             }
+
+            if(tag->mds) {
+                /* files that were refused memory may be able to go now */
+                rm_mds_kick(tag->mds);
+            }
         }
         g_mutex_unlock(&tag->hash_mem_mtx);
         group->mem_allocation = 0;
@@ -586,9 +635,11 @@ static bool rm_shred_check_paranoid_mem_alloc(RmShredGroup *group,
         return true;
     }
 
+    /* charge what the paranoid buffers really take, not just their data */
     gint64 mem_required =
         (rm_shred_group_potential_file_count(group) / 2 + 1) *
-        MIN(group->file_size - group->hash_offset, SHRED_PARANOID_BYTES);
+        rm_digest_paranoid_footprint(
+            MIN(group->file_size - group->hash_offset, SHRED_PARANOID_BYTES));
 
     bool result = FALSE;
     RmShredTag *tag = group->session->shredder;
@@ -630,6 +681,15 @@ static bool rm_shred_check_paranoid_mem_alloc(RmShredGroup *group,
             group->is_active = TRUE;
             group->status = RM_SHRED_GROUP_HASHING;
             result = TRUE;
+        } else if(mem_required > tag->paranoid_mem_total / SHRED_PARANOID_FALLBACK_DIVISOR) {
+            /* this group would hold up the others for long; let it go ahead
+             * without buffers and compare its files directly at the end */
+            rm_log_debug_line("Group needs %" LLI " bytes for paranoid hashing; "
+                              "falling back to hash + lockstep compare",
+                              mem_required);
+            group->digest_type = RM_DEFAULT_DIGEST;
+            group->status = RM_SHRED_GROUP_HASHING;
+            result = TRUE;
         } else {
             if(!tag->mem_refusing) {
                 rm_log_debug_line(
@@ -670,12 +730,16 @@ static void rm_shred_counter_factory(RmCounterBuffer *buffer, RmShredTag *tag) {
     RmSession *session = tag->session;
     session->shred_files_remaining += buffer->files;
     if(buffer->files < 0) {
-        session->total_filtered_files += buffer->files;
+        g_mutex_lock(&session->tables->lock);
+        { session->total_filtered_files += buffer->files; }
+        g_mutex_unlock(&session->tables->lock);
     }
     session->shred_bytes_remaining += buffer->bytes;
     rm_fmt_set_state(session->formats, (tag->after_preprocess)
                                            ? RM_PROGRESS_STATE_SHREDDER
-                                           : RM_PROGRESS_STATE_PREPROCESS);
+                                           : (session->traverse_finished)
+                                                 ? RM_PROGRESS_STATE_PREPROCESS
+                                                 : RM_PROGRESS_STATE_TRAVERSE);
 
     /* fake interrupt option for debugging/testing: */
     if(tag->after_preprocess && session->cfg->fake_abort &&
@@ -730,20 +794,75 @@ static void rm_shred_discard_file(RmFile *file, bool free_file) {
     }
 }
 
+/* Lookup the physical offset of file's data in the space map of its device;
+ * the map is read on first use of each device.  Reading it can take a while,
+ * so it happens outside of fsmap_lock; until it is done, lookups on that
+ * device fail and the caller falls back to FIEMAP.
+ * */
+static bool rm_shred_fsmap_lookup(RmShredTag *tag, RmFile *file, RmOff *physical) {
+    RmFsMap *fsmap = NULL;
+    gpointer key = GUINT_TO_POINTER(file->dev);
+    bool first_use = false;
+
+    g_mutex_lock(&tag->fsmap_lock);
+    {
+        if(!g_hash_table_lookup_extended(tag->fsmaps, key, NULL, (gpointer *)&fsmap)) {
+            /* NULL placeholder until the map is read */
+            g_hash_table_insert(tag->fsmaps, key, NULL);
+            first_use = true;
+        }
+    }
+    g_mutex_unlock(&tag->fsmap_lock);
+
+    if(first_use) {
+        RM_DEFINE_PATH(file);
+        int fd = rm_sys_open(file_path, O_RDONLY);
+        if(fd != -1) {
+            fsmap = rm_fsmap_new(fd);
+            rm_sys_close(fd);
+        }
+        rm_log_debug_line("GETFSMAP for device %u: %s", (unsigned)file->dev,
+                          fsmap ? "available" : "not available");
+
+        if(fsmap) {
+            g_mutex_lock(&tag->fsmap_lock);
+            {
+                /* replaces (and frees) the NULL placeholder */
+                g_hash_table_insert(tag->fsmaps, key, fsmap);
+            }
+            g_mutex_unlock(&tag->fsmap_lock);
+        }
+    }
+
+    return rm_fsmap_lookup(fsmap, file->inode, physical);
+}
+
 /* Push file to scheduler queue.
  * */
 static void rm_shred_push_queue(RmFile *file) {
-    if(file->hash_offset == 0) {
-        /* first-timer; lookup disk offset */
+    if(!file->disk_offset_known) {
+        /* first-timer; lookup disk offset (once only: files that are
+         * pushed again before their first increment keep what was found) */
+        file->disk_offset_known = true;
+        /* use inode number instead of disk offset if no extents available */
+        file->disk_offset = file->inode;
         if(file->session->cfg->build_fiemap &&
            !rm_mounts_is_nonrotational(file->session->mounts, file->dev)) {
-            RM_DEFINE_PATH(file);
-            file->disk_offset = rm_offset_get_from_path(file_path, 0, NULL);
-        } else {
-            /* use inode number instead of disk offset */
-            file->disk_offset = file->inode;
+            RmOff physical = 0;
+            if(rm_shred_fsmap_lookup(file->session->shredder, file, &physical)) {
+                /* whole-device map already knows where the file starts;
+                 * later increments keep sorting by that */
+                file->disk_offset = physical;
+            } else {
+                RM_DEFINE_PATH(file);
+                file->extents = rm_extent_map_new_from_path(file_path);
+            }
         }
     }
+    if(file->extents) {
+        /* sort the next increment by where its data actually is on disk */
+        file->disk_offset = rm_extent_map_lookup(file->extents, file->hash_offset);
+    }
     rm_mds_push_task(file->disk, file->dev, file->disk_offset, NULL, file);
 }
 
@@ -1070,17 +1189,57 @@ static void rm_shred_hash_callback(
 //  SHRED-SPECIFIC PREPROCESSING  //
 ////////////////////////////////////
 
-/* Basically this unloads files from the initial list build (which has
+/* Basically this unloads files from the initial array build (which has
  * hardlinks already grouped).
  * Outline:
- * 1. Use g_hash_table_foreach_remove to send RmFiles from node_table
- *    to size_groups via rm_shred_file_preprocess.
- * 2. Use g_hash_table_foreach_remove to delete all singleton and other
- *    non-qualifying groups from size_groups via rm_shred_group_preprocess.
- * 3. Use g_hash_table_foreach to do the FIEMAP lookup for all remaining
- *    files via rm_shred_device_preprocess.
+ * 1. For each size group slice of tables->all_files, cluster ext_cksum
+ *    twins via rm_shred_process_group.
+ * 2. Send the remaining RmFiles to their RmShredGroup via
+ *    rm_shred_file_preprocess; singleton groups are finalised right away.
  * */
 
+/* cfg->pipeline: get the held first generation RmShredGroup for files of the
+ * same size as file, creating it if needed */
+static RmShredGroup *rm_shred_held_group_get(RmShredTag *tag, RmFile *file) {
+    GHashTable *held_groups = tag->held_groups[!!file->is_symlink];
+    RmShredGroup *group = g_hash_table_lookup(held_groups, &file->file_size);
+    if(!group) {
+        group = rm_shred_group_new(file);
+        group->digest_type = tag->session->cfg->checksum_type;
+        /* the hold; dropped by rm_shred_release_held_groups() */
+        group->num_pending = 1;
+        g_hash_table_insert(held_groups, &group->file_size, group);
+    }
+    return group;
+}
+
+/* cfg->pipeline: traversal has finished, so no more files can arrive; drop the
+ * hold on the first generation groups and finalise those with nothing pending */
+static void rm_shred_release_held_groups(RmShredTag *tag) {
+    for(int i = 0; i < 2; ++i) {
+        /* finalising may free a group (and so its key) */
+        GList *groups = g_hash_table_get_values(tag->held_groups[i]);
+        g_hash_table_destroy(tag->held_groups[i]);
+        tag->held_groups[i] = NULL;
+
+        for(GList *iter = groups; iter; iter = iter->next) {
+            RmShredGroup *group = iter->data;
+            gboolean group_finished = FALSE;
+            g_mutex_lock(&group->lock);
+            {
+                group->num_pending--;
+                group_finished = (group->num_pending == 0);
+            }
+            g_mutex_unlock(&group->lock);
+
+            if(group_finished) {
+                rm_shred_group_finalise(group);
+            }
+        }
+        g_list_free(groups);
+    }
+}
+
 /* Called for each file; find appropriate RmShredGroup (ie files with same size) and
  * push the file to it.
  * */
@@ -1098,6 +1257,11 @@ static void rm_shred_file_preprocess(RmFile *file, RmShredGroup **group) {
         file->digest = rm_digest_new(cfg->checksum_type, 0);
     }
 
+    if(!(*group) && shredder->held_groups[0]) {
+        /* files of this size may have arrived from other devices already */
+        *group = rm_shred_held_group_get(shredder, file);
+    }
+
     if(!(*group)) {
         /* create RmShredGroup using first file in size group as template*/
         *group = rm_shred_group_new(file);
@@ -1107,7 +1271,7 @@ static void rm_shred_file_preprocess(RmFile *file, RmShredGroup **group) {
     RM_DEFINE_PATH(file);
 
     /* add reference for this file to the MDS scheduler, and get pointer to its device */
-    file->disk = rm_mds_device_get(session->mds, file_path, (cfg->fake_pathindex_as_disk)
+    file->disk = rm_mds_device_get(shredder->mds, file_path, (cfg->fake_pathindex_as_disk)
                                                                 ? file->path_index + 1
                                                                 : file->dev);
     rm_mds_device_ref(file->disk, 1);
@@ -1143,8 +1307,119 @@ static gint rm_shred_cluster_ext(RmFile *file, RmFile *prev) {
     return FALSE;
 }
 
+typedef struct RmShredReflinkCandidate {
+    RmFile *file;
+    RmExtentMap *extents;
+    guint hash;
+    /* position in the files array passed to rm_shred_cluster_reflinks */
+    guint index;
+} RmShredReflinkCandidate;
+
+static gint rm_shred_cmp_reflink_candidate(const RmShredReflinkCandidate *a,
+                                           const RmShredReflinkCandidate *b) {
+    return SIGN_DIFF(a->hash, b->hash);
+}
+
+/* Cluster files of the same size whose data extents are all shared (reflinks,
+ * eg. left over from a previous --dedupe run): they are known to be identical,
+ * so only one of them needs to be read.  Returns the number of files left in
+ * files (clustered files are removed from it). */
+static guint rm_shred_cluster_reflinks(RmFile **files, guint n_files, RmShredTag *tag) {
+    RmSession *session = tag->session;
+    if(session->mounts == NULL || session->cfg->merge_directories || n_files < 2) {
+        /* treemerge needs a digest for every file */
+        return n_files;
+    }
+
+    GArray *candidates =
+        g_array_sized_new(FALSE, FALSE, sizeof(RmShredReflinkCandidate), n_files);
+    for(guint i = 0; i < n_files; ++i) {
+        RmFile *file = files[i];
+        if(file->file_size == 0 || (file->cluster && file->cluster->length > 1) ||
+           !rm_mounts_can_reflink(session->mounts, file->dev, file->dev)) {
+            /* nothing to gain, or already clustered by ext_cksum */
+            continue;
+        }
+
+        RM_DEFINE_PATH(file);
+        RmShredReflinkCandidate candidate = {file, rm_extent_map_new_from_path(file_path),
+                                             0, i};
+        candidate.hash = rm_extent_map_hash(candidate.extents);
+        if(candidate.hash == 0) {
+            rm_extent_map_free(candidate.extents);
+            continue;
+        }
+        g_array_append_val(candidates, candidate);
+    }
+
+    if(candidates->len < 2) {
+        goto cleanup;
+    }
+
+    g_array_sort(candidates, (GCompareFunc)rm_shred_cmp_reflink_candidate);
+
+    /* compare candidates with equal hashes */
+    gboolean *clustered = g_new0(gboolean, n_files);
+    for(guint i = 0; i < candidates->len; ++i) {
+        RmShredReflinkCandidate *host = &g_array_index(candidates, RmShredReflinkCandidate, i);
+        if(clustered[host->index]) {
+            continue;
+        }
+
+        for(guint j = i + 1; j < candidates->len; ++j) {
+            RmShredReflinkCandidate *guest =
+                &g_array_index(candidates, RmShredReflinkCandidate, j);
+            if(guest->hash != host->hash) {
+                break;
+            }
+
+            if(clustered[guest->index] ||
+               !rm_mounts_can_reflink(session->mounts, host->file->dev, guest->file->dev) ||
+               !rm_extent_map_equal(host->extents, guest->extents)) {
+                continue;
+            }
+
+            RmFile *host_file = host->file, *guest_file = guest->file;
+#if _RM_SHRED_DEBUG
+            RM_DEFINE_PATH(host_file);
+            RM_DEFINE_PATH(guest_file);
+            rm_log_debug_line("reflink cluster %s <-- %s", host_file_path, guest_file_path);
+#endif
+            if(guest_file->cluster) {
+                /* drop its hardlink self-cluster; the hardlinks stay bundled */
+                rm_file_cluster_remove(guest_file);
+            }
+            rm_file_cluster_add(host_file, guest_file);
+            clustered[guest->index] = TRUE;
+        }
+    }
+
+    guint n_kept = 0;
+    for(guint i = 0; i < n_files; ++i) {
+        if(!clustered[i]) {
+            files[n_kept++] = files[i];
+        }
+    }
+
+    if(n_kept < n_files) {
+        rm_log_debug_line("%u files of size %" LLU " are reflinks; not reading them",
+                          n_files - n_kept, files[0]->file_size);
+    }
+
+    g_free(clustered);
+    n_files = n_kept;
+
+cleanup:
+    for(guint i = 0; i < candidates->len; ++i) {
+        rm_extent_map_free(g_array_index(candidates, RmShredReflinkCandidate, i).extents);
+    }
+    g_array_free(candidates, TRUE);
+    return n_files;
+}
+
 /* sorting function to sort by external checksums */
-static gint rm_shred_cmp_ext_cksum(RmFile *a, RmFile *b) {
+static gint rm_shred_cmp_ext_cksum(RmFile **file_a, RmFile **file_b) {
+    RmFile *a = *file_a, *b = *file_b;
     if(!a->ext_cksum && !b->ext_cksum) {
         return 0;
     }
@@ -1154,9 +1429,13 @@ static gint rm_shred_cmp_ext_cksum(RmFile *a, RmFile *b) {
     return strcmp(a->ext_cksum, b->ext_cksum);
 }
 
-static void rm_shred_process_group(GSList *files, _UNUSED RmShredTag *main) {
+static void rm_shred_process_group(RmFile **files, guint n_files, RmShredTag *main) {
     g_assert(files);
-    g_assert(files->data);
+    g_assert(n_files > 0);
+
+    /* with cfg->pipeline, more files of this size may still turn up on other
+     * devices, so the group can't be finalised (or split) here */
+    gboolean group_is_held = !!main->held_groups[0];
 
     /* cluster hardlinks and ext_cksum matches;
      * Initially I over-complicated this until I realised that hardlinks
@@ -1166,36 +1445,38 @@ static void rm_shred_process_group(GSList *files, _UNUSED RmShredTag *main) {
      * hardlink.
      */
 
-    /* sort list so that external checksums are grouped; with large sets
+    /* sort array so that external checksums are grouped; with large sets
      * this is faster than a triangular search for twins */
-    files = g_slist_sort(files, (GCompareFunc)rm_shred_cmp_ext_cksum);
+    gboolean any_have_ext_cksums = FALSE;
+    for(guint i = 0; i < n_files && !any_have_ext_cksums; ++i) {
+        any_have_ext_cksums = !!files[i]->ext_cksum;
+    }
+    if(any_have_ext_cksums) {
+        g_qsort_with_data(files, n_files, sizeof(RmFile *),
+                          (GCompareDataFunc)rm_shred_cmp_ext_cksum, NULL);
+    }
 
-    /* cluster ext_cksum twins */
+    /* cluster ext_cksum twins, compacting the array as we go */
     gboolean all_have_ext_cksums = TRUE;
-    for(GSList *prev = NULL, *iter = files, *next = NULL; iter; iter = next) {
-        next = iter->next;
-        RmFile *file = iter->data;
+    guint n_kept = 0;
+    for(guint i = 0; i < n_files; ++i) {
+        RmFile *file = files[i];
         all_have_ext_cksums &= !!file->ext_cksum;
-        RmFile *prev_file = prev ? prev->data : NULL;
-        if(rm_shred_cluster_ext(file, prev_file)) {
-            /* delete iter from GSList */
-            g_slist_free1(iter);
-            if(prev) {
-                prev->next = next;
-            } else {
-                files = next;
-            }
-        } else {
-            prev = iter;
+        RmFile *prev_file = n_kept ? files[n_kept - 1] : NULL;
+        if(!rm_shred_cluster_ext(file, prev_file)) {
+            files[n_kept++] = file;
         }
     }
 
+    if(!all_have_ext_cksums) {
+        n_kept = rm_shred_cluster_reflinks(files, n_kept, main);
+    }
+
     /* push files to shred group */
     RmShredGroup *group = NULL;
-    RmFile *file = NULL;
-    while((file = rm_util_slist_pop(&files, NULL))) {
-        rm_shred_file_preprocess(file, &group);
-        if(all_have_ext_cksums) {
+    for(guint i = 0; i < n_kept; ++i) {
+        rm_shred_file_preprocess(files[i], &group);
+        if(all_have_ext_cksums && !group_is_held) {
             /* only one cluster per RmShredGroup */
             rm_shred_group_finalise(group);
             group = NULL;
@@ -1203,21 +1484,33 @@ static void rm_shred_process_group(GSList *files, _UNUSED RmShredTag *main) {
     }
 
     /* remove group if it failed to launch (eg if only 1 file) */
-    if(group && group->status == RM_SHRED_GROUP_DORMANT) {
+    if(group && group->status == RM_SHRED_GROUP_DORMANT && !group_is_held) {
         rm_shred_group_finalise(group);
     }
 }
 
+/* move preprocessed files (see rm_preprocess_files()) into initial
+ * RmShredGroups; files are owned by their RmShredGroups afterwards */
+static void rm_shred_process_groups(RmShredTag *main, GPtrArray *all_files,
+                                    GArray *size_groups) {
+    RmFile **files = (RmFile **)all_files->pdata;
+    for(guint i = 0, start = 0; i < size_groups->len; ++i) {
+        guint end = g_array_index(size_groups, guint, i);
+        rm_shred_process_group(&files[start], end - start, main);
+        start = end;
+    }
+
+    g_ptr_array_set_size(all_files, 0);
+    g_array_set_size(size_groups, 0);
+}
+
 static void rm_shred_preprocess_input(RmShredTag *main) {
     RmSession *session = main->session;
     guint removed = 0;
 
-    /* move files from node tables into initial RmShredGroups */
     rm_log_debug_line("preparing size groups for shredding (dupe finding)...");
-    RmFileTables *tables = session->tables;
-    g_slist_foreach(tables->size_groups, (GFunc)rm_shred_process_group, main);
-    g_slist_free(tables->size_groups);
-    tables->size_groups = NULL;
+    rm_shred_process_groups(main, session->tables->all_files,
+                            session->tables->size_groups);
     rm_log_debug_line("...done at time %.3f; removed %u of %" LLU,
                       g_timer_elapsed(session->timer, NULL), removed,
                       session->total_filtered_files);
@@ -1423,6 +1716,67 @@ static RmShredGroup *rm_shred_basename_rejects(RmShredGroup *group, RmShredTag *
 }
 
 
+static void rm_shred_group_postprocess(RmShredGroup *group, RmShredTag *tag);
+
+/* move files into a new, already verified group and post-process that */
+static void rm_shred_lockstep_reject(RmShredGroup *group, GQueue *files,
+                                     RmShredTag *tag) {
+    RmShredGroup *rejects = rm_shred_create_rejects(group, files->head->data);
+    rejects->is_verified = TRUE;
+    rejects->is_lockstep_reject = TRUE;
+    for(GList *iter = files->head; iter; iter = iter->next) {
+        rm_shred_group_transfer(iter->data, group, rejects);
+    }
+    rm_shred_group_postprocess(rejects, tag);
+}
+
+/* if cfg->paranoid_lockstep (or if a paranoid group had to fall back to
+ * hashing) then compare the files of the group byte-by-byte and split off any
+ * that differ from the largest set of identical files */
+static void rm_shred_lockstep_verify(RmShredGroup *group, RmShredTag *tag) {
+    RmCfg *cfg = tag->session->cfg;
+    RmFile *headfile = group->held_files->head->data;
+    bool paranoid_fallback = cfg->checksum_type == RM_DIGEST_PARANOID && group->digest &&
+                             group->digest->type != RM_DIGEST_PARANOID &&
+                             group->digest->type != RM_DIGEST_EXT;
+    if(!(cfg->paranoid_lockstep || paranoid_fallback) || group->is_verified ||
+       headfile->is_symlink || group->status != RM_SHRED_GROUP_FINISHING) {
+        return;
+    }
+    group->is_verified = TRUE;
+
+    /* held files keep their device (and its read throttle) referenced until
+     * rm_shred_group_free(), so rm_lockstep_split can pace its reads */
+    GQueue *files = g_queue_copy(group->held_files);
+    GQueue failed = G_QUEUE_INIT;
+    GList *sets =
+        paranoid_fallback
+            ? rm_lockstep_split(files, SHRED_PARANOID_BYTES,
+                                tag->paranoid_mem_total / SHRED_PARANOID_FALLBACK_DIVISOR,
+                                &failed)
+            : rm_lockstep_split(files, cfg->read_buf_len, cfg->total_mem, &failed);
+    g_queue_free(files);
+
+    if(sets) {
+        /* the first (largest) set stays */
+        for(GList *iter = sets->next; iter; iter = iter->next) {
+            rm_shred_lockstep_reject(group, iter->data, tag);
+        }
+    } else {
+        /* nothing could be read; keep one file so the group is not empty */
+        g_queue_pop_head(&failed);
+    }
+    for(GList *iter = failed.head; iter; iter = iter->next) {
+        /* can't vouch for these; each goes on its own */
+        GQueue single = G_QUEUE_INIT;
+        g_queue_push_tail(&single, iter->data);
+        rm_shred_lockstep_reject(group, &single, tag);
+    }
+
+    g_queue_clear(&failed);
+    rm_lockstep_free(sets);
+}
+
 /* if cfg->keep_hardlinked_dupes then tag hardlinked dupes as originals */
 static void rm_shred_tag_hardlink_rejects(RmShredGroup *group, _UNUSED RmShredTag *tag) {
     if(!tag->session->cfg->keep_hardlinked_dupes) {
@@ -1454,6 +1808,60 @@ static void rm_shred_tag_hardlink_rejects(RmShredGroup *group, _UNUSED RmShredTa
     }
 }
 
+/* if cfg->keep_reflinked_dupes then tag dupes that already share all data
+ * extents with an original (ie were deduplicated before) as originals */
+static void rm_shred_tag_reflink_rejects(RmShredGroup *group, RmShredTag *tag) {
+    RmMountTable *mounts = tag->session->mounts;
+    if(!tag->session->cfg->keep_reflinked_dupes || mounts == NULL) {
+        return;
+    }
+
+    if(group->status != RM_SHRED_GROUP_FINISHING) {
+        return;
+    }
+
+    /* extent maps of the originals, built as needed */
+    GHashTable *orig_extents =
+        g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)rm_extent_map_free);
+
+    for(GList *i_dupe = group->held_files->head; i_dupe; i_dupe = i_dupe->next) {
+        RmFile *dupe = i_dupe->data;
+        if(dupe->is_original || !rm_mounts_can_reflink(mounts, dupe->dev, dupe->dev)) {
+            continue;
+        }
+
+        RM_DEFINE_PATH(dupe);
+        RmExtentMap *dupe_extents = rm_extent_map_new_from_path(dupe_path);
+
+        for(GList *i_orig = group->held_files->head; i_orig && dupe_extents;
+            i_orig = i_orig->next) {
+            RmFile *orig = i_orig->data;
+            if(!orig->is_original) {
+                /* have gone past last original */
+                break;
+            }
+            if(!rm_mounts_can_reflink(mounts, orig->dev, dupe->dev)) {
+                continue;
+            }
+
+            if(!g_hash_table_contains(orig_extents, orig)) {
+                RM_DEFINE_PATH(orig);
+                g_hash_table_insert(orig_extents, orig,
+                                    rm_extent_map_new_from_path(orig_path));
+            }
+
+            if(rm_extent_map_equal(g_hash_table_lookup(orig_extents, orig),
+                                   dupe_extents)) {
+                dupe->is_original = TRUE;
+                break;
+            }
+        }
+        rm_extent_map_free(dupe_extents);
+    }
+
+    g_hash_table_unref(orig_extents);
+}
+
 /* post-process a group:
  * decide which file(s) are originals
  * maybe split out mtime rejects (--mtime-window option)
@@ -1474,6 +1882,7 @@ static void rm_shred_group_postprocess(RmShredGroup *group, RmShredTag *tag) {
     rm_shred_group_find_original(tag->session, group->held_files, group->status);
     rm_shred_group_postprocess(rm_shred_basename_rejects(group, tag), tag);
     rm_shred_group_postprocess(rm_shred_mtime_rejects(group, tag), tag);
+    rm_shred_lockstep_verify(group, tag);
 
     /* re-check whether what is left of the group still meets all criteria */
     group->status = (rm_shred_group_qualifies(group)) ? RM_SHRED_GROUP_FINISHING
@@ -1485,6 +1894,7 @@ static void rm_shred_group_postprocess(RmShredGroup *group, RmShredTag *tag) {
     rm_shred_group_find_original(tag->session, group->held_files, group->status);
 
     rm_shred_tag_hardlink_rejects(group, tag);
+    rm_shred_tag_reflink_rejects(group, tag);
 
     /* Update statistics */
     if(group->status == RM_SHRED_GROUP_FINISHING) {
@@ -1513,7 +1923,9 @@ static void rm_shred_group_postprocess(RmShredGroup *group, RmShredTag *tag) {
         rm_shred_forward_to_output(tag->session, group->held_files);
     }
 
-    rm_shred_write_group_to_xattr(tag->session, group->held_files);
+    if(!group->is_lockstep_reject) {
+        rm_shred_write_group_to_xattr(tag->session, group->held_files);
+    }
 
     if(group->status == RM_SHRED_GROUP_FINISHING) {
         group->status = RM_SHRED_GROUP_FINISHED;
@@ -1580,11 +1992,13 @@ static bool rm_shred_reassign_checksum(RmShredTag *main, RmFile *file) {
     RmShredGroup *group = file->shred_group;
 
     if(group->digest_type == RM_DIGEST_PARANOID) {
-        /* check if memory allocation is ok */
+        /* check if memory allocation is ok (or whether to fall back) */
         if(!rm_shred_check_paranoid_mem_alloc(group, 0)) {
             return false;
         }
+    }
 
+    if(group->digest_type == RM_DIGEST_PARANOID) {
         /* get the required target offset into group->next_offset, so that
          * we can make the paranoid RmDigest the right size*/
         g_mutex_lock(&group->lock);
@@ -1597,6 +2011,7 @@ static bool rm_shred_reassign_checksum(RmShredTag *main, RmFile *file) {
         g_mutex_unlock(&group->lock);
 
         file->digest = rm_digest_new(RM_DIGEST_PARANOID, 0);
+        rm_digest_reserve(file->digest, group->next_offset - file->hash_offset);
 
         if((file->is_symlink == false || cfg->see_symlinks == false) &&
            (group->next_offset > file->hash_offset + SHRED_PREMATCH_THRESHOLD)) {
@@ -1618,13 +2033,13 @@ static bool rm_shred_reassign_checksum(RmShredTag *main, RmFile *file) {
             }
             g_mutex_unlock(&group->lock);
         }
-    } else if(group->digest) {
+    } else if(group->digest && group->digest->type == group->digest_type) {
         /* pick up the digest-so-far from the RmShredGroup */
         file->digest = rm_digest_copy(group->digest);
     } else {
-        /* this is first generation of RMGroups, so there is no progressive hash yet */
-        file->digest = rm_digest_new(cfg->checksum_type,
-                                     main->session->hash_seed);
+        /* this is first generation of RMGroups (or the first after a paranoid
+         * fallback), so there is no progressive hash yet */
+        file->digest = rm_digest_new(group->digest_type, main->session->hash_seed);
     }
     return true;
 }
@@ -1638,6 +2053,94 @@ static bool rm_shred_can_process(RmFile *file, RmShredTag *main) {
     }
 }
 
+/* readahead job for the prefetch_pool */
+typedef struct RmShredPrefetch {
+    RmNode *folder;
+    RmOff offset;
+    RmOff len;
+} RmShredPrefetch;
+
+static void rm_shred_prefetch_factory(RmShredPrefetch *job, RmShredTag *tag) {
+#if HAVE_POSIX_FADVISE
+    int fd = rm_dir_cache_open(tag->dir_cache, job->folder, O_RDONLY);
+    if(fd != -1) {
+        posix_fadvise(fd, job->offset, job->len, POSIX_FADV_WILLNEED);
+        rm_sys_close(fd);
+    }
+#endif
+    g_slice_free(RmShredPrefetch, job);
+}
+
+/* Prefetch callback for RmMDS; called with the file's device locked so it only
+ * queues the readahead for the prefetch_pool.  The file is still queued, so
+ * nobody is hashing it (and moving hash_offset) right now. */
+static void rm_shred_prefetch(RmMDSTask *task, RmSession *session) {
+    RmShredTag *tag = session->shredder;
+    RmFile *file = task->task_data;
+    if(file->is_symlink || file->hash_offset >= file->file_size) {
+        return;
+    }
+
+    RmShredPrefetch *job = g_slice_new(RmShredPrefetch);
+    job->folder = file->folder;
+    job->offset = file->hash_offset;
+    job->len = MIN(file->file_size - file->hash_offset, SHRED_PREFETCH_BYTES);
+    rm_util_thread_pool_push(tag->prefetch_pool, job);
+}
+
+/* Update totals for file, device and session after an increment was read */
+static void rm_shred_increment_done(RmShredTag *tag, RmFile *file, RmOff bytes_to_read,
+                                    RmOff bytes_read) {
+    /* TODO: make this threadsafe: */
+    tag->session->shred_bytes_read += bytes_read;
+
+    file->hash_offset += bytes_to_read;
+    if(file->extents && file->hash_offset >= file->file_size) {
+        /* no further increments to schedule */
+        rm_extent_map_free(file->extents);
+        file->extents = NULL;
+    }
+    if(file->is_symlink) {
+        rm_shred_adjust_counters(tag, 0, -(gint64)file->file_size);
+    } else {
+        rm_shred_adjust_counters(tag, 0, -(gint64)bytes_to_read);
+    }
+}
+
+/* Fast path for files that fit into one read buffer: read and hash them in the
+ * device worker itself, skipping the hasher task, hashpipe handoff and callback
+ * that would cost more than the data.  Returns the file if it needs further
+ * processing (like rm_shred_sift). */
+static RmFile *rm_shred_hash_small(RmShredTag *tag, RmFile *file, int *fd,
+                                   RmOff bytes_to_read) {
+    guint64 bytes_read = 0;
+    gboolean success = FALSE;
+
+    if(*fd == -1) {
+        *fd = rm_dir_cache_open(tag->dir_cache, file->folder, O_RDONLY);
+    }
+    if(*fd == -1) {
+        RM_DEFINE_PATH(file);
+        rm_log_info("open(2) failed for %s: %s\n", file_path, g_strerror(errno));
+    } else {
+        success = rm_hasher_hash_small(tag->hasher, file->digest,
+                                       rm_mds_device_get_throttle(file->disk), *fd,
+                                       file->folder->basename, file->hash_offset,
+                                       bytes_to_read, &bytes_read);
+    }
+
+    if(!success) {
+        file->status = RM_FILE_STATE_IGNORE;
+    }
+
+    rm_shred_increment_done(tag, file, bytes_to_read, bytes_read);
+
+    /* the digest is up to date already, so do what rm_shred_hash_callback would */
+    file->signal = NULL;
+    file->shredder_waiting = FALSE;
+    return rm_shred_sift(file);
+}
+
 /* Callback for RmMDS
  * Return value of 1 tells md-scheduler that we have processed the file and either
  * disposed of it or pushed it back to the scheduler queue.
@@ -1654,7 +2157,9 @@ static gint rm_shred_process_file(RmFile *file, RmSession *session) {
     }
 
     gint result = 0;
-    RM_DEFINE_PATH(file);
+
+    /* opened on first use and kept for all increments hashed in this call */
+    int fd = -1;
 
     while(file && rm_shred_can_process(file, tag)) {
         result = 1;
@@ -1662,6 +2167,12 @@ static gint rm_shred_process_file(RmFile *file, RmSession *session) {
         RmCfg *cfg = session->cfg;
         RmOff bytes_to_read = rm_shred_get_read_size(file, tag);
 
+        if(!file->is_symlink &&
+           rm_hasher_can_hash_small(tag->hasher, file->digest, file->file_size)) {
+            file = rm_shred_hash_small(tag, file, &fd, bytes_to_read);
+            continue;
+        }
+
         gboolean shredder_waiting =
             (file->shred_group->next_offset != file->file_size) &&
             (cfg->shred_always_wait ||
@@ -1670,23 +2181,33 @@ static gint rm_shred_process_file(RmFile *file, RmSession *session) {
 
         guint64 bytes_read = 0;
         RmHasherTask *task = rm_hasher_task_new(tag->hasher, file->digest, file);
-        if(!rm_hasher_task_hash(task, file_path, file->hash_offset, bytes_to_read,
-                                file->is_symlink, &bytes_read)) {
+        rm_hasher_task_set_throttle(task, rm_mds_device_get_throttle(file->disk));
+        gboolean success = FALSE;
+        if(file->is_symlink) {
+            RM_DEFINE_PATH(file);
+            success = rm_hasher_task_hash(task, file_path, file->hash_offset,
+                                          bytes_to_read, TRUE, &bytes_read);
+        } else {
+            if(fd == -1) {
+                fd = rm_dir_cache_open(tag->dir_cache, file->folder, O_RDONLY);
+            }
+            if(fd == -1) {
+                RM_DEFINE_PATH(file);
+                rm_log_info("open(2) failed for %s: %s\n", file_path, g_strerror(errno));
+            } else {
+                success = rm_hasher_task_hash_fd(task, fd, file->folder->basename,
+                                                 file->hash_offset, bytes_to_read,
+                                                 &bytes_read);
+            }
+        }
+
+        if(!success) {
             /* rm_hasher_start_increment failed somewhere */
             file->status = RM_FILE_STATE_IGNORE;
             shredder_waiting = FALSE;
         }
 
-        /* TODO: make this threadsafe: */
-        session->shred_bytes_read += bytes_read;
-
-        /* Update totals for file, device and session*/
-        file->hash_offset += bytes_to_read;
-        if(file->is_symlink) {
-            rm_shred_adjust_counters(tag, 0, -(gint64)file->file_size);
-        } else {
-            rm_shred_adjust_counters(tag, 0, -(gint64)bytes_to_read);
-        }
+        rm_shred_increment_done(tag, file, bytes_to_read, bytes_read);
 
         if(shredder_waiting) {
             /* some final checks if it's still worth waiting for the hash result */
@@ -1716,9 +2237,14 @@ static gint rm_shred_process_file(RmFile *file, RmSession *session) {
             file = NULL;
         }
     }
+
+    if(fd != -1) {
+        rm_sys_close(fd);
+    }
+
     if(file) {
         /* file was not handled by rm_shred_sift so we need to add it back to the queue */
-        rm_mds_push_task(file->disk, file->dev, file->disk_offset, NULL, file);
+        rm_shred_push_queue(file);
     }
     return result;
 }
@@ -1731,28 +2257,26 @@ void rm_shred_output_tm_results(RmFile *file, gpointer data) {
     rm_fmt_write(file, session->formats);
 }
 
-void rm_shred_run(RmSession *session) {
-    g_assert(session);
-    g_assert(session->tables);
-
-    RmCfg *cfg = session->cfg;
-
-    RmShredTag tag;
-    tag.active_groups = 0;
-    tag.session = session;
-    tag.mem_refusing = false;
-    session->shredder = &tag;
-
-    tag.page_size = SHRED_PAGE_SIZE;
-
-    tag.after_preprocess = FALSE;
+/* Allocate the shredder and its helper pools; hashing tasks will go to mds */
+static RmShredTag *rm_shred_tag_new(RmSession *session, RmMDS *mds) {
+    RmShredTag *tag = g_slice_new0(RmShredTag);
+    tag->session = session;
+    tag->mds = mds;
+    tag->page_size = SHRED_PAGE_SIZE;
+    tag->balanced_bytes = (session->cfg->shred_balanced_bytes)
+                              ? session->cfg->shred_balanced_bytes
+                              : tag->page_size * SHRED_BALANCED_PAGES;
+    session->shredder = tag;
 
     /* would use g_atomic, but helgrind does not like that */
-    g_mutex_init(&tag.hash_mem_mtx);
+    g_mutex_init(&tag->hash_mem_mtx);
+
+    g_mutex_init(&tag->lock);
 
-    g_mutex_init(&tag.lock);
+    g_mutex_init(&tag->fsmap_lock);
+    tag->fsmaps = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)rm_fsmap_free);
 
-    rm_mds_configure(session->mds,
+    rm_mds_configure(mds,
                      (RmMDSFunc)rm_shred_process_file,
                      session,
                      session->cfg->sweep_count,
@@ -1760,33 +2284,30 @@ void rm_shred_run(RmSession *session) {
                      (RmMDSSortFunc)rm_mds_elevator_cmp);
 
     /* Create a pool for progress counting */
-    tag.counter_pool = rm_util_thread_pool_new((GFunc)rm_shred_counter_factory, &tag, 1);
+    tag->counter_pool = rm_util_thread_pool_new((GFunc)rm_shred_counter_factory, tag, 1);
 
     /* Create a pool for results processing */
-    tag.result_pool = rm_util_thread_pool_new((GFunc)rm_shred_result_factory, &tag, 1);
-
-    rm_shred_preprocess_input(&tag);
-    rm_log_debug_line("Done shred preprocessing");
+    tag->result_pool = rm_util_thread_pool_new((GFunc)rm_shred_result_factory, tag, 1);
 
-    /* wait for counters to catch up */
-    while(g_thread_pool_unprocessed(tag.counter_pool) > 0) {
-        g_usleep(10);
-    }
-    rm_log_debug_line("Byte and file counters up to date");
+    return tag;
+}
 
-    tag.after_preprocess = TRUE;
-    session->shred_bytes_after_preprocess = session->shred_bytes_remaining;
+/* Initialise the hasher and start the scheduler */
+static void rm_shred_start_hashing(RmShredTag *tag) {
+    RmSession *session = tag->session;
+    RmCfg *cfg = session->cfg;
 
     /* estimate mem used for RmFiles and allocate any leftovers to read buffer and/or
-     * paranoid mem */
+     * paranoid mem; with cfg->pipeline only the files pushed so far are known */
     RmOff mem_used = SHRED_AVERAGE_MEM_PER_FILE * session->shred_files_remaining;
     RmOff read_buffer_mem = MAX(1024 * 1024, (gint64)cfg->total_mem - (gint64)mem_used);
 
     if(cfg->checksum_type == RM_DIGEST_PARANOID) {
         /* allocate any spare mem for paranoid hashing */
-        tag.paranoid_mem_alloc = (gint64)cfg->total_mem - (gint64)mem_used;
-        tag.paranoid_mem_alloc = MAX(0, tag.paranoid_mem_alloc);
-        rm_log_debug_line("Paranoid Mem: %" LLU, tag.paranoid_mem_alloc);
+        tag->paranoid_mem_alloc = (gint64)cfg->total_mem - (gint64)mem_used;
+        tag->paranoid_mem_alloc = MAX(0, tag->paranoid_mem_alloc);
+        tag->paranoid_mem_total = tag->paranoid_mem_alloc;
+        rm_log_debug_line("Paranoid Mem: %" LLU, tag->paranoid_mem_alloc);
         /* paranoid memory manager takes care of memory load; */
         read_buffer_mem = 0;
     }
@@ -1794,34 +2315,146 @@ void rm_shred_run(RmSession *session) {
 
     /* Initialise hasher */
 
-    tag.hasher = rm_hasher_new(cfg->checksum_type,
-                               cfg->threads,
-                               cfg->use_buffered_read,
-                               cfg->read_buf_len,
-                               read_buffer_mem,
-                               (RmHasherCallback)rm_shred_hash_callback,
-                               &tag);
+    tag->hasher = rm_hasher_new(cfg->checksum_type,
+                                cfg->threads,
+                                cfg->use_buffered_read,
+                                cfg->read_buf_len,
+                                read_buffer_mem,
+                                (RmHasherCallback)rm_shred_hash_callback,
+                                tag);
+
+    tag->dir_cache = rm_dir_cache_new(&cfg->file_trie, 0);
+
+#if HAVE_POSIX_FADVISE
+    /* read ahead of the next few files on fast devices, within a share of the
+     * memory budget; the scheduler only does this on non-rotational disks.
+     * The kernel's readahead would bypass the per-device throttle, so there
+     * is none when reads are limited */
+    bool reads_limited =
+        cfg->limit_read_rate || cfg->limit_read_ops || cfg->limit_adaptive;
+    gint prefetch_depth = reads_limited ? 0
+                                        : MIN(cfg->total_mem / SHRED_PREFETCH_MEM_DIVISOR /
+                                                  SHRED_PREFETCH_BYTES,
+                                              RM_MDS_PREFETCH_MAX);
+    if(prefetch_depth > 0) {
+        tag->prefetch_pool = rm_util_thread_pool_new(
+            (GFunc)rm_shred_prefetch_factory, tag, SHRED_PREFETCH_THREADS);
+        rm_mds_set_prefetch(tag->mds, (RmMDSPrefetchFunc)rm_shred_prefetch,
+                            prefetch_depth);
+    }
+    rm_log_debug_line("Prefetch depth: %d", tag->prefetch_pool ? prefetch_depth : 0);
+#endif
+
+    rm_mds_start(tag->mds);
+}
+
+void rm_shred_pipeline_start(RmSession *session) {
+    g_assert(session);
+    g_assert(session->tables);
+
+    RmCfg *cfg = session->cfg;
+
+    /* session->mds is busy with traversal, so hashing needs a scheduler of its own */
+    RmMDS *mds = rm_mds_new(cfg->threads, session->mounts, cfg->fake_pathindex_as_disk);
+    rm_mds_set_throttle(mds, cfg->limit_read_rate, cfg->limit_read_ops, cfg->limit_adaptive);
+    RmShredTag *tag = rm_shred_tag_new(session, mds);
+
+    for(int i = 0; i < 2; ++i) {
+        tag->held_groups[i] = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+
+    rm_shred_start_hashing(tag);
+}
+
+void rm_shred_pipeline_push(RmSession *session, GPtrArray *files) {
+    RmShredTag *tag = session->shredder;
+    g_assert(tag);
+    g_assert(tag->held_groups[0]);
+
+    GArray *size_groups = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    g_mutex_lock(&session->tables->lock);
+    {
+        session->total_filtered_files += files->len;
+        rm_preprocess_files(session, files, size_groups);
+        rm_shred_process_groups(tag, files, size_groups);
+    }
+    g_mutex_unlock(&session->tables->lock);
+
+    g_array_free(size_groups, TRUE);
+}
+
+void rm_shred_run(RmSession *session) {
+    g_assert(session);
+    g_assert(session->tables);
+
+    /* with cfg->pipeline the shredder is running already */
+    RmShredTag *tag = session->shredder;
+    bool is_pipelined = (tag != NULL);
+    if(!is_pipelined) {
+        tag = rm_shred_tag_new(session, session->mds);
+    }
+
+    rm_shred_preprocess_input(tag);
+    rm_log_debug_line("Done shred preprocessing");
+
+    /* wait for counters to catch up */
+    while(g_thread_pool_unprocessed(tag->counter_pool) > 0) {
+        g_usleep(10);
+    }
+    rm_log_debug_line("Byte and file counters up to date");
+
+    tag->after_preprocess = TRUE;
+    session->shred_bytes_after_preprocess = session->shred_bytes_remaining;
 
     rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_SHREDDER);
 
     session->shred_bytes_total = session->shred_bytes_remaining;
-    rm_mds_start(session->mds);
+    if(is_pipelined) {
+        rm_shred_release_held_groups(tag);
+    } else {
+        rm_shred_start_hashing(tag);
+    }
 
     /* should complete shred session and then free: */
-    rm_mds_free(session->mds, FALSE);
-    rm_hasher_free(tag.hasher, TRUE);
+    rm_mds_finish(tag->mds);
+    RmMDS *mds = tag->mds;
+    g_mutex_lock(&tag->hash_mem_mtx);
+    {
+        /* no more rm_mds_kick() from rm_shred_mem_return() */
+        tag->mds = NULL;
+    }
+    g_mutex_unlock(&tag->hash_mem_mtx);
+
+    rm_mds_free(mds, FALSE);
+    if(mds != session->mds) {
+        /* the (idle) traversal scheduler */
+        rm_mds_free(session->mds, FALSE);
+    }
+    if(tag->prefetch_pool) {
+        /* drop hints that are still queued; they need the dir_cache */
+        g_thread_pool_free(tag->prefetch_pool, TRUE, TRUE);
+    }
+    rm_hasher_free(tag->hasher, TRUE);
+    rm_dir_cache_free(tag->dir_cache);
+    g_hash_table_destroy(tag->fsmaps);
+    g_mutex_clear(&tag->fsmap_lock);
 
     session->shredder_finished = TRUE;
     rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_SHREDDER);
 
     /* This should not block, or at least only very short. */
-    g_thread_pool_free(tag.result_pool, FALSE, TRUE);
+    g_thread_pool_free(tag->result_pool, FALSE, TRUE);
 
     rm_log_debug(BLUE "Waiting for progress counters to catch up..." RESET);
-    g_thread_pool_free(tag.counter_pool, FALSE, TRUE);
+    g_thread_pool_free(tag->counter_pool, FALSE, TRUE);
     rm_log_debug(BLUE "Done\n" RESET);
 
-    g_mutex_clear(&tag.hash_mem_mtx);
+    g_mutex_clear(&tag->hash_mem_mtx);
+    g_mutex_clear(&tag->lock);
     rm_log_debug_line("Remaining %" LLU " bytes in %" LLU " files",
                       session->shred_bytes_remaining, session->shred_files_remaining);
+
+    session->shredder = NULL;
+    g_slice_free(RmShredTag, tag);
 }
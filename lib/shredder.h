@@ -45,6 +45,23 @@ typedef enum RmShredGroupStatus {
  */
 void rm_shred_run(RmSession *session);
 
+/**
+ * @brief Start the shredder before traversal (cfg->pipeline).
+ *
+ * Files are then fed in one device at a time via rm_shred_pipeline_push()
+ * and hashing starts straight away; duplicate groups are held open until
+ * rm_shred_run() is called after traversal, which completes the run.
+ */
+void rm_shred_pipeline_start(RmSession *session);
+
+/**
+ * @brief Preprocess the files of a completely traversed device and push the
+ * duplicate candidates to the running shredder.
+ *
+ * @param files All files found on the device; the array is emptied.
+ */
+void rm_shred_pipeline_push(RmSession *session, GPtrArray *files);
+
 /**
  * @brief Forward a group of files to the output module.
  *
@@ -0,0 +1,143 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#include "throttle.h"
+#include "utilities.h"
+
+/* smoothing factors for the short and long term latency averages */
+#define RM_THROTTLE_LATENCY_ALPHA_SHORT (0.2)
+#define RM_THROTTLE_LATENCY_ALPHA_LONG (0.01)
+
+/* back off once short term latency exceeds the long term one by this factor */
+#define RM_THROTTLE_CONGESTION_FACTOR (2.0)
+
+/* range of the extra pause inserted per operation when backing off */
+#define RM_THROTTLE_BACKOFF_MIN_US (1000)
+#define RM_THROTTLE_BACKOFF_MAX_US (500 * 1000)
+
+struct _RmThrottle {
+    /* tokens per second; 0 if only adaptive */
+    gdouble rate;
+
+    /* available tokens; negative while in debt */
+    gdouble tokens;
+
+    /* when tokens was last refilled (monotonic time) */
+    gint64 last_refill;
+
+    /* adaptive mode state */
+    bool adaptive;
+    gdouble latency_short;
+    gdouble latency_long;
+    gint64 backoff_us;
+
+    GMutex lock;
+};
+
+RmThrottle *rm_throttle_new(gdouble rate, bool adaptive) {
+    if(rate <= 0 && !adaptive) {
+        return NULL;
+    }
+
+    RmThrottle *self = g_slice_new0(RmThrottle);
+    self->rate = MAX(rate, 0);
+    self->tokens = self->rate;
+    self->last_refill = g_get_monotonic_time();
+    self->adaptive = adaptive;
+    g_mutex_init(&self->lock);
+    return self;
+}
+
+void rm_throttle_free(RmThrottle *self) {
+    if(self == NULL) {
+        return;
+    }
+    g_mutex_clear(&self->lock);
+    g_slice_free(RmThrottle, self);
+}
+
+void rm_throttle_take(RmThrottle *self, gdouble n) {
+    if(self == NULL) {
+        return;
+    }
+
+    gint64 wait_us = 0;
+    g_mutex_lock(&self->lock);
+    {
+        if(self->rate > 0) {
+            gint64 now = g_get_monotonic_time();
+            /* refill, but allow no more than one second worth of burst */
+            self->tokens = MIN(self->rate, self->tokens + (now - self->last_refill) *
+                                                              self->rate / G_USEC_PER_SEC);
+            self->last_refill = now;
+
+            /* reserve our tokens even if that puts us in debt; we then wait until
+             * the debt is paid off, which also makes concurrent callers queue up
+             * behind each other */
+            self->tokens -= n;
+            if(self->tokens < 0) {
+                wait_us = -self->tokens * G_USEC_PER_SEC / self->rate;
+            }
+        }
+        wait_us += self->backoff_us;
+    }
+    g_mutex_unlock(&self->lock);
+
+    if(wait_us > 0) {
+        g_usleep(wait_us);
+    }
+}
+
+void rm_throttle_report_latency(RmThrottle *self, gint64 latency_us) {
+    if(self == NULL || !self->adaptive) {
+        return;
+    }
+
+    g_mutex_lock(&self->lock);
+    {
+        if(self->latency_long == 0) {
+            /* first sample */
+            self->latency_short = self->latency_long = latency_us;
+        }
+
+        self->latency_short +=
+            (latency_us - self->latency_short) * RM_THROTTLE_LATENCY_ALPHA_SHORT;
+        self->latency_long +=
+            (latency_us - self->latency_long) * RM_THROTTLE_LATENCY_ALPHA_LONG;
+
+        if(self->latency_short > self->latency_long * RM_THROTTLE_CONGESTION_FACTOR) {
+            /* someone else is keeping the disk busy; yield more */
+            self->backoff_us = CLAMP(self->backoff_us * 2, RM_THROTTLE_BACKOFF_MIN_US,
+                                     RM_THROTTLE_BACKOFF_MAX_US);
+        } else if(self->backoff_us > 0) {
+            /* recover slowly */
+            self->backoff_us = self->backoff_us * 3 / 4;
+            if(self->backoff_us < RM_THROTTLE_BACKOFF_MIN_US / 4) {
+                self->backoff_us = 0;
+            }
+        }
+    }
+    g_mutex_unlock(&self->lock);
+}
@@ -0,0 +1,80 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+#ifndef RM_THROTTLE_H
+#define RM_THROTTLE_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+/**
+ * @file throttle.h
+ * @brief Token bucket rate limiter for disk reads.
+ *
+ * Used to limit the impact of a scan on busy storage: each device of the
+ * scheduler gets one bucket for bytes/sec and one for operations/sec.
+ * Callers take tokens before doing IO and sleep if the bucket is in debt,
+ * so the long term rate never exceeds the limit (short bursts of up to one
+ * second worth of tokens are allowed).
+ *
+ * In adaptive mode the limiter additionally watches the latency of the reads
+ * it paced (rm_throttle_report_latency()). If it rises well above its long
+ * term average (ie someone else is using the disk) it inserts extra pauses,
+ * which shrink again once latency recovers.
+ *
+ * All functions are thread safe and accept NULL (no limit).
+ **/
+
+typedef struct _RmThrottle RmThrottle;
+
+/**
+ * @brief Allocate a new rate limiter.
+ *
+ * @param rate Tokens per second; 0 means unlimited.
+ * @param adaptive Back off when reported latency rises.
+ * @retval the limiter, or NULL if neither a rate nor adaptive was given.
+ **/
+RmThrottle *rm_throttle_new(gdouble rate, bool adaptive);
+
+/**
+ * @brief Free a limiter; NULL is allowed.
+ **/
+void rm_throttle_free(RmThrottle *self);
+
+/**
+ * @brief Take n tokens, sleeping as long as needed to stay within the rate.
+ **/
+void rm_throttle_take(RmThrottle *self, gdouble n);
+
+/**
+ * @brief Report how long (in microseconds) an operation paced by self took.
+ *
+ * Only has an effect in adaptive mode.
+ **/
+void rm_throttle_report_latency(RmThrottle *self, gint64 latency_us);
+
+#endif /* end of include guard */
@@ -36,6 +36,7 @@
 #include "formats.h"
 #include "md-scheduler.h"
 #include "preprocess.h"
+#include "shredder.h"
 #include "utilities.h"
 #include "xattr.h"
 
@@ -48,12 +49,21 @@
 typedef struct RmTravSession {
     RmUserList *userlist;
     RmSession *session;
+
+    /* cfg->pipeline: files found so far per RmMDSDevice; handed to the
+     * shredder once the device has been traversed completely */
+    GHashTable *disk_files;
+    GMutex lock;
 } RmTravSession;
 
 static RmTravSession *rm_traverse_session_new(RmSession *session) {
     RmTravSession *self = g_new0(RmTravSession, 1);
     self->session = session;
     self->userlist = rm_userlist_new();
+    if(session->cfg->pipeline) {
+        self->disk_files = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_mutex_init(&self->lock);
+    }
     return self;
 }
 
@@ -65,6 +75,12 @@ static void rm_traverse_session_free(RmTravSession *trav_session) {
 
     rm_userlist_destroy(trav_session->userlist);
 
+    if(trav_session->disk_files) {
+        g_assert(g_hash_table_size(trav_session->disk_files) == 0);
+        g_hash_table_destroy(trav_session->disk_files);
+        g_mutex_clear(&trav_session->lock);
+    }
+
     g_free(trav_session);
 }
 
@@ -103,6 +119,16 @@ static void rm_trav_buffer_free(RmTravBuffer *self) {
 // ACTUAL WORK HERE //
 //////////////////////
 
+/* Number of files each traversal worker collects locally before handing
+ * them over to session->tables (which needs a lock); with cfg->pipeline
+ * the batch is kept until the worker is done */
+#define RM_TRAVERSE_BATCH_SIZE (4096)
+
+/* Traversal workers on a rotational disk (unless --threads-per-disk is given);
+ * unlike the shredder's sequential reads, a second directory walker keeps the
+ * disk busy while the first one is processing what it read */
+#define RM_TRAVERSE_ROTATIONAL_THREADS (2)
+
 // Symbolic links may contain relative paths, that are relative to the symbolic
 // link location.  When using readlink(), those relative paths are returned but
 // may not make sense depending from where rmlint was run. This function takes
@@ -129,10 +155,13 @@ static char *rm_traverse_rel_realpath(char *link_path, char *pointing_to) {
     return clean_path;
 }
 
-static void rm_traverse_file(RmTravSession *trav_session, RmStat *statp, char *path,
-                             bool is_prefd, unsigned long path_index,
-                             RmLintType file_type, bool is_symlink, bool is_hidden,
-                             bool is_on_subvol_fs, short depth) {
+/* If batch is not NULL, the file is collected there instead of being inserted
+ * into session->tables straight away; the caller has to flush it. */
+static void rm_traverse_file(RmTravSession *trav_session, GPtrArray *batch,
+                             RmStat *statp, char *path, bool is_prefd,
+                             unsigned long path_index, RmLintType file_type,
+                             bool is_symlink, bool is_hidden, bool is_on_subvol_fs,
+                             short depth) {
     RmSession *session = trav_session->session;
     RmCfg *cfg = session->cfg;
 
@@ -204,7 +233,14 @@ static void rm_traverse_file(RmTravSession *trav_session, RmStat *statp, char *p
         file->is_on_subvol_fs = is_on_subvol_fs;
         file->link_count = statp->st_nlink;
 
-        rm_file_list_insert_file(file, session);
+        if(batch) {
+            g_ptr_array_add(batch, file);
+            if(batch->len >= RM_TRAVERSE_BATCH_SIZE && !cfg->pipeline) {
+                rm_file_list_insert_batch(batch, session);
+            }
+        } else {
+            rm_file_list_insert_file(file, session);
+        }
 
         g_atomic_int_add(&trav_session->session->total_files, 1);
         rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_TRAVERSE);
@@ -234,8 +270,8 @@ static bool rm_traverse_is_hidden(RmCfg *cfg, const char *basename, char *hierar
 /* Macro for rm_traverse_directory() for easy file adding */
 #define _ADD_FILE(lint_type, is_symlink, stat_buf)                                      \
     rm_traverse_file(                                                                   \
-        trav_session, (RmStat *)stat_buf, p->fts_path, is_prefd, path_index, lint_type, \
-        is_symlink,                                                                     \
+        trav_session, batch, (RmStat *)stat_buf, p->fts_path, is_prefd, path_index,     \
+        lint_type, is_symlink,                                                          \
         rm_traverse_is_hidden(cfg, p->fts_name, is_hidden, p->fts_level + 1),           \
         rmpath->treat_as_single_vol, p->fts_level);
 
@@ -283,6 +319,38 @@ G_STATIC_ASSERT(G_SIZEOF_MEMBER(RmStat, st_ino) == G_SIZEOF_MEMBER(__fts_stat_t,
 
 #endif
 
+/* cfg->pipeline: add the files of a finished worker to its device's list and
+ * drop the worker's device reference; if it was the last one, the device is
+ * traversed completely and its files go to the shredder. */
+static void rm_traverse_device_done(RmTravSession *trav_session, RmMDSDevice *disk,
+                                    GPtrArray *batch) {
+    GPtrArray *files = NULL;
+    g_mutex_lock(&trav_session->lock);
+    {
+        GPtrArray *disk_files = g_hash_table_lookup(trav_session->disk_files, disk);
+        if(!disk_files) {
+            disk_files = g_ptr_array_new();
+            g_hash_table_insert(trav_session->disk_files, disk, disk_files);
+        }
+        g_ptr_array_extend(disk_files, batch, NULL, NULL);
+        g_ptr_array_set_size(batch, 0);
+
+        if(rm_mds_device_ref(disk, -1) == 0) {
+            files = disk_files;
+            g_hash_table_remove(trav_session->disk_files, disk);
+        }
+    }
+    g_mutex_unlock(&trav_session->lock);
+
+    if(files) {
+        rm_log_debug_line("Device traversal finished at %.3f; pushing %u files",
+                          g_timer_elapsed(trav_session->session->timer, NULL),
+                          files->len);
+        rm_shred_pipeline_push(trav_session->session, files);
+        g_ptr_array_free(files, TRUE);
+    }
+}
+
 static void rm_traverse_directory(RmTravBuffer *buffer, RmTravSession *trav_session) {
     RmSession *session = trav_session->session;
     RmCfg *cfg = session->cfg;
@@ -291,6 +359,9 @@ static void rm_traverse_directory(RmTravBuffer *buffer, RmTravSession *trav_sess
     char is_prefd = rmpath->is_prefd;
     RmOff path_index = rmpath->idx;
 
+    /* files found by this worker; avoids taking the tables lock for each file */
+    GPtrArray *batch = g_ptr_array_sized_new(RM_TRAVERSE_BATCH_SIZE);
+
     /* Initialize ftsp */
     int fts_flags = FTS_PHYSICAL | FTS_COMFOLLOW | FTS_NOCHDIR;
 
@@ -353,6 +424,11 @@ static void rm_traverse_directory(RmTravBuffer *buffer, RmTravSession *trav_sess
                         "Not descending into %s because it is a different filesystem\n",
                         p->fts_path);
                 } else {
+                    /* remember dev/inode so rm_preprocess() can detect path doubles
+                     * without having to stat the parent dirs again */
+                    rm_trie_insert_dir(&cfg->file_trie, p->fts_path, p->fts_statp->st_dev,
+                                       p->fts_statp->st_ino);
+
                     /* recurse dir; assume empty until proven otherwise */
                     is_emptydir[p->fts_level + 1] = 1;
                     is_hidden[p->fts_level + 1] =
@@ -403,8 +479,8 @@ static void rm_traverse_directory(RmTravBuffer *buffer, RmTravSession *trav_sess
                     /* normal stat failed but 64-bit stat worked
                      * -> must be a big file on 32 bit.
                      */
-                    rm_traverse_file(trav_session, &stat_buf, p->fts_path, is_prefd,
-                                     path_index, RM_LINT_TYPE_UNKNOWN, false,
+                    rm_traverse_file(trav_session, batch, &stat_buf, p->fts_path,
+                                     is_prefd, path_index, RM_LINT_TYPE_UNKNOWN, false,
                                      rm_traverse_is_hidden(cfg, p->fts_name, is_hidden,
                                                            p->fts_level + 1),
                                      rmpath->treat_as_single_vol, p->fts_level);
@@ -478,10 +554,46 @@ static void rm_traverse_directory(RmTravBuffer *buffer, RmTravSession *trav_sess
     rm_fmt_set_state(session->formats, RM_PROGRESS_STATE_TRAVERSE);
 
 done:
-    rm_mds_device_ref(buffer->disk, -1);
+    if(cfg->pipeline) {
+        rm_traverse_device_done(trav_session, buffer->disk, batch);
+    } else {
+        rm_file_list_insert_batch(batch, session);
+        rm_mds_device_ref(buffer->disk, -1);
+    }
+    g_ptr_array_free(batch, TRUE);
+
     rm_trav_buffer_free(buffer);
 }
 
+/* cfg->pipeline: files given on the command line may be path doubles or
+ * hardlinks of files found in one of the directories, so they have to be
+ * preprocessed together with that directory's device.  Must be called before
+ * the traversal starts, so that no device is finished yet. */
+static void rm_traverse_add_cmdline_files(RmTravSession *trav_session,
+                                          GHashTable *dev_to_disk, GPtrArray *files) {
+    for(guint i = 0; i < files->len; ++i) {
+        RmFile *file = g_ptr_array_index(files, i);
+        RmMDSDevice *disk = g_hash_table_lookup(dev_to_disk, GSIZE_TO_POINTER(file->dev));
+        if(disk == NULL) {
+            /* no directory traversed on this device; nothing to share inodes with */
+            rm_file_list_insert_file(file, trav_session->session);
+            continue;
+        }
+
+        g_mutex_lock(&trav_session->lock);
+        {
+            GPtrArray *disk_files = g_hash_table_lookup(trav_session->disk_files, disk);
+            if(!disk_files) {
+                disk_files = g_ptr_array_new();
+                g_hash_table_insert(trav_session->disk_files, disk, disk_files);
+            }
+            g_ptr_array_add(disk_files, file);
+        }
+        g_mutex_unlock(&trav_session->lock);
+    }
+    g_ptr_array_set_size(files, 0);
+}
+
 ////////////////
 // PUBLIC API //
 ////////////////
@@ -497,6 +609,16 @@ void rm_traverse_tree(RmSession *session) {
                      0,
                      cfg->threads_per_disk,
                      NULL);
+    rm_mds_set_rotational_threads(mds, RM_TRAVERSE_ROTATIONAL_THREADS);
+
+    /* cfg->pipeline: regular files given on the command line, and the device
+     * of each traversed directory by st_dev */
+    GPtrArray *cmdline_files = NULL;
+    GHashTable *dev_to_disk = NULL;
+    if(cfg->pipeline) {
+        cmdline_files = g_ptr_array_new();
+        dev_to_disk = g_hash_table_new(NULL, NULL);
+    }
 
     /* iterate through paths */
     for(GSList *iter = cfg->paths; iter && !rm_session_was_aborted(); iter = iter->next) {
@@ -515,11 +637,11 @@ void rm_traverse_tree(RmSession *session) {
             /* A symlink where we could not get the actual path from
              * (and it was given directly, e.g. by a find call)
              */
-            rm_traverse_file(trav_session, &buffer->stat_buf, rmpath->path,
+            rm_traverse_file(trav_session, NULL, &buffer->stat_buf, rmpath->path,
                              rmpath->is_prefd, rmpath->idx, RM_LINT_TYPE_BADLINK, false,
                              is_hidden, FALSE, 0);
         } else if(S_ISREG(buffer->stat_buf.st_mode)) {
-            rm_traverse_file(trav_session, &buffer->stat_buf, rmpath->path,
+            rm_traverse_file(trav_session, cmdline_files, &buffer->stat_buf, rmpath->path,
                              rmpath->is_prefd, rmpath->idx, RM_LINT_TYPE_UNKNOWN, false,
                              is_hidden, FALSE, 0);
 
@@ -531,6 +653,11 @@ void rm_traverse_tree(RmSession *session) {
                                                          ? rmpath->idx + 1
                                                          : buffer->stat_buf.st_dev);
             rm_mds_device_ref(buffer->disk, 1);
+            if(dev_to_disk) {
+                g_hash_table_insert(dev_to_disk,
+                                    GSIZE_TO_POINTER(buffer->stat_buf.st_dev),
+                                    buffer->disk);
+            }
             rm_mds_push_task(buffer->disk, buffer->stat_buf.st_dev, 0, rmpath->path,
                              buffer);
 
@@ -540,6 +667,12 @@ void rm_traverse_tree(RmSession *session) {
         }
     }
 
+    if(cmdline_files) {
+        rm_traverse_add_cmdline_files(trav_session, dev_to_disk, cmdline_files);
+        g_ptr_array_free(cmdline_files, TRUE);
+        g_hash_table_destroy(dev_to_disk);
+    }
+
     rm_mds_start(mds);
     rm_mds_finish(mds);
 
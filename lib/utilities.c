@@ -62,6 +62,12 @@
 #include <linux/fs.h>
 #endif
 
+#if HAVE_FSMAP
+#include <linux/fsmap.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif
+
 /* Internal headers */
 #include "config.h"
 #include "file.h"
@@ -462,6 +468,8 @@ void rm_userlist_destroy(RmUserList *self) {
 typedef struct RmDiskInfo {
     char *name;
     bool is_rotational;
+    /* ideal number of concurrent readers */
+    gint queue_depth;
 } RmDiskInfo;
 
 typedef struct RmPartitionInfo {
@@ -486,10 +494,11 @@ void rm_part_info_free(RmPartitionInfo *self) {
     g_free(self);
 }
 
-RmDiskInfo *rm_disk_info_new(char *name, char is_rotational) {
+RmDiskInfo *rm_disk_info_new(char *name, char is_rotational, gint queue_depth) {
     RmDiskInfo *self = g_new0(RmDiskInfo, 1);
     self->name = g_strdup(name);
     self->is_rotational = is_rotational;
+    self->queue_depth = queue_depth;
     return self;
 }
 
@@ -498,28 +507,51 @@ void rm_disk_info_free(RmDiskInfo *self) {
     g_free(self);
 }
 
-static gchar rm_mounts_is_rotational_blockdev(const char *dev) {
-    gchar is_rotational = -1;
+/* read an integer from /sys/block/<dev>/queue/<attr>; -1 if unavailable */
+static gint rm_mounts_read_sysblock_queue(const char *dev, const char *attr) {
+    gint result = -1;
 
 #if HAVE_SYSBLOCK /* this works only on linux */
     char sys_path[PATH_MAX + 30];
-    snprintf(sys_path, sizeof(sys_path) - 1, "/sys/block/%s/queue/rotational", dev);
+    snprintf(sys_path, sizeof(sys_path) - 1, "/sys/block/%s/queue/%s", dev, attr);
 
     FILE *sys_fdes = fopen(sys_path, "r");
     if(sys_fdes == NULL) {
         return -1;
     }
 
-    if(fread(&is_rotational, 1, 1, sys_fdes) == 1) {
-        is_rotational -= '0';
+    if(fscanf(sys_fdes, "%d", &result) != 1) {
+        result = -1;
     }
 
     fclose(sys_fdes);
 #else
     (void)dev;
+    (void)attr;
 #endif
 
-    return is_rotational;
+    return result;
+}
+
+static gchar rm_mounts_is_rotational_blockdev(const char *dev) {
+    return rm_mounts_read_sysblock_queue(dev, "rotational");
+}
+
+/* Pick the number of concurrent readers that keeps the disk busy: one sweeping
+ * stream for rotational disks, a few for SATA/SCSI SSDs and many more for NVMe
+ * (never more than the block layer will queue though) */
+static gint rm_mounts_queue_depth_blockdev(const char *dev, bool is_rotational) {
+    if(is_rotational) {
+        return RM_QUEUE_DEPTH_ROTATIONAL;
+    }
+
+    gint depth = g_str_has_prefix(dev, "nvme") ? RM_QUEUE_DEPTH_NVME : RM_QUEUE_DEPTH_SSD;
+
+    gint nr_requests = rm_mounts_read_sysblock_queue(dev, "nr_requests");
+    if(nr_requests > 0) {
+        depth = MIN(depth, nr_requests);
+    }
+    return depth;
 }
 
 static bool rm_mounts_is_ramdisk(const char *fs_type) {
@@ -777,6 +809,8 @@ static bool rm_mounts_create_tables(RmMountTable *self, bool force_fiemap) {
 
         is_rotational |= force_fiemap;
 
+        gint queue_depth = rm_mounts_queue_depth_blockdev(diskname, is_rotational);
+
         RmPartitionInfo *existing = g_hash_table_lookup(
             self->part_table, GUINT_TO_POINTER(stat_buf_folder.st_dev));
         if(!existing || (existing->disk == 0 && whole_disk != 0)) {
@@ -804,14 +838,15 @@ static bool rm_mounts_create_tables(RmMountTable *self, bool force_fiemap) {
         if(!g_hash_table_contains(self->disk_table, GINT_TO_POINTER(whole_disk))) {
             g_hash_table_insert(self->disk_table,
                                 GINT_TO_POINTER(whole_disk),
-                                rm_disk_info_new(diskname, is_rotational));
+                                rm_disk_info_new(diskname, is_rotational, queue_depth));
         }
 
         rm_log_debug_line(
-            "%02u:%02u %50s -> %02u:%02u %-12s (underlying disk: %s; rotational: %3s)",
+            "%02u:%02u %50s -> %02u:%02u %-12s (underlying disk: %s; rotational: %3s; "
+            "queue depth: %d)",
             major(stat_buf_folder.st_dev), minor(stat_buf_folder.st_dev), entry->dir,
             major(whole_disk), minor(whole_disk), entry->fsname, diskname,
-            is_rotational ? "yes" : "no");
+            is_rotational ? "yes" : "no", queue_depth);
     }
 
     rm_mount_list_close(mnt_entries);
@@ -875,6 +910,45 @@ bool rm_mounts_is_nonrotational(RmMountTable *self, dev_t device) {
     }
 }
 
+gint rm_mounts_get_queue_depth(RmMountTable *self, dev_t device) {
+    if(self == NULL) {
+        return RM_QUEUE_DEPTH_SSD;
+    }
+
+    RmPartitionInfo *part =
+        g_hash_table_lookup(self->part_table, GINT_TO_POINTER(device));
+    RmDiskInfo *disk =
+        (part) ? g_hash_table_lookup(self->disk_table, GINT_TO_POINTER(part->disk)) : NULL;
+    if(disk == NULL) {
+        /* same fallback as rm_mounts_is_nonrotational() */
+        return RM_QUEUE_DEPTH_SSD;
+    }
+    return disk->queue_depth;
+}
+
+static RmDiskInfo *rm_mounts_get_disk_info(RmMountTable *self, dev_t device) {
+    if(self == NULL) {
+        return NULL;
+    }
+
+    RmPartitionInfo *part =
+        g_hash_table_lookup(self->part_table, GINT_TO_POINTER(device));
+    return (part) ? g_hash_table_lookup(self->disk_table, GINT_TO_POINTER(part->disk))
+                  : NULL;
+}
+
+void rm_mounts_set_queue_depth(RmMountTable *self, dev_t device, gint queue_depth) {
+    RmDiskInfo *disk = rm_mounts_get_disk_info(self, device);
+    if(disk != NULL && queue_depth > 0) {
+        disk->queue_depth = queue_depth;
+    }
+}
+
+const char *rm_mounts_get_disk_name(RmMountTable *self, dev_t device) {
+    RmDiskInfo *disk = rm_mounts_get_disk_info(self, device);
+    return (disk) ? disk->name : NULL;
+}
+
 dev_t rm_mounts_get_disk_id(RmMountTable *self, _UNUSED dev_t dev,
                             _UNUSED const char *path) {
     if(self == NULL) {
@@ -981,14 +1055,35 @@ bool rm_mounts_can_reflink(RmMountTable *self, dev_t source, dev_t dest) {
 //    FIEMAP IMPLEMENTATION     //
 /////////////////////////////////
 
+/* one run of physically contiguous extents */
+typedef struct RmExtentRun {
+    RmOff logical;
+    RmOff physical;
+    RmOff length;
+} RmExtentRun;
+
+struct RmExtentMap {
+    /* true if the whole file was mapped and all extents have a well-defined
+     * physical location of their own (see rm_extent_map_equal) */
+    bool comparable;
+    /* true if the whole file was mapped (its last extent was seen) */
+    bool complete;
+    guint n_runs;
+    RmExtentRun runs[];
+};
+
 #if HAVE_FIEMAP
 
+/* Number of extents fetched per FS_IOC_FIEMAP call */
+#define RM_OFFSET_EXTENT_BATCH (64)
+
 /* Return fiemap structure containing n_extents for file descriptor fd.
  * Return NULL if errors encountered.
  * Needs to be freed with g_free if not NULL.
  * */
 static struct fiemap *rm_offset_get_fiemap(int fd, const int n_extents,
-                                           const uint64_t file_offset) {
+                                           const uint64_t file_offset,
+                                           const uint32_t flags) {
 #if _RM_OFFSET_DEBUG
     rm_log_debug_line(_("rm_offset_get_fiemap: fd=%d, n_extents=%d, file_offset=%d"),
                       fd, n_extents, file_offset);
@@ -999,7 +1094,7 @@ static struct fiemap *rm_offset_get_fiemap(int fd, const int n_extents,
     struct fiemap *fm =
         g_malloc0(sizeof(struct fiemap) + n_extents * sizeof(struct fiemap_extent));
 
-    fm->fm_flags = 0;
+    fm->fm_flags = flags;
     fm->fm_extent_count = n_extents;
     fm->fm_length = FIEMAP_MAX_OFFSET;
     fm->fm_start = file_offset;
@@ -1011,6 +1106,21 @@ static struct fiemap *rm_offset_get_fiemap(int fd, const int n_extents,
     return fm;
 }
 
+/* Check if a fiemap has extents which are not allocated on disk yet (ie the file
+ * has dirty pages); those need FIEMAP_FLAG_SYNC to get meaningful offsets.
+ * This avoids an fsync(2) for the vast majority of files which rmlint only
+ * ever reads.
+ * */
+static bool rm_offset_fiemap_is_dirty(const struct fiemap *fm) {
+    for(guint i = 0; i < fm->fm_mapped_extents; ++i) {
+        if(fm->fm_extents[i].fe_flags &
+           (FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Return physical (disk) offset of the beginning of the file extent found after the
  * specified logical file_offset.
  * If a pointer to file_offset_next is provided then read fiemap extents until the next
@@ -1020,17 +1130,18 @@ static struct fiemap *rm_offset_get_fiemap(int fd, const int n_extents,
  * */
 RmOff rm_offset_get_from_fd(int fd, RmOff file_offset, RmOff *file_offset_next, RmOff *logical_offset, bool *is_last) {
     RmOff result = 0;
+    RmOff start_offset = file_offset;
+    uint32_t flags = 0;
     bool done = FALSE;
     bool first = TRUE;
     struct fiemap_extent fm_last;
 
     memset(&fm_last, 0, sizeof(fm_last));
 
-    fsync(fd);
-
     while(!done) {
-        /* read in next extent */
-        struct fiemap *fm = rm_offset_get_fiemap(fd, 1, file_offset);
+        /* read in next batch of extents */
+        struct fiemap *fm =
+            rm_offset_get_fiemap(fd, RM_OFFSET_EXTENT_BATCH, file_offset, flags);
 
         if(fm==NULL) {
             /* got no extent data */
@@ -1045,10 +1156,18 @@ RmOff rm_offset_get_from_fd(int fd, RmOff file_offset, RmOff *file_offset_next,
                 rm_log_warning_line(_("rm_offset_get_fiemap: got no extents for %d at offset %" G_GUINT64_FORMAT), fd, file_offset);
             }
             done = TRUE;
-        } else {
+        } else if(flags == 0 && rm_offset_fiemap_is_dirty(fm)) {
+            /* unwritten data; have the kernel flush the file and start over */
+            flags = FIEMAP_FLAG_SYNC;
+            file_offset = start_offset;
+            first = TRUE;
+            g_free(fm);
+            continue;
+        }
 
+        for(guint i = 0; !done && i < fm->fm_mapped_extents; ++i) {
             /* retrieve data from fiemap */
-            struct fiemap_extent fm_ext = fm->fm_extents[0];
+            struct fiemap_extent fm_ext = fm->fm_extents[i];
 
             if (first) {
                 /* remember disk location of start of data */
@@ -1063,7 +1182,7 @@ RmOff rm_offset_get_from_fd(int fd, RmOff file_offset, RmOff *file_offset_next,
                 unsigned long expected = fm_last.fe_physical + fm_ext.fe_logical - fm_last.fe_logical;
                 if(fm_ext.fe_physical != expected || fm_ext.fe_physical != expected_dense) {
                     /* current extent is not contiguous with previous, so we can stop */
-                    g_free(fm);
+                    done = TRUE;
                     break;
                 }
             }
@@ -1097,6 +1216,76 @@ RmOff rm_offset_get_from_fd(int fd, RmOff file_offset, RmOff *file_offset_next,
     return result;
 }
 
+/* Extents whose fe_physical does not identify their data on its own: not yet
+ * allocated, inline in metadata, or compressed/encrypted (where several files
+ * may reference different parts of one physical extent) */
+#define RM_EXTENT_INCOMPARABLE_FLAGS                                           \
+    (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |   \
+     FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |                 \
+     FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN)
+
+RmExtentMap *rm_extent_map_new(int fd) {
+    GArray *runs = g_array_new(FALSE, FALSE, sizeof(RmExtentRun));
+    RmOff file_offset = 0;
+    uint32_t flags = 0;
+    bool done = FALSE;
+    bool comparable = TRUE;
+    bool seen_last = FALSE;
+
+    while(!done) {
+        struct fiemap *fm =
+            rm_offset_get_fiemap(fd, RM_OFFSET_EXTENT_BATCH, file_offset, flags);
+        if(fm == NULL || fm->fm_mapped_extents == 0) {
+            g_free(fm);
+            break;
+        }
+
+        if(flags == 0 && rm_offset_fiemap_is_dirty(fm)) {
+            /* see rm_offset_get_from_fd() */
+            flags = FIEMAP_FLAG_SYNC;
+            file_offset = 0;
+            g_array_set_size(runs, 0);
+            comparable = TRUE;
+            g_free(fm);
+            continue;
+        }
+
+        for(guint i = 0; !done && i < fm->fm_mapped_extents; ++i) {
+            struct fiemap_extent *ext = &fm->fm_extents[i];
+            comparable &= !(ext->fe_flags & RM_EXTENT_INCOMPARABLE_FLAGS);
+            RmExtentRun *last =
+                (runs->len > 0) ? &g_array_index(runs, RmExtentRun, runs->len - 1) : NULL;
+
+            if(last && ext->fe_logical == last->logical + last->length &&
+               ext->fe_physical == last->physical + last->length) {
+                /* contiguous with previous extent; extend run */
+                last->length += ext->fe_length;
+            } else {
+                RmExtentRun run = {ext->fe_logical, ext->fe_physical, ext->fe_length};
+                g_array_append_val(runs, run);
+            }
+
+            if((ext->fe_flags & FIEMAP_EXTENT_LAST) || ext->fe_length == 0) {
+                seen_last = (ext->fe_flags & FIEMAP_EXTENT_LAST);
+                done = TRUE;
+            }
+            file_offset = ext->fe_logical + ext->fe_length;
+        }
+        g_free(fm);
+    }
+
+    RmExtentMap *map = NULL;
+    if(runs->len > 0) {
+        map = g_malloc(sizeof(RmExtentMap) + runs->len * sizeof(RmExtentRun));
+        map->comparable = comparable && seen_last;
+        map->complete = seen_last;
+        map->n_runs = runs->len;
+        memcpy(map->runs, runs->data, runs->len * sizeof(RmExtentRun));
+    }
+    g_array_free(runs, TRUE);
+    return map;
+}
+
 RmOff rm_offset_get_from_path(const char *path, RmOff file_offset,
                               RmOff *file_offset_next) {
     int fd = rm_sys_open(path, O_RDONLY);
@@ -1109,6 +1298,17 @@ RmOff rm_offset_get_from_path(const char *path, RmOff file_offset,
     return result;
 }
 
+RmExtentMap *rm_extent_map_new_from_path(const char *path) {
+    int fd = rm_sys_open(path, O_RDONLY);
+    if(fd == -1) {
+        rm_log_info("Error opening %s in rm_extent_map_new_from_path\n", path);
+        return NULL;
+    }
+    RmExtentMap *map = rm_extent_map_new(fd);
+    rm_sys_close(fd);
+    return map;
+}
+
 #else /* Probably FreeBSD */
 
 RmOff rm_offset_get_from_fd(_UNUSED int fd, _UNUSED RmOff file_offset, _UNUSED RmOff *file_offset_next,
@@ -1121,8 +1321,309 @@ RmOff rm_offset_get_from_path(_UNUSED const char *path, _UNUSED RmOff file_offse
     return 0;
 }
 
+RmExtentMap *rm_extent_map_new(_UNUSED int fd) {
+    return NULL;
+}
+
+RmExtentMap *rm_extent_map_new_from_path(_UNUSED const char *path) {
+    return NULL;
+}
+
 #endif
 
+/* index of the first run that ends beyond file_offset (n_runs if none) */
+static guint rm_extent_map_find(const RmExtentMap *map, RmOff file_offset) {
+    guint lo = 0, hi = map->n_runs;
+    while(lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        const RmExtentRun *run = &map->runs[mid];
+        if(run->logical + run->length <= file_offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+RmOff rm_extent_map_lookup(const RmExtentMap *map, RmOff file_offset) {
+    if(map == NULL) {
+        return 0;
+    }
+
+    guint lo = rm_extent_map_find(map, file_offset);
+    if(lo == map->n_runs) {
+        /* beyond the last extent */
+        const RmExtentRun *run = &map->runs[map->n_runs - 1];
+        return run->physical + run->length;
+    }
+
+    const RmExtentRun *run = &map->runs[lo];
+    if(file_offset < run->logical) {
+        /* in a hole; the next data to be read is at the start of this run */
+        return run->physical;
+    }
+    return run->physical + (file_offset - run->logical);
+}
+
+bool rm_extent_map_equal(const RmExtentMap *a, const RmExtentMap *b) {
+    if(a == NULL || b == NULL || !a->comparable || !b->comparable ||
+       a->n_runs != b->n_runs) {
+        return false;
+    }
+    return memcmp(a->runs, b->runs, a->n_runs * sizeof(RmExtentRun)) == 0;
+}
+
+bool rm_extent_map_comparable(const RmExtentMap *map) {
+    return map && map->comparable;
+}
+
+RmOff rm_extent_map_shared(const RmExtentMap *a, const RmExtentMap *b, RmOff offset,
+                           RmOff len) {
+    if(a == NULL || b == NULL || !a->comparable || !b->comparable) {
+        return 0;
+    }
+
+    RmOff pos = offset, end = offset + len;
+    guint i = rm_extent_map_find(a, pos), j = rm_extent_map_find(b, pos);
+
+    while(pos < end) {
+        const RmExtentRun *run_a = (i < a->n_runs) ? &a->runs[i] : NULL;
+        const RmExtentRun *run_b = (j < b->n_runs) ? &b->runs[j] : NULL;
+        bool data_a = run_a && run_a->logical <= pos;
+        bool data_b = run_b && run_b->logical <= pos;
+
+        RmOff next = end;
+        if(data_a != data_b) {
+            /* data in one, hole in the other */
+            break;
+        } else if(data_a) {
+            if(run_a->physical + (pos - run_a->logical) !=
+               run_b->physical + (pos - run_b->logical)) {
+                break;
+            }
+            next = MIN(run_a->logical + run_a->length, run_b->logical + run_b->length);
+        } else {
+            /* hole in both; up to where either has data again */
+            next = MIN(run_a ? run_a->logical : end, run_b ? run_b->logical : end);
+        }
+
+        if(next <= pos) {
+            break;
+        }
+        pos = MIN(next, end);
+
+        if(run_a && pos >= run_a->logical + run_a->length) {
+            i++;
+        }
+        if(run_b && pos >= run_b->logical + run_b->length) {
+            j++;
+        }
+    }
+    return pos - offset;
+}
+
+RmLinkType rm_extent_map_link_type(const RmExtentMap *a, const RmExtentMap *b) {
+#if HAVE_FIEMAP
+    if(a == NULL && b == NULL) {
+        /* no extents to compare (maybe inline extents?) */
+        return RM_LINK_MAYBE_REFLINK;
+    }
+    if(a == NULL || b == NULL || a->n_runs != b->n_runs ||
+       memcmp(a->runs, b->runs, a->n_runs * sizeof(RmExtentRun)) != 0) {
+        return RM_LINK_NONE;
+    }
+    /* same verdict as rm_util_link_type(), which only gives up on extents
+     * without a physical location (inline) or files it could not map fully;
+     * the other flags of rm_extent_map_equal() don't matter here */
+    if(!a->complete || !b->complete) {
+        return RM_LINK_MAYBE_REFLINK;
+    }
+    for(guint i = 0; i < a->n_runs; ++i) {
+        if(a->runs[i].physical == 0) {
+            return RM_LINK_MAYBE_REFLINK;
+        }
+    }
+    return RM_LINK_REFLINK;
+#else
+    (void)a;
+    (void)b;
+    return RM_LINK_NONE;
+#endif
+}
+
+guint rm_extent_map_hash(const RmExtentMap *map) {
+    if(map == NULL || !map->comparable) {
+        return 0;
+    }
+
+    /* the first run almost always tells maps apart already */
+    guint64 hash = map->runs[0].physical ^ (map->runs[0].length << 32) ^ map->n_runs;
+    return (guint)(hash ^ (hash >> 32)) | 1;
+}
+
+void rm_extent_map_free(RmExtentMap *map) {
+    g_free(map);
+}
+
+/////////////////////////////////
+//     FSMAP IMPLEMENTATION     //
+/////////////////////////////////
+
+/* physical location of the first data extent of an inode */
+typedef struct RmFsMapEntry {
+    RmOff inode;
+    RmOff logical;
+    RmOff physical;
+} RmFsMapEntry;
+
+struct RmFsMap {
+    /* sorted by inode, one entry per inode */
+    GArray *entries;
+};
+
+static gint rm_fsmap_entry_inode_cmp(const RmFsMapEntry *a, const RmFsMapEntry *b) {
+    return SIGN_DIFF(a->inode, b->inode);
+}
+
+#if HAVE_FSMAP
+
+#ifndef XFS_SUPER_MAGIC
+#define XFS_SUPER_MAGIC (0x58465342)
+#endif
+
+/* Number of records fetched per FS_IOC_GETFSMAP call */
+#define RM_FSMAP_BATCH (1024)
+
+/* Compact the entries array every so often while building it so that memory
+ * stays bounded by (number of inodes) rather than (number of extents) */
+#define RM_FSMAP_COMPACT_EVERY (1024 * 1024)
+
+static gint rm_fsmap_entry_cmp(const RmFsMapEntry *a, const RmFsMapEntry *b) {
+    RETURN_IF_NONZERO(rm_fsmap_entry_inode_cmp(a, b));
+    return SIGN_DIFF(a->logical, b->logical);
+}
+
+/* sort entries and keep only the lowest logical offset of each inode */
+static void rm_fsmap_compact(GArray *entries) {
+    g_array_sort(entries, (GCompareFunc)rm_fsmap_entry_cmp);
+
+    guint kept = 0;
+    for(guint i = 0; i < entries->len; ++i) {
+        RmFsMapEntry *entry = &g_array_index(entries, RmFsMapEntry, i);
+        if(kept > 0 &&
+           g_array_index(entries, RmFsMapEntry, kept - 1).inode == entry->inode) {
+            continue;
+        }
+        g_array_index(entries, RmFsMapEntry, kept++) = *entry;
+    }
+    g_array_set_size(entries, kept);
+}
+
+RmFsMap *rm_fsmap_new(int fd) {
+    /* ext4 implements GETFSMAP too, but reports its file data as owned by
+     * nobody in particular (FMR_OWN_UNKNOWN), so only xfs maps inodes */
+    struct statfs fs;
+    if(fstatfs(fd, &fs) == -1 || fs.f_type != XFS_SUPER_MAGIC) {
+        return NULL;
+    }
+
+    struct fsmap_head *head = g_malloc0(fsmap_sizeof(RM_FSMAP_BATCH));
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(RmFsMapEntry));
+    guint since_compact = 0;
+    bool success = FALSE;
+
+    /* query the whole filesystem; high key is all ones */
+    head->fmh_count = RM_FSMAP_BATCH;
+    head->fmh_keys[1].fmr_device = G_MAXUINT32;
+    head->fmh_keys[1].fmr_flags = G_MAXUINT32;
+    head->fmh_keys[1].fmr_physical = G_MAXUINT64;
+    head->fmh_keys[1].fmr_owner = G_MAXUINT64;
+    head->fmh_keys[1].fmr_offset = G_MAXUINT64;
+
+    while(TRUE) {
+        if(ioctl(fd, FS_IOC_GETFSMAP, head) == -1) {
+            /* usually EPERM (needs CAP_SYS_ADMIN) or EOPNOTSUPP (xfs
+             * without rmapbt); caller falls back to FIEMAP */
+            rm_log_debug_line("FS_IOC_GETFSMAP failed: %s", g_strerror(errno));
+            break;
+        }
+
+        if(head->fmh_entries == 0) {
+            success = TRUE;
+            break;
+        }
+
+        for(guint i = 0; i < head->fmh_entries; ++i) {
+            struct fsmap *rec = &head->fmh_recs[i];
+            if(rec->fmr_flags & (FMR_OF_SPECIAL_OWNER | FMR_OF_ATTR_FORK |
+                                 FMR_OF_EXTENT_MAP)) {
+                /* metadata / free space etc; not file data */
+                continue;
+            }
+            RmFsMapEntry entry = {rec->fmr_owner, rec->fmr_offset, rec->fmr_physical};
+            g_array_append_val(entries, entry);
+            if(++since_compact >= RM_FSMAP_COMPACT_EVERY) {
+                rm_fsmap_compact(entries);
+                since_compact = 0;
+            }
+        }
+
+        if(head->fmh_recs[head->fmh_entries - 1].fmr_flags & FMR_OF_LAST) {
+            success = TRUE;
+            break;
+        }
+
+        /* continue after the last record returned */
+        fsmap_advance(head);
+    }
+
+    g_free(head);
+
+    if(!success || entries->len == 0) {
+        g_array_free(entries, TRUE);
+        return NULL;
+    }
+
+    rm_fsmap_compact(entries);
+
+    RmFsMap *self = g_slice_new(RmFsMap);
+    self->entries = entries;
+    return self;
+}
+
+#else
+
+RmFsMap *rm_fsmap_new(_UNUSED int fd) {
+    return NULL;
+}
+
+#endif
+
+bool rm_fsmap_lookup(const RmFsMap *self, RmOff inode, RmOff *physical) {
+    if(self == NULL) {
+        return false;
+    }
+
+    RmFsMapEntry key = {inode, 0, 0};
+    guint index = 0;
+    if(!g_array_binary_search(self->entries, &key,
+                              (GCompareFunc)rm_fsmap_entry_inode_cmp, &index)) {
+        return false;
+    }
+
+    *physical = g_array_index(self->entries, RmFsMapEntry, index).physical;
+    return true;
+}
+
+void rm_fsmap_free(RmFsMap *self) {
+    if(self == NULL) {
+        return;
+    }
+    g_array_free(self->entries, TRUE);
+    g_slice_free(RmFsMap, self);
+}
+
 static gboolean rm_util_is_path_double(char *path1, char *path2) {
     char *basename1 = rm_util_basename(path1);
     char *basename2 = rm_util_basename(path2);
@@ -1158,6 +1659,44 @@ static gboolean rm_util_same_device(const char *path1, const char *path2) {
     return result;
 }
 
+RmLinkType rm_util_link_type_stat(char *path1, RmStat *stat1, char *path2,
+                                  RmStat *stat2) {
+    if(stat1->st_size != stat2->st_size) {
+#if _RM_OFFSET_DEBUG
+        rm_log_debug_line("rm_util_link_type: Files have different sizes: %" G_GUINT64_FORMAT
+                          " <> %" G_GUINT64_FORMAT, stat1->st_size,
+                          stat2->st_size);
+#endif
+        return RM_LINK_WRONG_SIZE;
+    }
+
+    if(stat1->st_dev == stat2->st_dev && stat1->st_ino == stat2->st_ino) {
+        /* hardlinks or maybe even same file */
+        if(strcmp(path1, path2) == 0) {
+            return RM_LINK_SAME_FILE;
+        } else if(rm_util_is_path_double(path1, path2)) {
+            return RM_LINK_PATH_DOUBLE;
+        } else {
+            return RM_LINK_HARDLINK;
+        }
+    }
+
+    if(stat1->st_dev != stat2->st_dev) {
+        /* reflinks must be on same filesystem but not necessarily
+         * same st_dev (btrfs subvolumes have different st_dev's) */
+        if(!rm_util_same_device(path1, path2)) {
+            return RM_LINK_XDEV;
+        }
+    }
+
+    /* If both are symbolic links we do not follow them */
+    if(S_ISLNK(stat1->st_mode) || S_ISLNK(stat2->st_mode)) {
+        return RM_LINK_SYMLINK;
+    }
+
+    return RM_LINK_NONE;
+}
+
 RmLinkType rm_util_link_type(char *path1, char *path2) {
 #if _RM_OFFSET_DEBUG
     rm_log_debug_line("Checking link type for %s vs %s", path1, path2);
@@ -1210,37 +1749,9 @@ RmLinkType rm_util_link_type(char *path1, char *path2) {
         RM_RETURN(RM_LINK_NOT_FILE);
     }
 
-    if(stat1.st_size != stat2.st_size) {
-#if _RM_OFFSET_DEBUG
-        rm_log_debug_line("rm_util_link_type: Files have different sizes: %" G_GUINT64_FORMAT
-                          " <> %" G_GUINT64_FORMAT, stat1.st_size,
-                          stat2.st_size);
-#endif
-        RM_RETURN(RM_LINK_WRONG_SIZE);
-    }
-
-    if(stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino) {
-        /* hardlinks or maybe even same file */
-        if(strcmp(path1, path2) == 0) {
-            RM_RETURN(RM_LINK_SAME_FILE);
-        } else if(rm_util_is_path_double(path1, path2)) {
-            RM_RETURN(RM_LINK_PATH_DOUBLE);
-        } else {
-            RM_RETURN(RM_LINK_HARDLINK);
-        }
-    }
-
-    if(stat1.st_dev != stat2.st_dev) {
-        /* reflinks must be on same filesystem but not necessarily
-         * same st_dev (btrfs subvolumes have different st_dev's) */
-        if(!rm_util_same_device(path1, path2)) {
-            RM_RETURN(RM_LINK_XDEV);
-        }
-    }
-
-    /* If both are symbolic links we do not follow them */
-    if(S_ISLNK(stat1.st_mode) || S_ISLNK(stat2.st_mode)) {
-        RM_RETURN(RM_LINK_SYMLINK);
+    RmLinkType stat_type = rm_util_link_type_stat(path1, &stat1, path2, &stat2);
+    if(stat_type != RM_LINK_NONE) {
+        RM_RETURN(stat_type);
     }
 
 #if HAVE_FIEMAP
@@ -103,6 +103,14 @@ WARN_UNUSED_RESULT static inline int rm_sys_lstat(const char *path, RmStat *buf)
 #endif
 }
 
+WARN_UNUSED_RESULT static inline int rm_sys_fstat(int fd, RmStat *buf) {
+#if HAVE_STAT64 && !RM_IS_APPLE
+    return fstat64(fd, buf);
+#else
+    return fstat(fd, buf);
+#endif
+}
+
 static inline gdouble rm_sys_stat_mtime_float(RmStat *stat) {
 #if RM_IS_APPLE
     return (gdouble)stat->st_mtimespec.tv_sec + stat->st_mtimespec.tv_nsec / 1000000000.0;
@@ -123,6 +131,16 @@ static inline int rm_sys_open(const char *path, int mode) {
     return open(path, mode, (S_IRUSR | S_IWUSR));
 }
 
+static inline int rm_sys_openat(int dirfd, const char *path, int mode) {
+#if HAVE_STAT64
+#ifdef O_LARGEFILE
+    mode |= O_LARGEFILE;
+#endif
+#endif
+
+    return openat(dirfd, path, mode, (S_IRUSR | S_IWUSR));
+}
+
 static inline void rm_sys_close(int fd) {
     if(close(fd) == -1) {
         rm_log_perror("close(2) failed");
@@ -381,6 +399,36 @@ void rm_mounts_table_destroy(RmMountTable *self);
  */
 bool rm_mounts_is_nonrotational(RmMountTable *self, dev_t device);
 
+/* Ideal number of concurrent readers per kind of disk */
+#define RM_QUEUE_DEPTH_ROTATIONAL (1)
+#define RM_QUEUE_DEPTH_SSD (4)
+#define RM_QUEUE_DEPTH_NVME (16)
+
+/**
+ * @brief Get the number of concurrent readers the disk behind device performs
+ * best with; detected from /sys/block/<disk>/queue (rotational, nr_requests)
+ * and the kind of device (NVMe or not).
+ *
+ * @param self the table to lookup from.
+ * @param device the dev_t of a file or disk.
+ *
+ * @return the queue depth (>= 1).
+ */
+gint rm_mounts_get_queue_depth(RmMountTable *self, dev_t device);
+
+/**
+ * @brief Override the detected queue depth of the disk behind device,
+ * e.g. with a measured one (see rm_calibrate_apply_profiles).
+ */
+void rm_mounts_set_queue_depth(RmMountTable *self, dev_t device, gint queue_depth);
+
+/**
+ * @brief Get the name of the disk behind device ("sda", "nvme0n1", ...).
+ *
+ * @return the name (owned by the table) or NULL if unknown.
+ */
+const char *rm_mounts_get_disk_name(RmMountTable *self, dev_t device);
+
 /**
  * @brief Get the disk behind the partition.
  *
@@ -428,12 +476,127 @@ RmOff rm_offset_get_from_fd(int fd, RmOff file_offset, RmOff *file_offset_next,
 RmOff rm_offset_get_from_path(const char *path, RmOff file_offset,
                               RmOff *file_offset_next);
 
+/**
+ * @brief Complete logical -> physical mapping of a file, merged into runs of
+ * contiguous extents.  Built once so that repeated offset lookups (eg. once per
+ * hashing increment) do not need another FS_IOC_FIEMAP call each.
+ */
+typedef struct RmExtentMap RmExtentMap;
+
+/**
+ * @brief Read the extent map of fd.
+ *
+ * @return a new map (free with rm_extent_map_free) or NULL if unavailable.
+ */
+RmExtentMap *rm_extent_map_new(int fd);
+
+/**
+ * @brief Same as rm_extent_map_new, but opens path itself.
+ */
+RmExtentMap *rm_extent_map_new_from_path(const char *path);
+
+/**
+ * @brief Lookup the physical offset of the data at (or, in case of a hole,
+ * following) file_offset.
+ *
+ * @return the physical offset, or 0 if map is NULL.
+ */
+RmOff rm_extent_map_lookup(const RmExtentMap *map, RmOff file_offset);
+
+/**
+ * @brief Check if a and b map every logical offset to the same physical
+ * location, ie. the files are reflinks of each other and have identical
+ * content.  Always false for NULL maps and maps with extents that don't
+ * have a location of their own (inline, compressed, not yet allocated...).
+ * Only meaningful for files on the same filesystem.
+ */
+bool rm_extent_map_equal(const RmExtentMap *a, const RmExtentMap *b);
+
+/**
+ * @brief Check if map can be compared at all (see rm_extent_map_equal);
+ * false for NULL.
+ */
+bool rm_extent_map_comparable(const RmExtentMap *map);
+
+/**
+ * @brief Count how many bytes from offset on (up to len) a and b already
+ * share, ie. map to the same physical location (or are a hole in both).
+ * Like rm_extent_map_equal, 0 for NULL maps and maps that are not comparable.
+ *
+ * @return length of the shared range starting at offset.
+ */
+RmOff rm_extent_map_shared(const RmExtentMap *a, const RmExtentMap *b, RmOff offset,
+                           RmOff len);
+
+/**
+ * @brief Decide from the extent maps of two files (as far as their stat did
+ * not already, see rm_util_link_type_stat) if they are reflinks.
+ *
+ * Gives the same answer as rm_util_link_type for the same files.
+ *
+ * @return RM_LINK_REFLINK, RM_LINK_NONE or RM_LINK_MAYBE_REFLINK if the
+ * extents match but don't tell for sure.
+ */
+RmLinkType rm_extent_map_link_type(const RmExtentMap *a, const RmExtentMap *b);
+
+/**
+ * @brief Hash value of map, consistent with rm_extent_map_equal.
+ *
+ * @return the hash, or 0 if map is never equal to any other map.
+ */
+guint rm_extent_map_hash(const RmExtentMap *map);
+
+/**
+ * @brief Free a map returned by rm_extent_map_new; NULL is allowed.
+ */
+void rm_extent_map_free(RmExtentMap *map);
+
+/////////////////////////////////
+//     FSMAP IMPLEMENTATION     //
+/////////////////////////////////
+
+/**
+ * @brief Map of inode -> physical offset of its first data extent for a whole
+ * filesystem, read via ioctl(FS_IOC_GETFSMAP).  Only xfs reports the inode
+ * owning each extent, so other filesystems get no map.
+ */
+typedef struct RmFsMap RmFsMap;
+
+/**
+ * @brief Read the space map of the filesystem that fd lives on.
+ *
+ * @return a new map (free with rm_fsmap_free) or NULL if the filesystem is not
+ * xfs, does not support GETFSMAP or we lack the privileges (CAP_SYS_ADMIN) to
+ * use it.
+ */
+RmFsMap *rm_fsmap_new(int fd);
+
+/**
+ * @brief Lookup the physical offset of the start of inode's data.
+ *
+ * @return true if found (result is written to *physical).
+ */
+bool rm_fsmap_lookup(const RmFsMap *self, RmOff inode, RmOff *physical);
+
+/**
+ * @brief Free a map returned by rm_fsmap_new; NULL is allowed.
+ */
+void rm_fsmap_free(RmFsMap *self);
+
 /**
  * @brief Test if two files have identical fiemaps.
  * @retval see RmOffsetsMatchCode enum definition.
  */
 RmLinkType rm_util_link_type(char *path1, char *path2);
 
+/**
+ * @brief The part of rm_util_link_type that only needs the (lstat) stat of
+ * two regular files.
+ * @retval RM_LINK_NONE if only their extents can tell, else see RmLinkType.
+ */
+RmLinkType rm_util_link_type_stat(char *path1, RmStat *stat1, char *path2,
+                                  RmStat *stat2);
+
 //////////////////////////////
 //    TIMESTAMP HELPERS     //
 //////////////////////////////
@@ -140,6 +140,8 @@ int main(int argc, const char **argv) {
             exit_state = rm_session_dedupe_main(&cfg);
         } else if(cfg.is_reflink) {
             exit_state = rm_session_is_reflink_main(&cfg);
+        } else if(cfg.calibrate) {
+            exit_state = rm_calibrate_main(&session);
         } else {
             exit_state = rm_cmd_main(&session);
         }
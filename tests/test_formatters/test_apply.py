@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+from tests.utils import *
+
+
+def _replay_apply(replay_path, *config):
+    args = ['--replay', replay_path]
+    for value in config:
+        args += ['-c', 'apply:' + value]
+
+    *_, log = run_rmlint(*args, outputs=['apply'])
+    return log
+
+
+def test_apply_remove(usual_setup_usual_teardown):
+    create_file('xxx', 'a')
+    create_file('xxx', 'b')
+    create_file('xxx', 'sub/c')
+    create_file('', 'empty')
+
+    replay_path = os.path.join(TESTDIR_NAME, 'replay.json')
+    run_rmlint('-S a -o json:{p}'.format(p=replay_path))
+
+    # dry run must not touch anything
+    log = _replay_apply(replay_path, 'dry_run')
+    assert 'Deleting: ' + os.path.join(TESTDIR_NAME, 'b') in log
+    for name in ('a', 'b', 'sub/c', 'empty'):
+        assert os.path.exists(os.path.join(TESTDIR_NAME, name))
+
+    sub_mtime = os.stat(os.path.join(TESTDIR_NAME, 'sub')).st_mtime
+    _replay_apply(replay_path, 'paranoid', 'keep_dir_timestamps')
+
+    assert os.path.exists(os.path.join(TESTDIR_NAME, 'a'))
+    for name in ('b', 'sub/c', 'empty'):
+        assert not os.path.exists(os.path.join(TESTDIR_NAME, name))
+    assert os.stat(os.path.join(TESTDIR_NAME, 'sub')).st_mtime == sub_mtime
+
+
+def test_apply_hardlink(usual_setup_usual_teardown):
+    path_a = create_file('xxx', 'a')
+    path_b = create_file('xxx', 'b')
+
+    replay_path = os.path.join(TESTDIR_NAME, 'replay.json')
+    run_rmlint('-S a -o json:{p}'.format(p=replay_path))
+
+    _replay_apply(replay_path, 'handler=hardlink')
+    assert os.stat(path_a).st_ino == os.stat(path_b).st_ino
+
+    # second time round there is nothing left to do
+    log = _replay_apply(replay_path, 'handler=hardlink')
+    assert 'already hardlinked' in log
+
+
+def test_apply_paranoid_mismatch(usual_setup_usual_teardown):
+    create_file('xxx', 'a')
+    path_b = create_file('xxx', 'b')
+
+    replay_path = os.path.join(TESTDIR_NAME, 'replay.json')
+    run_rmlint('-S a -o json:{p}'.format(p=replay_path))
+
+    # b changed since the json was written (but kept its mtime, so
+    # --replay does not notice)
+    stamp = os.stat(path_b)
+    with open(path_b, 'w') as handle:
+        handle.write('yyy')
+    os.utime(path_b, ns=(stamp.st_atime_ns, stamp.st_mtime_ns))
+
+    log = _replay_apply(replay_path, 'paranoid', 'handler=symlink')
+    assert 'no longer identical' in log
+    assert not os.path.islink(path_b)
+
+
+def test_apply_needs_replay_or_handler(usual_setup_usual_teardown):
+    path_a = create_file('xxx', 'a')
+    path_b = create_file('xxx', 'b')
+
+    # a plain scan must not delete anything behind the user's back
+    *_, log = run_rmlint('-S a', outputs=['apply'])
+    assert 'Deleting: ' + path_b in log
+    assert os.path.exists(path_a)
+    assert os.path.exists(path_b)
@@ -139,3 +139,108 @@ def test_clone_handler(usual_setup_usual_teardown, needs_reflink_fs):
     counts = pattern_count(sh_path, ["^clone *'", "^skip_reflink *'"])
     assert counts[0] == 0
     assert counts[1] == 1
+
+
+def test_dedupe_batch(usual_setup_usual_teardown, needs_reflink_fs):
+    # test files need to be larger than btrfs node size to prevent inline extents
+    paths = [create_file('1' * 100000, name) for name in 'abc']
+    json_path = os.path.join(TESTDIR_NAME, 'out.json')
+
+    run_rmlint('-S a -o json:{p}'.format(p=json_path), with_json=False)
+
+    with assert_exit_code(0):
+        run_rmlint(
+            '--dedupe-batch', json_path,
+            use_default_dir=False,
+            with_json=False,
+            verbosity=""
+        )
+
+    for path in paths[1:]:
+        with assert_exit_code(0):
+            run_rmlint(
+                '--is-reflink', paths[0], path,
+                use_default_dir=False,
+                with_json=False,
+                verbosity=""
+            )
+
+
+def test_dedupe_hardlink(usual_setup_usual_teardown, needs_reflink_fs):
+    path_a = create_file('1' * 100000, 'a')
+    create_link('a', 'b', symlink=False)
+    path_b = os.path.join(TESTDIR_NAME, 'b')
+
+    # a hardlink already shares everything; nothing to do, no error
+    with assert_exit_code(0):
+        run_rmlint(
+            '--dedupe', path_a, path_b,
+            use_default_dir=False,
+            with_json=False,
+            verbosity=""
+        )
+
+
+def _dedupe_log(path_a, path_b):
+    result = subprocess.run(
+        ['./rmlint', '-vv', '--dedupe', path_a, path_b],
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE
+    )
+    return result.returncode, result.stderr.decode('utf-8')
+
+
+def test_dedupe_skips_shared_chunks(usual_setup_usual_teardown, needs_reflink_fs):
+    # a bit more than one 16M chunk, so the head is a whole chunk
+    size = 20 * 1024 * 1024
+    tail = 1024 * 1024
+    path_a = os.path.join(TESTDIR_NAME, 'a')
+    path_b = os.path.join(TESTDIR_NAME, 'b')
+    with open(path_a, 'wb') as handle:
+        handle.write(os.urandom(size))
+    subprocess.run(['cp', '--reflink=never', path_a, path_b], check=True)
+
+    code, log = _dedupe_log(path_a, path_b)
+    assert code == 0
+    assert 'already shared' not in log
+
+    # rewrite the tail of b with the same data: only the tail is unshared now
+    with open(path_a, 'rb') as handle:
+        handle.seek(size - tail)
+        data = handle.read()
+    with open(path_b, 'r+b') as handle:
+        handle.seek(size - tail)
+        handle.write(data)
+    os.sync()
+
+    code, log = _dedupe_log(path_a, path_b)
+    assert code == 0
+    assert 'Skipping 16777216 bytes at 0, already shared with ' + path_b in log
+
+    with assert_exit_code(0):
+        run_rmlint(
+            '--is-reflink', path_a, path_b,
+            use_default_dir=False,
+            with_json=False,
+            verbosity=""
+        )
+
+
+def test_dedupe_incomparable_extents(usual_setup_usual_teardown, needs_reflink_fs):
+    # compressed extents have no physical location of their own
+    path_dir = create_dirs('compressed')
+    try:
+        subprocess.run(['chattr', '+c', path_dir], check=True,
+                       stderr=subprocess.DEVNULL)
+    except (OSError, subprocess.CalledProcessError):
+        pytest.skip('filesystem does not support compression')
+
+    path_a = create_file('1' * 1024 * 1024, 'compressed/a')
+    path_b = create_file('1' * 1024 * 1024, 'compressed/b')
+    os.sync()
+
+    for _ in range(2):
+        # nothing can be skipped, every chunk goes to the kernel
+        code, log = _dedupe_log(path_a, path_b)
+        assert code == 0
+        assert "Can't compare extents" in log
+        assert 'already shared' not in log
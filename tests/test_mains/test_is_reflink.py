@@ -183,3 +183,101 @@ def test_default_outputs_disabled(usual_setup_usual_teardown):
         assert not os.path.exists('rmlint.json')
     finally:
         os.chdir(cwd)
+
+
+def test_batch(usual_setup_usual_teardown):
+    path_a = create_file('xxx', 'a')
+    path_b = create_file('xxxx', 'b')
+    path_c = create_dirs('c')
+    create_link('a', 'a_hardlink', symlink=False)
+    pairs = [
+        (path_a, path_a + '_hardlink'),  # RM_LINK_HARDLINK
+        (path_a, path_b),                # RM_LINK_WRONG_SIZE
+        (path_a, path_c),                # RM_LINK_NOT_FILE
+    ]
+
+    proc = subprocess.Popen(
+        ['./rmlint', '--is-reflink-batch'],
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE
+    )
+    data, _ = proc.communicate(
+        ''.join(a + '\n' + b + '\n' for a, b in pairs).encode('utf-8')
+    )
+    assert proc.returncode == 1
+
+    lines = [line.split('\t') for line in data.decode('utf-8').splitlines()]
+    assert lines == [
+        ['8', *pairs[0]],
+        ['4', *pairs[1]],
+        ['3', *pairs[2]],
+    ]
+
+
+def test_batch_reflinks(usual_setup_usual_teardown, needs_reflink_fs):
+    path_a = os.path.join(TESTDIR_NAME, 'a')
+    _run_dd_urandom(path_a, '4K', 4)
+    for name in 'bc':
+        subprocess.run(['cp', '--reflink', path_a, os.path.join(TESTDIR_NAME, name)], check=True)
+
+    json_path = os.path.join(TESTDIR_NAME, 'out.json')
+    run_rmlint('-S a -o json:{p}'.format(p=json_path), with_json=False)
+
+    with open(json_path, 'rb') as handle:
+        proc = subprocess.Popen(
+            ['./rmlint', '--is-reflink-batch'],
+            stdin=handle,
+            stdout=subprocess.PIPE
+        )
+        data, _ = proc.communicate()
+
+    assert proc.returncode == 0
+    assert [line.split('\t')[0] for line in data.decode('utf-8').splitlines()] == ['0', '0']
+
+
+def _is_reflink_status(path_a, path_b):
+    try:
+        run_rmlint_once(
+            '--is-reflink', path_a, path_b,
+            use_default_dir=False,
+            with_json=False,
+            verbosity=''
+        )
+    except subprocess.CalledProcessError as exc:
+        return exc.returncode
+    return 0
+
+
+def test_batch_matches_single(usual_setup_usual_teardown, needs_reflink_fs):
+    path_a = os.path.join(TESTDIR_NAME, 'a')
+    _run_dd_urandom(path_a, '4K', 4)
+    subprocess.run(['cp', '--reflink', path_a, path_a + '_reflink'], check=True)
+    subprocess.run(['cp', '--reflink', path_a, path_a + '_broken'], check=True)
+    _run_dd_urandom(path_a + '_broken', '4K', 1, 'seek=1 conv=notrunc')
+    subprocess.run(['cp', path_a, path_a + '_copy'], check=True)
+
+    # small enough to be stored inline on btrfs
+    path_s = create_file('xxx', 's')
+    subprocess.run(['cp', '--reflink', path_s, path_s + '_reflink'], check=True)
+
+    pairs = [
+        (path_a, path_a + '_reflink'),
+        (path_a, path_a + '_broken'),
+        (path_a, path_a + '_copy'),
+        (path_s, path_s + '_reflink'),
+    ]
+
+    proc = subprocess.Popen(
+        ['./rmlint', '--is-reflink-batch'],
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE
+    )
+    data, _ = proc.communicate(
+        ''.join(a + '\n' + b + '\n' for a, b in pairs).encode('utf-8')
+    )
+
+    lines = [line.split('\t') for line in data.decode('utf-8').splitlines()]
+    assert lines == [
+        [str(_is_reflink_status(a, b)), a, b] for a, b in pairs
+    ]
+    assert lines[0][0] == '0'
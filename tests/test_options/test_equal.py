@@ -143,3 +143,30 @@ def test_default_outputs_disabled(usual_setup_usual_teardown):
         assert not os.path.exists('rmlint.json')
     finally:
         os.chdir(cwd)
+
+
+def test_equal_without_output(usual_setup_usual_teardown):
+    # Without other outputs --equal compares the files directly.
+    data = 'x' * (512 * 1024)
+    path_a = create_file(data, 'a')
+    path_b = create_file(data, 'b')
+    path_c = create_file(data[:-1] + 'y', 'c')
+    path_d = create_file(data[:-1], 'd')
+    path_e = os.path.join(TESTDIR_NAME, 'e')
+    os.link(path_a, path_e)
+
+    with assert_exit_code(0):
+        run_rmlint('--equal', path_a, path_b, path_e, use_default_dir=False, with_json=False)
+
+    with assert_exit_code(0):
+        run_rmlint('--equal', path_a, path_a, use_default_dir=False, with_json=False)
+
+    with assert_exit_code(1):
+        run_rmlint('--equal', path_a, path_b, path_c, use_default_dir=False, with_json=False)
+
+    with assert_exit_code(1):
+        run_rmlint('--equal', path_d, path_a, use_default_dir=False, with_json=False)
+
+    # directories still go through the normal run
+    with assert_exit_code(1):
+        run_rmlint('--equal', path_a, TESTDIR_NAME, use_default_dir=False, with_json=False)
@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+from tests.utils import *
+
+
+def _dedupe(path_a, path_b):
+    with assert_exit_code(0):
+        run_rmlint(
+            '--dedupe', path_a, path_b,
+            use_default_dir=False,
+            with_json=False,
+            verbosity=""
+        )
+
+
+def test_keep_reflinks(usual_setup_usual_teardown, needs_reflink_fs):
+    # test files need to be larger than btrfs node size to prevent inline extents
+    create_file('1' * 100000, 'file_a')
+    create_file('1' * 100000, 'file_b')
+    create_file('1' * 100000, 'file_z')
+    _dedupe(os.path.join(TESTDIR_NAME, 'file_a'), os.path.join(TESTDIR_NAME, 'file_b'))
+
+    # reflinks are still reported as duplicates by default
+    head, *data, footer = run_rmlint('-S a')
+    assert [d["path"][-6:] for d in data] == ['file_a', 'file_b', 'file_z']
+    assert [d["is_original"] for d in data] == [True, False, False]
+
+    head, *data, footer = run_rmlint('--keep-reflinked -S a')
+    assert [d["path"][-6:] for d in data] == ['file_a', 'file_b', 'file_z']
+    assert [d["is_original"] for d in data] == [True, True, False]
+
+
+def test_only_reflinks(usual_setup_usual_teardown, needs_reflink_fs):
+    # a group consisting of reflinks only is found without hashing
+    create_file('1' * 100000, 'file_a')
+    create_file('1' * 100000, 'file_b')
+    _dedupe(os.path.join(TESTDIR_NAME, 'file_a'), os.path.join(TESTDIR_NAME, 'file_b'))
+
+    head, *data, footer = run_rmlint('-S a')
+    assert len(data) == 2
+    assert footer['duplicates'] == 1
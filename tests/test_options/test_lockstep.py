@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+from tests.utils import *
+
+
+def test_lockstep(usual_setup_usual_teardown):
+    create_file('xxx', 'file_a')
+    create_file('xxx', 'file_b')
+    create_link('file_a', 'file_c')
+    create_file('xxy', 'file_d')
+
+    for options in ['--lockstep', '-pp --lockstep']:
+        head, *data, footer = run_rmlint(options + ' --hardlinked -S a')
+        assert len(data) == 3
+        assert [os.path.basename(f["path"]) for f in data] == ['file_a', 'file_b', 'file_c']
+        assert all(f["type"] == "duplicate_file" for f in data)
+        assert footer['duplicates'] == 2
+
+
+def test_lockstep_late_difference(usual_setup_usual_teardown):
+    # differ only in the last byte, well past the first few blocks
+    create_file('x' * 300000 + 'a', 'file_a')
+    create_file('x' * 300000 + 'a', 'file_b')
+    create_file('x' * 300000 + 'b', 'file_c')
+
+    head, *data, footer = run_rmlint('-pp --lockstep --read-buffer-len 4K -S a')
+    assert len(data) == 2
+    assert [os.path.basename(f["path"]) for f in data] == ['file_a', 'file_b']
+
+
+def test_lockstep_hash_collision(usual_setup_usual_teardown):
+    # the cumulative digest xors aligned words, so swapping two blocks
+    # gives file_c the same checksum as file_a and file_b
+    create_file('a' * 64 + 'b' * 64, 'file_a')
+    create_file('a' * 64 + 'b' * 64, 'file_b')
+    create_file('b' * 64 + 'a' * 64, 'file_c')
+
+    # without lockstep the collision goes unnoticed
+    head, *data, footer = run_rmlint('-a cumulative -S a')
+    assert len(data) == 3
+
+    head, *data, footer = run_rmlint('-a cumulative --lockstep -S a')
+    assert len(data) == 2
+    assert [os.path.basename(f["path"]) for f in data] == ['file_a', 'file_b']
+    assert footer['duplicates'] == 1
+
+
+def test_lockstep_limit_read_rate(usual_setup_usual_teardown):
+    # the byte-by-byte reads are paced by the device throttle too
+    create_file('x' * 300000 + 'a', 'file_a')
+    create_file('x' * 300000 + 'a', 'file_b')
+    create_file('x' * 300000 + 'b', 'file_c')
+
+    head, *data, footer = run_rmlint('--lockstep --limit-read-rate 100M -S a')
+    assert [os.path.basename(f["path"]) for f in data] == ['file_a', 'file_b']
@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+from tests.utils import *
+
+
+def test_file_also_in_traversed_dir(usual_setup_usual_teardown):
+    path_a = create_file('xxx', 'dir/a')
+
+    # dir/a is found twice (directly and in dir); it must not be its own duplicate
+    head, *data, footer = run_rmlint(
+        '--pipeline -x', path_a, force_no_pendantic=True
+    )
+    assert len(data) == 0
+
+
+def test_file_also_in_traversed_dir_with_dupe(usual_setup_usual_teardown):
+    path_a = create_file('xxx', 'dir/a')
+    create_file('xxx', 'dir/b')
+    create_link('dir/a', 'dir/a_hardlink', symlink=False)
+
+    head, *data, footer = run_rmlint(
+        '--pipeline -x -S a', path_a, force_no_pendantic=True
+    )
+
+    paths = sorted(p['path'] for p in data)
+    assert paths == sorted([
+        path_a,
+        path_a + '_hardlink',
+        os.path.join(TESTDIR_NAME, 'dir/b'),
+    ])
+    assert footer['duplicates'] == 2
@@ -172,11 +172,11 @@ def test_sort_by_regex_bad_input(usual_setup_usual_teardown):
     create_file('xxx', 'aaab')
 
     # Should work:
-    run_rmlint("-S '{}'".format('r<.>' * 8))
+    run_rmlint("-S '{}'".format('r<.>' * 63))
 
-    # More than 8 is bad:
+    # More than 63 is bad:
     try:
-        run_rmlint("-S '{}'".format('r<.>' * 9))
+        run_rmlint("-S '{}'".format('r<.>' * 64))
         assert False
     except subprocess.CalledProcessError:
         pass
@@ -0,0 +1,83 @@
+/*
+ *  This file is part of rmlint.
+ *
+ *  rmlint is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  rmlint is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rmlint.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *
+ *  - Christopher <sahib> Pahl 2010-2020 (https://github.com/sahib)
+ *  - Daniel <SeeSpotRun> T.   2014-2020 (https://github.com/SeeSpotRun)
+ *
+ * Hosted on http://github.com/sahib/rmlint
+ *
+ */
+
+/* Microbenchmark for the md-scheduler: pushes a lot of tasks with scattered
+ * offsets through a single fake rotational device while the worker drains them.
+ *
+ * Build: scons bench-mds
+ * Usage: tests/test_speed/mds_bench [n_tasks (default 10M)] [threads_per_disk]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../lib/config.h"
+#include "../../lib/md-scheduler.h"
+
+static gint rm_bench_task(RmMDSDevice *device, _UNUSED gpointer user_data) {
+    rm_mds_device_ref(device, -1);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    guint64 n_tasks = (argc > 1) ? g_ascii_strtoull(argv[1], NULL, 10) : 10 * 1000 * 1000;
+    gint threads_per_disk = (argc > 2) ? atoi(argv[2]) : 1;
+
+    if(n_tasks == 0 || threads_per_disk < 1) {
+        fprintf(stderr, "Usage: %s [n_tasks] [threads_per_disk]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* fake_disk: even numbers are rotational, no mount table needed */
+    RmMDS *mds = rm_mds_new(threads_per_disk, NULL, true);
+    rm_mds_configure(mds, (RmMDSFunc)rm_bench_task, NULL, 0, threads_per_disk,
+                     (RmMDSSortFunc)rm_mds_elevator_cmp);
+
+    RmMDSDevice *device = rm_mds_device_get(mds, NULL, 2);
+    rm_mds_device_ref(device, n_tasks);
+    rm_mds_start(mds);
+
+    gint64 start = g_get_monotonic_time();
+
+    /* cheap LCG so runs are reproducible */
+    guint64 offset = 1;
+    for(guint64 i = 0; i < n_tasks; ++i) {
+        offset = offset * 6364136223846793005ULL + 1442695040888963407ULL;
+        rm_mds_push_task(device, 2, (offset >> 20), NULL, device);
+    }
+
+    gint64 pushed = g_get_monotonic_time();
+    rm_mds_finish(mds);
+    gint64 done = g_get_monotonic_time();
+
+    rm_mds_free(mds, FALSE);
+
+    printf("tasks:      %" G_GUINT64_FORMAT "\n", n_tasks);
+    printf("push:       %.3fs\n", (pushed - start) / (gdouble)G_USEC_PER_SEC);
+    printf("total:      %.3fs\n", (done - start) / (gdouble)G_USEC_PER_SEC);
+    printf("throughput: %.0f tasks/s\n",
+           n_tasks / ((done - start) / (gdouble)G_USEC_PER_SEC));
+    return EXIT_SUCCESS;
+}
@@ -91,3 +91,38 @@ def test_two_external_hardlinks(usual_setup_usual_teardown):
     # No effective lint: Removing any link will not save any disk space.
     assert len(data) == 2
     assert footer['total_lint_size'] == 0
+
+
+def test_sparse_file(usual_setup_usual_teardown):
+    # holes are hashed as zeros without reading them; the result must be the
+    # same as for a file where the zeros are actually written to disk
+    size = 8 * 1024 * 1024
+    with open(os.path.join(TESTDIR_NAME, 'sparse'), 'wb') as handle:
+        handle.write(b'x' * 4096)
+        handle.seek(size // 2)
+        handle.write(b'y' * 4096)
+        handle.truncate(size)
+
+    dense = bytearray(size)
+    dense[:4096] = b'x' * 4096
+    dense[size // 2:size // 2 + 4096] = b'y' * 4096
+    with open(os.path.join(TESTDIR_NAME, 'dense'), 'wb') as handle:
+        handle.write(dense)
+
+    for algo in ('sha1', 'blake2b', 'paranoid'):
+        head, *data, footer = run_rmlint('-S a -a {}'.format(algo))
+        assert len(data) == 2
+        assert data[0]['checksum'] == data[1]['checksum']
+
+
+def test_paranoid_over_mem_budget(usual_setup_usual_teardown):
+    # groups too large for the paranoid memory budget are compared block by block;
+    # this must still catch a difference in the very last byte
+    size = 4 * 1024 * 1024
+    for name, last in (('a', b'a'), ('b', b'a'), ('c', b'b')):
+        with open(os.path.join(TESTDIR_NAME, name), 'wb') as handle:
+            handle.write(b'x' * (size - 1) + last)
+
+    head, *data, footer = run_rmlint('-S a -pp --limit-mem 1M')
+    assert len(data) == 2
+    assert [os.path.basename(f['path']) for f in data] == ['a', 'b']
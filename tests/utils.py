@@ -260,6 +260,7 @@ def run_rmlint_pedantic(*args, **kwargs):
         '--threads=1',
         '--shred-never-wait',
         '--shred-always-wait',
+        '--pipeline --no-crossdev',
         '--no-mount-table'
     ]
 